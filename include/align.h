@@ -1,58 +1,69 @@
+/*
+ * CNRSIM
+ * align.h
+ * Aligns a read to a window of the reference,
+ * the whole read against any substring of the
+ * reference with unitary edit costs, yielding
+ * the same alignment codes of edlib.
+ *
+ * @author Riccardo Massidda
+ */
 #ifndef ALIGN
 #define ALIGN
+#include <stdint.h>
 
 typedef struct aligner_t aligner_t;
 
-enum error {
-    GAP = -1,
-    MATCH = 1,
-    MISMATCH = 0
+// Alignment codes
+enum operation {
+    AL_MATCH = 0,
+    AL_INSERTION = 1, // character of the read only
+    AL_DELETION = 2, // character of the reference only
+    AL_MISMATCH = 3
 };
 
+/*
+ * The buffers are reused between
+ * alignments and grow on demand.
+ */
 struct aligner_t {
-    char * reference; // reference
-    char * read; // read
-    int ref_len; // length of the reference (zero-included)
-    int read_len; // length of the read ( zero-included )
-    void * nw; // Needleman–Wunsch matrix
-    void * op; // matrix operations
-    char * alignment; // result of the alignment
-    int start; // start position of the alignment
+    uint64_t * bits; // pattern bitvectors and column state
+    int bits_size;
+    int * rows; // rows of the banded matrix
+    int rows_size;
+    int * matrix; // matrix of the small subproblems
+    unsigned char * alignment; // result of the alignment
+    int alignment_size;
+    int length; // length of the alignment
+    int start; // start position of the alignment in the reference
+    int distance; // edit distance
 };
 
 /*
  * Initalize the structure used by the aligner
  *
- * @param s1 first sequence
- * @param s2 second sequence
- * @param aligner previously allocated structure to be reused
  * @ret initialized structure, NULL if error
  */
-aligner_t * al_init ( aligner_t * aligner_t, char * reference, int reference_length, char * read );
+aligner_t * al_init ( );
 
 /*
- * Populates the matrix
+ * Aligns the whole read to the substring of the
+ * reference with the minimum edit distance.
+ * The distances are computed column by column
+ * with the bit-parallel algorithm of Myers and
+ * Hyyro, the alignment is traced back in linear
+ * memory following Hirschberg and restricting
+ * each subproblem to the band allowed by its
+ * distance. Comparisons are case insensitive.
  *
- * @param al pointer to the aligner
- */
-void __align ( aligner_t * al ) ;
-
-/*
- * Computes the alignment string
- *
- * @param al pointer to the aligner
- * @ret alignment string
- */
-char * build_alignment ( aligner_t * al ) ;
-
-char * alignment ( aligner_t * al ) ;
-
-/*
- * Prints the matrixes.
- *
- * @param al pointer to the aligner
+ * @param read          read to be aligned
+ * @param read_len      length of the read
+ * @param reference     window of the reference
+ * @param ref_len       length of the window
+ * @param al            pointer to the aligner
+ * @ret edit distance, -1 if error
  */
-void dump ( aligner_t * al );
+int al_align ( char * read, int read_len, char * reference, int ref_len, aligner_t * al );
 
 /*
  * Frees the memory
@@ -9,13 +9,35 @@
 #ifndef VARIATOR_H
 #define VARIATOR_H
 #include <stdbool.h>
+#include <stdio.h>
+
+// Size of the sequence buffer of a streamed allele
+#define ALLELE_BUFFER ( 1 << 20 )
 
 typedef struct allele_t allele_t;
+typedef struct allele_run_t allele_run_t;
+
+/*
+ * Run of the same operation in the alignment
+ * of the allele against the reference, with
+ * the coordinates of its first character.
+ */
+struct allele_run_t {
+    long int alg; // alignment position
+    long int pos; // allele position
+    long int ref; // reference position
+    long int len; // length of the run
+    char op; // '=', 'X', 'I' or 'D'
+};
 
 struct allele_t {
     char * sequence; // pointer to the mutated sequence
-    char * alignment; // pointer to the alignment of the sequence
+    allele_run_t * run; // run-length encoded alignment, NULL if equal to the reference
+    long int n_run; // number of runs
+    long int run_size; // allocated runs
     long int buffer_size; // size of the sequence
+    FILE * output; // file where the sequence is streamed, or NULL
+    long int flushed; // characters of the sequence already written
     long int pos; // current position
     long int ref; // corresponding reference position
     long int alg; // corresponding alignment position
@@ -30,23 +52,78 @@ struct allele_t {
  */
 allele_t * allele_init ( long int size, allele_t * allele );
 
+/*
+ * Initialize an allele whose sequence is written
+ * to a file as it's built, through a buffer of
+ * fixed size. The alignment is kept in memory.
+ *
+ * @param output file where the sequence is written
+ * @param allele allele to be initialized, or NULL
+ * @returns the initialized structure
+ */
+allele_t * allele_stream ( FILE * output, allele_t * allele );
+
+/*
+ * Writes the buffered sequence
+ * of a streamed allele.
+ *
+ * @param allele pointer to the structure
+ * @return       0 on success, -1 otherwise
+ */
+int allele_flush ( allele_t * allele );
+
 /*
  * Initialize an allele without allocating memory,
  * using pointer to external arrays.
  *
  * @param size size of the reference
  * @param sequence sequence
- * @param alignment string containing the alignment
+ * @param run alignment of the sequence, or NULL
+ * @param n_run number of runs in the alignment
  * @param allele allele to be initialized
  * @returns the initialized structure
  */
-allele_t * allele_point ( long int size, char * sequence, char * alignment, allele_t * allele );
+allele_t * allele_point ( long int size, char * sequence, allele_run_t * run, long int n_run, allele_t * allele );
+
+/*
+ * Appends characters to the alignment of
+ * the allele, advancing its positions.
+ *
+ * @param op     alignment operation
+ * @param len    number of characters
+ * @param allele pointer to the structure
+ * @return       0 on success, -1 otherwise
+ */
+int allele_append ( char op, long int len, allele_t * allele );
+
+/*
+ * Builds the runs of an alignment, written either
+ * as a CIGAR string with the operations =, X, I, D
+ * or with a character per operation.
+ *
+ * @param s         alignment string
+ * @param compact   true if s is a CIGAR string
+ * @param n_run     number of runs
+ * @returns         allocated runs, NULL if error
+ */
+allele_run_t * allele_parse ( char * s, bool compact, long int * n_run );
+
+/*
+ * Writes the alignment of the allele
+ * as a CIGAR string.
+ *
+ * @param file   pointer to the file
+ * @param allele pointer to the structure
+ */
+void allele_write ( FILE * file, allele_t * allele );
 
 /*
  * Sets the allele pointers to the position
  * corresponding to the required reference
- * or allelic position.
- * This function must be used with rising input.
+ * or allelic position, i.e. to the first
+ * alignment character where the position
+ * is reached by an operation consuming it.
+ * The positions can be required in any order.
  *
  * @param       position
  * @param       is the position relative to the reference
@@ -54,6 +131,27 @@ allele_t * allele_point ( long int size, char * sequence, char * alignment, alle
  */
 int allele_seek ( int position, bool from_reference, allele_t * allele );
 
+/*
+ * Run containing an alignment position,
+ * to iterate over the following ones.
+ *
+ * @param alg    alignment position
+ * @param allele pointer to the structure
+ * @return       index of the run, -1 if out of the alignment
+ */
+long int allele_run ( long int alg, allele_t * allele );
+
+/*
+ * Copies a stretch of the reference
+ * without variations.
+ *
+ * @param ref    reference string
+ * @param len    number of characters
+ * @param allele pointer to the structure
+ * @return       0 on success, -1 otherwise
+ */
+int allele_copy ( char * ref, long int len, allele_t * allele );
+
 /*
  * Applies a variation at the current allele position.
  *
@@ -0,0 +1,81 @@
+/*
+ * CNRSIM
+ * amplification.h
+ * Map from the positions of an amplified
+ * sequence to the positions of the reference,
+ * the amplified nucleotides are synthesized
+ * only when a window is requested.
+ *
+ * @author Riccardo Massidda
+ */
+#ifndef AMPLIFICATION_H
+#define AMPLIFICATION_H
+#include "pack.h"
+
+typedef struct amp_piece_t amp_piece_t;
+typedef struct amp_map_t amp_map_t;
+
+/*
+ * Interval of the amplified sequence, either
+ * copied from the reference or obtained
+ * repeating a motif of the reference.
+ */
+struct amp_piece_t {
+    long amp; // first position in the amplified sequence
+    long ref; // first position in the reference
+    long len; // length in the amplified sequence
+    int period; // length of the repeated motif, 0 if copied
+};
+
+struct amp_map_t {
+    amp_piece_t * piece; // pieces ordered by position
+    long n; // number of pieces
+    long size; // allocated pieces
+    long len; // length of the amplified sequence
+};
+
+/*
+ * Initialize an empty map
+ *
+ * @param       map     map to be reused, or NULL
+ * @returns     the initialized structure, NULL if error
+ */
+amp_map_t * amp_map_init ( amp_map_t * map );
+
+/*
+ * Appends an interval of the reference
+ *
+ * @param       ref     first position in the reference
+ * @param       len     length of the interval
+ * @param       map     map to be extended
+ * @returns     0 on success, -1 otherwise
+ */
+int amp_map_copy ( long ref, long len, amp_map_t * map );
+
+/*
+ * Appends the repetitions of a motif
+ *
+ * @param       ref     position of the motif in the reference
+ * @param       period  length of the motif
+ * @param       len     length of the repetitions
+ * @param       map     map to be extended
+ * @returns     0 on success, -1 otherwise
+ */
+int amp_map_repeat ( long ref, int period, long len, amp_map_t * map );
+
+/*
+ * Synthesizes an interval of the amplified sequence,
+ * clipped to its length, into a NULL terminated string.
+ *
+ * @param       pos     first position of the interval
+ * @param       len     length of the interval
+ * @param       out     buffer of at least len + 1 characters
+ * @param       pack    packed reference
+ * @param       map     map of the amplified sequence
+ * @returns     number of synthesized nucleotides
+ */
+long amp_map_unpack ( long pos, long len, char * out, pack_t * pack, amp_map_t * map );
+
+void amp_map_destroy ( amp_map_t * map );
+
+#endif
@@ -0,0 +1,50 @@
+/*
+ * CNRSIM
+ * encoding.h
+ * Conversions between the representations
+ * of the nucleotides, through lookup tables
+ * or vector instructions if available.
+ *
+ * @author Riccardo Massidda
+ */
+#ifndef ENCODING_H
+#define ENCODING_H
+#include <stdint.h>
+
+// Code of the nucleotides, in any case, 4 for the other characters
+extern const uint8_t enc_code[256];
+// Nucleotide of each code, N for the other values
+extern const char enc_base[256];
+
+/*
+ * Decodes the 4 bit nucleotides of
+ * a BAM record in characters
+ *
+ * @param       nibbles two nucleotides per byte, the first in the high bits
+ * @param       len     number of nucleotides
+ * @param       out     buffer of at least len characters, not terminated
+ */
+void enc_nibbles ( const uint8_t * nibbles, long len, char * out );
+
+/*
+ * Packs the nucleotides in two bits each, the
+ * other characters are packed as A.
+ *
+ * @param       seq     nucleotides
+ * @param       len     number of nucleotides
+ * @param       out     buffer of ( len + 3 ) / 4 bytes, four nucleotides per byte, the first in the high bits
+ */
+void enc_pack ( const char * seq, long len, uint8_t * out );
+
+/*
+ * Unpacks an interval of nucleotides
+ * stored in two bits each
+ *
+ * @param       bases   four nucleotides per byte, the first in the high bits
+ * @param       pos     first position of the interval
+ * @param       len     length of the interval
+ * @param       out     buffer of at least len characters, not terminated
+ */
+void enc_unpack ( const uint8_t * bases, long pos, long len, char * out );
+
+#endif
@@ -10,10 +10,15 @@
 #ifndef MODEL
 #define MODEL
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include "source.h"
 #include "stats.h"
 
+// Binary model format
+#define MODEL_MAGIC "CNRSIMBM"
+#define MODEL_VERSION 4
+
 typedef struct model_t model_t;
 
 struct model_t {
@@ -26,6 +31,8 @@ struct model_t {
     int max_repetition;
     int max_insert_size;
     int size_granularity;
+    void * map; // mapped binary model, NULL if parsed
+    size_t map_size;
 };
 
 /*
@@ -42,6 +49,59 @@ model_t * model_init ( int max_motif, int max_repetition, int max_insert_size, i
  */
 model_t * model_parse ( FILE * file );
 
+/*
+ * Initalize the model from a file, either in
+ * the binary format, memory mapped read-only and
+ * shareable between processes, or in the text one.
+ *
+ * @param filename  path of the model
+ * @ret initialized structure, NULL if error
+ */
+model_t * model_load ( char * filename );
+
+/*
+ * Writes the model in the binary format,
+ * including the tables used by the generation.
+ *
+ * @param file  pointer to the file
+ * @param model pointer to the statistics
+ * @returns     0 on success, -1 otherwise
+ */
+int model_write ( FILE * file, model_t * model );
+
+/*
+ * Adds the examples of a model to another one,
+ * e.g. to reduce the models learned by different
+ * threads or processes. The models must share
+ * the same parameters.
+ *
+ * @param dst   model to be updated
+ * @param src   model to be added
+ * @returns     0 on success, -1 if the models aren't compatible
+ */
+int model_merge ( model_t * dst, model_t * src );
+
+/*
+ * Bins the positions of the statistics
+ * of the reads, the model must be empty.
+ *
+ * @param exact   positions with their own matrix, 0 to disable the binning
+ * @param width   positions of each following bin, 0 for logarithmic bins
+ * @param model   pointer to the statistics
+ * @returns       0 on success, -1 otherwise
+ */
+int model_bin ( int exact, int width, model_t * model );
+
+/*
+ * Builds the tables used by the generation
+ * in each of the sources, so that the model
+ * can be shared between threads.
+ *
+ * @param model pointer to the statistics
+ * @returns       0 on success, -1 otherwise
+ */
+int model_normalize ( model_t * model );
+
 /*
  * Frees the memory
  *
@@ -0,0 +1,117 @@
+/*
+ * CNRSIM
+ * pack.h
+ * Sequences stored with two bits per
+ * nucleotide, and a mask of the characters
+ * that can't be represented this way.
+ *
+ * @author Riccardo Massidda
+ */
+#ifndef PACK_H
+#define PACK_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define PACK_MAGIC "CNRSIMPK"
+#define PACK_VERSION 1
+
+typedef struct pack_run_t pack_run_t;
+typedef struct pack_t pack_t;
+typedef struct pack_set_t pack_set_t;
+
+/*
+ * Run of the mask, either characters other
+ * than ACGT or lowercase nucleotides.
+ */
+struct pack_run_t {
+    long pos; // first position of the run
+    long len; // length of the run
+    char c; // character of the run, 0 for lowercase nucleotides
+};
+
+struct pack_t {
+    char * name; // name of the sequence
+    long len; // number of nucleotides
+    uint8_t * bases; // four nucleotides per byte, the first in the high bits
+    pack_run_t * run; // mask, ordered by position
+    long n_run; // runs in the mask
+    long run_size; // allocated runs
+    bool mapped; // data owned by a mapped file
+};
+
+/*
+ * Packed sequences of a file,
+ * in the order of the file.
+ */
+struct pack_set_t {
+    pack_t ** seq; // sequences
+    int n; // number of sequences
+    void * map; // mapped file
+    size_t map_size; // size of the mapped file
+};
+
+/*
+ * Packs a sequence
+ *
+ * @param       name    name of the sequence
+ * @param       seq     nucleotides
+ * @param       len     length of the sequence
+ * @returns     the packed sequence, NULL if error
+ */
+pack_t * pack_init ( char * name, char * seq, long len );
+
+/*
+ * Unpacks an interval of the sequence, clipped
+ * to its length, into a NULL terminated string.
+ *
+ * @param       pos     first position of the interval
+ * @param       len     length of the interval
+ * @param       out     buffer of at least len + 1 characters
+ * @param       pack    packed sequence
+ * @returns     number of unpacked nucleotides
+ */
+long pack_unpack ( long pos, long len, char * out, pack_t * pack );
+
+void pack_destroy ( pack_t * pack );
+
+/*
+ * Writes the header of a file of
+ * packed sequences.
+ *
+ * @param       file    output file
+ * @returns     0 on success, -1 otherwise
+ */
+int pack_header ( FILE * file );
+
+/*
+ * Appends a sequence to a file
+ * of packed sequences.
+ *
+ * @param       file    output file, after the header
+ * @param       pack    packed sequence
+ * @returns     0 on success, -1 otherwise
+ */
+int pack_write ( FILE * file, pack_t * pack );
+
+/*
+ * Maps a file of packed sequences, that can
+ * be shared by different processes.
+ *
+ * @param       filename        path of the file
+ * @returns     the mapped sequences, NULL if the file is invalid
+ */
+pack_set_t * pack_load ( char * filename );
+
+/*
+ * Looks for a sequence by name
+ *
+ * @param       name    name of the sequence
+ * @param       set     packed sequences
+ * @returns     index of the sequence, -1 if absent
+ */
+int pack_find ( char * name, pack_set_t * set );
+
+void pack_set_destroy ( pack_set_t * set );
+
+#endif
@@ -0,0 +1,82 @@
+/*
+ * CNRSIM
+ * reference.h
+ * Access to the sequences of a FASTA file,
+ * fetched on demand through an existing faidx
+ * index or streamed when the file isn't indexed.
+ *
+ * @author Riccardo Massidda
+ */
+#ifndef REFERENCE_H
+#define REFERENCE_H
+#include <stdbool.h>
+#include <zlib.h>
+#include <htslib/faidx.h>
+#include "pack.h"
+
+typedef struct reference_t reference_t;
+
+struct reference_t {
+    faidx_t * fai; // index of the file, NULL if streamed
+    gzFile fp; // streamed file
+    void * stream; // sequential parser of the streamed file
+    pack_set_t * cache; // packed sequences of the file, NULL if not cached
+    char * region; // name of the requested sequence, NULL for the whole file
+    long beg; // first position of the requested interval
+    long end; // last position of the requested interval, excluded
+    bool whole; // the whole sequence is loaded, even if an interval is requested
+    bool fastq; // the file holds FASTQ records
+    bool done; // no more sequences
+    int n; // sequences in the file, known once it has been read
+    // Current sequence
+    int index; // index of the sequence in the file
+    char * name; // name of the sequence
+    char * seq; // nucleotides, NULL if cached
+    pack_t * pack; // packed sequence, if cached
+    long len; // length of the nucleotides
+    char * qual; // quality line of FASTQ records, NULL otherwise
+    long start; // position of the first nucleotide in the sequence
+    char * fetched; // buffer allocated by faidx
+    char * fetched_qual; // quality buffer allocated by faidx
+};
+
+/*
+ * Opens a FASTA or FASTQ file, using its
+ * index if present to fetch the region; the
+ * index is never built, without it the file
+ * is streamed and the sequences before the
+ * region are skipped.
+ *
+ * @param       filename        path of the file
+ * @param       region          sequence, or interval in the form name:beg-end, NULL for the whole file
+ * @param       whole           load the whole sequence containing the region
+ * @returns     the initialized structure, NULL if error
+ */
+reference_t * ref_open ( char * filename, char * region, bool whole );
+
+/*
+ * Opens the packed copy of a FASTA file, in the
+ * file with the .pack suffix, that is built if
+ * missing or older than the FASTA file.
+ * The sequences aren't unpacked, the interval
+ * of the region is given by start and len.
+ *
+ * @param       filename        path of the FASTA file
+ * @param       region          sequence, or interval in the form name:beg-end, NULL for the whole file
+ * @returns     the initialized structure, NULL if error
+ */
+reference_t * ref_open_packed ( char * filename, char * region );
+
+/*
+ * Loads the next sequence of the file,
+ * or of the region. The sequence is owned by
+ * the structure and valid until the next call.
+ *
+ * @param       ref     opened file
+ * @returns     1 if a sequence is loaded, 0 at the end, -1 on error
+ */
+int ref_next ( reference_t * ref );
+
+void ref_close ( reference_t * ref );
+
+#endif
@@ -0,0 +1,71 @@
+/*
+ * CNRSIM
+ * rng.h
+ * Counter-based pseudorandom generator,
+ * Philox4x32-10 by Salmon et al.
+ * Every output is a function of the seed and
+ * of its position in the stream, so that each
+ * unit of work can derive its own stream.
+ *
+ * @author Riccardo Massidda
+ */
+#ifndef RNG_H
+#define RNG_H
+#include <stdint.h>
+
+typedef struct rng_t rng_t;
+
+struct rng_t {
+    uint32_t key[2]; // seed
+    uint32_t counter[4]; // block, stream and substream
+    uint32_t output[4]; // current block of outputs
+    int used; // outputs already consumed in the block
+};
+
+/*
+ * Initialize a stream
+ *
+ * @param       seed            seed of the run
+ * @param       stream          first index of the stream, e.g. the contig
+ * @param       substream       second index of the stream, e.g. the chunk
+ * @param       rng             stream to be initialized
+ */
+void rng_init ( uint64_t seed, uint32_t stream, uint32_t substream, rng_t * rng );
+
+/*
+ * Generates 32 random bits
+ *
+ * @param       rng     stream to be used
+ * @returns     uniform integer in [0, 2^32)
+ */
+uint32_t rng_next ( rng_t * rng );
+
+/*
+ * Generates a uniform real number
+ *
+ * @param       rng     stream to be used
+ * @returns     uniform real in [0, 1) with 53 bits of precision
+ */
+double rng_uniform ( rng_t * rng );
+
+/*
+ * Generates n outputs at once, the same
+ * that n calls of rng_next would return.
+ *
+ * @param       out     buffer of at least n outputs
+ * @param       n       number of outputs
+ * @param       rng     stream to be used
+ */
+void rng_fill ( uint32_t * out, long n, rng_t * rng );
+
+/*
+ * Generates an uniform integer without
+ * the bias of the modulo operation.
+ *
+ * @param       n       size of the range, greater than zero
+ * @param       rng     stream to be used
+ * @returns     uniform integer in [0, n)
+ */
+uint32_t rng_range ( uint32_t n, rng_t * rng );
+
+#endif
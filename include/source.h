@@ -7,17 +7,82 @@
  */
 #ifndef SOURCE_H
 #define SOURCE_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "rng.h"
 
+// Alignment in bytes of the matrix arenas
+#define SOURCE_ALIGNMENT 64
+// Widest output alphabet stored in dense rows
+#define SOURCE_SCAN_WIDTH 16
+// Total of a cumulative row
+#define SOURCE_UNIT ( 1u << 31 )
+// Logarithmic bins for each doubling of the position
+#define SOURCE_LOG_BINS 8
+
+typedef struct source_entry_t source_entry_t;
+typedef struct source_row_t source_row_t;
 typedef struct source_t source_t;
 
+/*
+ * Observed outcome of a row
+ */
+struct source_entry_t {
+    unsigned long count; // examples
+    int col; // outcome
+};
+
+/*
+ * Row of a sparse source while learning,
+ * the outcomes are ordered.
+ */
+struct source_row_t {
+    source_entry_t * entry; // observed outcomes
+    int n; // number of outcomes
+    int size; // allocated outcomes
+};
+
+/*
+ * Narrow sources are dense, the matrixes of all
+ * the positions are stored in a single arena,
+ * the matrix of position i starts at i * stride
+ * and its row of prefix j at i * stride + j * omega.
+ * They are sampled counting the thresholds of a
+ * cumulative row below a random number, that fits
+ * a cache line and has no branches.
+ *
+ * Wide sources are sparse, mostly empty rows store
+ * only the observed outcomes. Row j of position i
+ * is the row i * prefix + j, once normalized its
+ * entries are the ones from offset[row] to
+ * offset[row + 1], sampled through alias tables.
+ *
+ * Positions can be binned, the first ones have
+ * their own matrix while the following ones share
+ * the matrix of their bin.
+ */
 struct source_t {
     int n; // number of matrixes
-    unsigned long ** raw; // data
-    double ** normalized; // normalized data
+    int length; // number of positions, one more than the last learned
+    int exact; // positions with their own matrix, 0 for all of them
+    int width; // positions of a following bin, 0 for logarithmic bins
+    int capacity; // number of allocated matrixes
+    int stride; // elements between two matrixes, multiple of the alignment
+    unsigned long * raw; // data of dense sources
+    uint32_t * cdf; // cumulative rows scaled to SOURCE_UNIT, for dense sources
+    source_row_t * rows; // rows of sparse sources while learning
+    long * offset; // first entry of each row of sparse sources, once normalized
+    source_entry_t * entry; // entries of sparse sources, once normalized
+    long entries; // number of entries
+    double * normalized; // alias table of the entries, acceptance probabilities
+    int * alias; // alias table of the entries, alternative entries in the row
     int m; // memory
     int sigma; // input alphabet
     int omega; // output alphabet
     int prefix; // number of possible prefixes
+    bool sparse; // rows store only the observed outcomes
+    bool mapped; // tables owned by a memory mapping
 };
 
 /*
@@ -30,6 +95,40 @@ struct source_t {
  */
 source_t * source_init ( int sigma, int omega, int m, int graph );
 
+/*
+ * Allocates memory for at least n matrixes,
+ * the new matrixes are empty. A mapped source,
+ * or a normalized sparse one, can't be expanded.
+ *
+ * @param       n       number of matrixes
+ * @param       source  source to be expanded
+ * @returns     0 on success, -1 otherwise
+ */
+int source_reserve ( int n, source_t * source );
+
+/*
+ * Bins the following positions, the source
+ * must be empty.
+ *
+ * @param       exact   positions with their own matrix, 0 to disable the binning
+ * @param       width   positions of each following bin, 0 for logarithmic bins
+ * @param       source  source to be binned
+ * @returns     0 on success, -1 otherwise
+ */
+int source_bin ( int exact, int width, source_t * source );
+
+/*
+ * Adds examples of an outcome to a row
+ *
+ * @param       pos     matrix of the examples
+ * @param       row     index of the prefix
+ * @param       out     output character
+ * @param       count   number of examples
+ * @param       source  source to be updated
+ * @returns     0 on success, -1 otherwise
+ */
+int source_add ( int pos, int row, int out, unsigned long count, source_t * source );
+
 /*
  * Updates the data with a new example
  *
@@ -40,7 +139,7 @@ source_t * source_init ( int sigma, int omega, int m, int graph );
  * @param       source  source to be updated
  * @returns     0 on success, -1 otherwise
  */
-int source_update ( unsigned char * in, int len, int pos, unsigned char out, source_t * source );
+int source_update ( unsigned char * in, int len, int pos, int out, source_t * source );
 
 /*
  * Updates the data collecting examples from
@@ -52,6 +151,29 @@ int source_update ( unsigned char * in, int len, int pos, unsigned char out, sou
  */
 void source_learn_word ( unsigned char * w, int size, source_t * source );
 
+/*
+ * Adds the examples of a source to another one,
+ * the two sources must have the same alphabets
+ * and memory.
+ *
+ * @param       dst     source to be updated
+ * @param       src     source to be added
+ * @returns     0 on success, -1 otherwise
+ */
+int source_merge ( source_t * dst, source_t * src );
+
+/*
+ * Builds the tables used by the generation.
+ * The source must not be updated afterwards.
+ * Generating from a source normalizes it on
+ * first use, so this function has to be called
+ * before sharing a source between threads.
+ *
+ * @param       source  source to be normalized
+ * @returns     0 on success, -1 otherwise
+ */
+int source_normalize ( source_t * source );
+
 /*
  * Generates a character given a prefix
  * and a position
@@ -59,20 +181,69 @@ void source_learn_word ( unsigned char * w, int size, source_t * source );
  * @param       prefix  string containing the prefix
  * @param       len     lenghth of the prefix
  * @param       pos     position of the example
+ * @param       rng     pseudorandom stream
  * @param       source  source to be used
  * @returns     output character given the learned probabilities
  */
-unsigned char source_generate ( unsigned char * in, int len, int pos, source_t * source );
+int source_generate ( unsigned char * in, int len, int pos, rng_t * rng, source_t * source );
 
 /*
  * Generates a word
  *
  * @param       w       pointer to the string or NULL
  * @param       size    size of the string
+ * @param       rng     pseudorandom stream
  * @param       source  source to be used
  * @returns     word generated
  */
-unsigned char * source_generate_word ( unsigned char * w, int * size, source_t * source );
+unsigned char * source_generate_word ( unsigned char * w, int * size, rng_t * rng, source_t * source );
+
+/*
+ * Random numbers used by each
+ * generated outcome
+ *
+ * @param       source  source to be used
+ * @returns     1 for dense sources, 2 for sparse ones
+ */
+int source_draws ( source_t * source );
+
+/*
+ * Locates the distribution of a prefix at a
+ * position, so that it can be looked up once
+ * and sampled many times.
+ *
+ * @param       in      prefix
+ * @param       len     length of the prefix
+ * @param       pos     position of the outcome
+ * @param       source  source to be used
+ * @returns     row of the distribution
+ */
+long source_row ( unsigned char * in, int len, int pos, source_t * source );
+
+/*
+ * Generates an outcome of a row with pre-drawn
+ * random numbers, as source_generate would do
+ * drawing them from the stream.
+ *
+ * @param       row     row given by source_row
+ * @param       r       source_draws random numbers
+ * @param       source  normalized source
+ * @returns     output character given the learned probabilities
+ */
+int source_sample ( long row, const uint32_t * r, source_t * source );
+
+/*
+ * Generates n words, the random numbers of
+ * each word are drawn in a single block.
+ *
+ * @param       n       number of words
+ * @param       w       words, length characters each
+ * @param       size    size of each word
+ * @param       random  buffer of length * source_draws random numbers
+ * @param       rng     pseudorandom stream
+ * @param       source  source to be used
+ */
+void source_generate_words ( int n, unsigned char * w, int * size, uint32_t * random, rng_t * rng, source_t * source );
 
 /*
  * Dumps the content of a source to a file
@@ -82,6 +253,30 @@ unsigned char * source_generate_word ( unsigned char * w, int * size, source_t *
  */
 void source_dump ( FILE * file, char * source_name, source_t * source );
 
+/*
+ * Writes the counts and the sampling tables
+ * of a source in the binary model format,
+ * normalizing the source if needed.
+ *
+ * @param       file    pointer to the file
+ * @param       source  source to be written
+ * @returns     0 on success, -1 otherwise
+ */
+int source_write ( FILE * file, source_t * source );
+
+/*
+ * Points the tables of a source to a region
+ * written by source_write, e.g. a memory mapped
+ * file. The region must outlive the source and
+ * the source can't be updated afterwards.
+ *
+ * @param       data    beginning of the region
+ * @param       size    bytes available in the region
+ * @param       source  source with the same alphabets and memory
+ * @returns     bytes used by the source, -1 if not valid
+ */
+long source_map ( void * data, long size, source_t * source );
+
 /*
  * Deallocates a source
  *
@@ -10,12 +10,14 @@
 #ifndef STATS
 #define STATS
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include "source.h"
 #include "allele.h"
 
 typedef struct stats_t stats_t;
 typedef struct read_t read_t;
+typedef struct read_batch_t read_batch_t;
 
 struct stats_t {
     source_t * alignment;
@@ -33,6 +35,31 @@ struct read_t {
     bool cut;
 };
 
+/*
+ * Block of reads generated together, each
+ * field is an array indexed by the read.
+ * Alignments, nucleotides and qualities are
+ * stored one read after the other.
+ */
+struct read_batch_t {
+    int n; // generated reads
+    int size; // allocated reads
+    int alg_stride; // operations of each alignment
+    int stride; // characters of each read, with the terminator
+    unsigned char * align; // alignments
+    int * alg_len; // length of the alignments
+    char * read; // nucleotides, NULL terminated
+    unsigned char * quality; // quality scores, NULL terminated
+    int * length; // length of the reads
+    long * start; // positions of the reads, set by the caller
+    bool * cut; // the reference ended before the end of the read
+    int last; // last position that can be generated
+    long * quality_row; // rows of the quality by position and operation
+    long * mismatch_row; // rows of the mismatch by position and nucleotide
+    uint32_t * random; // pre-drawn random numbers
+    long random_size; // allocated random numbers
+};
+
 /*
  * Initalize the structure
  *
@@ -51,15 +78,102 @@ stats_t * stats_init ( );
  */
 void stats_update ( unsigned char * align, int alg_len, char * read, char * ref, unsigned char * quality, stats_t * stats );
 
+/*
+ * Adds the examples of a statistic to another one
+ *
+ * @param dst   statistics to be updated
+ * @param src   statistics to be added
+ * @returns     0 on success, -1 otherwise
+ */
+int stats_merge ( stats_t * dst, stats_t * src );
+
+/*
+ * Bins the positions of each of the sources
+ *
+ * @param exact   positions with their own matrix, 0 to disable the binning
+ * @param width   positions of each following bin, 0 for logarithmic bins
+ * @param stats   pointer to the statistics
+ * @returns       0 on success, -1 otherwise
+ */
+int stats_bin ( int exact, int width, stats_t * stats );
+
+/*
+ * Builds the tables used by the generation
+ * in each of the sources.
+ *
+ * @param stats pointer to the statistics
+ * @returns       0 on success, -1 otherwise
+ */
+int stats_normalize ( stats_t * stats );
+
 /*
  * Generates a read using the internal statistics
  *
  * @param ref   reference sequence
  * @param read  pointer to the read to be filled
+ * @param rng   pseudorandom stream
  * @param stats pointer to the statistics
  * @returns     pointer to the generated structure
  */
-read_t * stats_generate_read ( char * ref, read_t * read, stats_t * stats );
+read_t * stats_generate_read ( char * ref, read_t * read, rng_t * rng, stats_t * stats );
+
+/*
+ * Allocates a batch of reads for the
+ * statistics, that must not change afterwards
+ *
+ * @param size  maximum number of reads
+ * @param stats pointer to the statistics
+ * @returns     the initialized structure, NULL if error
+ */
+read_batch_t * stats_batch_init ( int size, stats_t * stats );
+
+/*
+ * Generates the alignments of a batch, they
+ * fix the length of the reads before their
+ * position in the reference is known.
+ *
+ * @param n     number of reads
+ * @param batch batch to be filled
+ * @param rng   pseudorandom stream
+ * @param stats pointer to the statistics
+ */
+void stats_batch_align ( int n, read_batch_t * batch, rng_t * rng, stats_t * stats );
+
+/*
+ * Clips an aligned read of a batch to the
+ * nucleotides left in the reference, updating
+ * its length and whether it's cut.
+ *
+ * @param k     index of the read
+ * @param n     nucleotides left in the reference
+ * @param batch aligned batch
+ */
+void stats_batch_clip ( int k, long n, read_batch_t * batch );
+
+/*
+ * Generates the nucleotides and the quality
+ * scores of the aligned reads of a batch, with
+ * the random numbers of the whole batch drawn
+ * in a single block. The length of the cut
+ * reads is updated.
+ *
+ * @param ref           windows of the reference starting at each read, NULL terminated at the end of the sequence
+ * @param ref_stride    distance between two windows
+ * @param batch         aligned batch
+ * @param rng           pseudorandom stream
+ * @param stats         pointer to the statistics
+ * @returns             0 on success, -1 otherwise
+ */
+int stats_generate_batch ( char * ref, long ref_stride, read_batch_t * batch, rng_t * rng, stats_t * stats );
+
+void stats_batch_destroy ( read_batch_t * batch );
+
+/*
+ * Frees a generated read
+ *
+ * @param read  pointer to the read
+ */
+void stats_read_destroy ( read_t * read );
 
 /*
  * Frees the memory
@@ -8,9 +8,18 @@
  */
 #ifndef TANDEM_H
 #define TANDEM_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define TANDEM_MAGIC "CNRSIMTR"
+#define TANDEM_VERSION 1
+#define TANDEM_SUFFIX ".tandem"
 
 typedef struct tandem_t tandem_t;
 typedef struct tandem_set_t tandem_set_t;
+typedef struct tandem_entry_t tandem_entry_t;
+typedef struct tandem_cache_t tandem_cache_t;
 
 struct tandem_t {
     unsigned int pos; // position inside of the reference
@@ -25,6 +34,38 @@ struct tandem_set_t {
     int size; // size of allocated memory
     int max_motif; // size of the maximum motif analyzed
     int max_repetition; // number of maximum allowed repetitions
+    bool mapped; // tandems owned by a cache
+};
+
+/*
+ * Tandems of a sequence, identified by its name,
+ * its length, the checksum of its nucleotides
+ * and the parameters of the analysis.
+ */
+struct tandem_entry_t {
+    char * name; // name of the sequence
+    long length; // length of the sequence
+    uint32_t checksum; // CRC32 of the nucleotides
+    int max_motif; // size of the maximum motif analyzed
+    int max_repetition; // number of maximum allowed repetitions
+    int n; // number of tandems
+    tandem_t * set; // tandems, ordered by position
+    bool mapped; // data owned by the mapped file
+};
+
+/*
+ * Annotations of the sequences of a FASTA file,
+ * stored in the file with the .tandem suffix.
+ */
+struct tandem_cache_t {
+    char * filename; // path of the annotation file
+    tandem_entry_t * entry; // annotated sequences
+    int n; // number of entries
+    int size; // allocated entries
+    int stored; // entries already in the file
+    void * map; // mapped file
+    size_t map_size; // size of the mapped file
+    pthread_mutex_t lock;
 };
 
 
@@ -39,14 +80,17 @@ struct tandem_set_t {
 tandem_set_t * tandem_set_init ( int length, int max_motif, int max_repetition, tandem_set_t * set );
 
 /*
- * Populates a set analyzing a reference sequence
+ * Populates a set analyzing a reference sequence,
+ * long sequences are split in chunks analyzed
+ * in parallel, with the same result.
  *
  * @param       reference       reference sequence
  * @param       length          size of the reference
+ * @param       threads         maximum number of threads
  * @param       set             empty set
- * @returns     set containing the repetitions
+ * @returns     set containing the repetitions, NULL if error
  */
-tandem_set_t * tandem_set_analyze ( char * reference, int length, tandem_set_t * set );
+tandem_set_t * tandem_set_analyze ( char * reference, int length, int threads, tandem_set_t * set );
 
 
 /*
@@ -56,4 +100,45 @@ tandem_set_t * tandem_set_analyze ( char * reference, int length, tandem_set_t *
  */
 void tandem_set_destroy ( tandem_set_t * set );
 
+/*
+ * Maps the annotations of a FASTA file,
+ * a missing or invalid file is ignored
+ * and replaced when written.
+ *
+ * @param       filename        path of the FASTA file
+ * @returns     the annotations, NULL if error
+ */
+tandem_cache_t * tandem_cache_open ( char * filename );
+
+/*
+ * Populates a set with the annotation of a
+ * sequence, that is analyzed and added to the
+ * cache if missing. Annotations found in the
+ * cache are shared with the set, and valid
+ * until the cache is destroyed.
+ *
+ * @param       name            name of the sequence
+ * @param       reference       reference sequence
+ * @param       length          size of the reference
+ * @param       max_motif       size of the maximum motif
+ * @param       max_repetition  number of maximum allowed repetitions
+ * @param       threads         maximum number of threads of the analysis
+ * @param       set             set to be populated, or NULL
+ * @param       cache           annotations of the file
+ * @returns     set containing the repetitions, NULL if error
+ */
+tandem_set_t * tandem_cache_analyze ( char * name, char * reference, int length, int max_motif, int max_repetition, int threads, tandem_set_t * set, tandem_cache_t * cache );
+
+/*
+ * Writes the annotations, if new ones have
+ * been added. The file is renamed when complete
+ * so that other processes never map a partial file.
+ *
+ * @param       cache   annotations of the file
+ * @returns     0 on success, -1 otherwise
+ */
+int tandem_cache_write ( tandem_cache_t * cache );
+
+void tandem_cache_destroy ( tandem_cache_t * cache );
+
 #endif
@@ -15,6 +15,7 @@
 #include <htslib/vcf.h>
 #include <htslib/synced_bcf_reader.h>
 #include "user_variation.h"
+#include "rng.h"
 
 typedef struct wrapper_t wrapper_t;
 
@@ -47,7 +48,9 @@ struct wrapper_t {
     char * ref; // reference
     char ** alt; // alternatives
     int * alt_index; // alternative chosen for each allele
+    double * p; // probabilities of the alternatives
     int ploidy;
+    rng_t rng; // pseudorandom stream used to choose the alternatives
 };
 
 /*
@@ -0,0 +1,78 @@
+/*
+ * CNRSIM
+ * writer.h
+ * Output stage of the simulator, formats
+ * the reads in FASTQ records and writes them
+ * on a BGZF compressed stream.
+ *
+ * @author Riccardo Massidda
+ */
+#ifndef WRITER_H
+#define WRITER_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <htslib/bgzf.h>
+#include <htslib/thread_pool.h>
+#include "stats.h"
+
+typedef struct writer_t writer_t;
+typedef struct fastq_buffer_t fastq_buffer_t;
+
+struct writer_t {
+    BGZF * fp; // output stream
+};
+
+struct fastq_buffer_t {
+    char * data; // formatted records
+    size_t len; // length of the records
+    size_t size; // allocated memory
+};
+
+/*
+ * Opens the output stream
+ *
+ * @param       filename        path of the compressed file, NULL for uncompressed standard output
+ * @param       pool            compression threads, shared by the streams, or NULL
+ * @returns     the initialized structure, NULL if error
+ */
+writer_t * writer_open ( char * filename, hts_tpool * pool );
+
+/*
+ * Appends a read of a batch to a buffer as
+ * a FASTQ record, reversed if on the reverse
+ * strand and with printable quality.
+ * The read is named after the sequence, the
+ * unit and its index in the unit, so that the
+ * two mates of a pair share the same name.
+ *
+ * @param       name    name of the sequence
+ * @param       unit    index of the work unit
+ * @param       id      index of the pair in the unit
+ * @param       pos     position of the read in the sequence
+ * @param       reverse strand of the read
+ * @param       batch   generated reads
+ * @param       k       index of the read in the batch
+ * @param       buffer  buffer to be filled
+ * @returns     0 on success, -1 if the buffer can't grow, leaving it unchanged
+ */
+int writer_format ( char * name, int unit, long id, long pos, bool reverse, read_batch_t * batch, int k, fastq_buffer_t * buffer );
+
+/*
+ * Writes the content of a buffer
+ * and empties it
+ *
+ * @param       buffer  buffer to be written
+ * @param       writer  output stream
+ * @returns     0 on success, -1 otherwise
+ */
+int writer_write ( fastq_buffer_t * buffer, writer_t * writer );
+
+/*
+ * Flushes and closes the stream
+ *
+ * @param       writer  output stream
+ * @returns     0 on success, -1 otherwise
+ */
+int writer_close ( writer_t * writer );
+
+#endif
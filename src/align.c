@@ -1,194 +1,368 @@
+/*
+ * CNRSIM
+ * align.c
+ * Aligns a read to a window of the reference,
+ * the whole read against any substring of the
+ * reference with unitary edit costs, yielding
+ * the same alignment codes of edlib.
+ *
+ * @author Riccardo Massidda
+ */
 #include <stdio.h>
 #include <ctype.h>
+#include <limits.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include "align.h"
 
-aligner_t * al_init ( aligner_t * aligner, char * reference, int reference_length, char * read ) {
-    aligner_t * al = realloc ( aligner, sizeof ( aligner_t ) );
+// Bits in a word of the bit-parallel algorithm
+#define AL_WORD 64
+// Subproblems up to this many cells keep the whole matrix
+#define AL_BASE 4096
+// Cost of the cells outside the band
+#define AL_INF ( INT_MAX / 2 )
+
+aligner_t * al_init ( ) {
+    aligner_t * al = malloc ( sizeof ( aligner_t ) );
     if ( al == NULL ) {
         return NULL;
     }
 
-    // Sequences
-    al->reference = reference;
-    al->read = read;
-    al->ref_len = reference_length + 1;
-    al->read_len = strlen ( read ) + 1;
+    al->bits = NULL;
+    al->bits_size = 0;
+    al->rows = NULL;
+    al->rows_size = 0;
+    al->matrix = malloc ( sizeof ( int ) * AL_BASE );
+    al->alignment = NULL;
+    al->alignment_size = 0;
+    al->length = 0;
+    al->start = 0;
+    al->distance = 0;
 
-    // Matrix
-    if ( aligner == NULL ) {
-        al->nw = NULL;
-        al->op = NULL;
-        al->alignment = NULL;
+    if ( al->matrix == NULL ) {
+        free ( al );
+        return NULL;
     }
+    return al;
+}
 
-    // Allocate matrix pointers
-    int ( *nw ) [al->ref_len] = realloc ( al->nw, sizeof ( int[al->read_len][al->ref_len] ) );
-    char ( *op ) [al->ref_len] = realloc ( al->op, sizeof ( char[al->read_len][al->ref_len] ) );
-    al->nw = ( void * ) nw;
-    al->op = ( void * ) op;
+/*
+ * Last row of the edit distance matrix between the
+ * query and the prefixes of the target, one column
+ * at a time, 64 rows per word. The query can start
+ * anywhere in the target unless anchored, reverse
+ * reads both strings backwards. Returns the first
+ * column with the wanted score or, if wanted is
+ * negative, the first one with the minimum score,
+ * stored in best. Returns -1 if there is none.
+ */
+static int __search ( char * query, int n, char * target, int m, bool reverse, bool anchored, int wanted, int * best, aligner_t * al ) {
+    int words = ( n + AL_WORD - 1 ) / AL_WORD;
+    int last = ( n - 1 ) % AL_WORD;
+    unsigned char code[256];
+    int symbols = 1;
+    uint64_t * peq;
+    uint64_t * pv;
+    uint64_t * mv;
+    int score = n;
+    int column = -1;
+    unsigned char c;
 
-    if ( nw == NULL || op == NULL ) {
-        return NULL;
+    // Symbols of the query, 0 for the ones not in the query
+    memset ( code, 0, sizeof ( code ) );
+    for ( int i = 0; i < n; i ++ ) {
+        c = toupper ( ( unsigned char ) query[i] );
+        if ( code[c] == 0 ) {
+            code[c] = symbols ++;
+        }
     }
 
-    // Initial conditions
-    for ( int i = 0; i < al->read_len; i ++ ) {
-        // Initial conditions
-        for ( int j = 0; j < al->ref_len; j ++ ) {
-            nw[i][j] = 0;
-            op[i][j] = 'X';
+    if ( al->bits_size < ( symbols + 2 ) * words ) {
+        al->bits_size = ( symbols + 2 ) * words;
+        al->bits = realloc ( al->bits, sizeof ( uint64_t ) * al->bits_size );
+        if ( al->bits == NULL ) {
+            return -1;
         }
-        // GAP in the first column
-        nw[i][0] = i * GAP;
-        op[i][0] = 'D';
     }
+    peq = al->bits;
+    pv = &peq[symbols * words];
+    mv = &pv[words];
 
-    // Alignement result
-    al->start = 0;
-    __align ( al );
-    return al;
-}
+    // Positions of each symbol in the query
+    memset ( peq, 0, sizeof ( uint64_t ) * symbols * words );
+    for ( int i = 0; i < n; i ++ ) {
+        c = toupper ( ( unsigned char ) query[reverse ? n - 1 - i : i] );
+        peq[code[c] * words + i / AL_WORD] |= 1ULL << ( i % AL_WORD );
+    }
+
+    // First column, the score grows by one each row
+    for ( int w = 0; w < words; w ++ ) {
+        pv[w] = ~0ULL;
+        mv[w] = 0;
+    }
+
+    for ( int j = 0; j < m; j ++ ) {
+        uint64_t * eq = &peq[code[toupper ( ( unsigned char ) target[reverse ? m - 1 - j : j] )] * words];
+        // Horizontal difference entering the block, the first row is free if not anchored
+        int hin = ( anchored ) ? 1 : 0;
+        for ( int w = 0; w < words; w ++ ) {
+            uint64_t e = eq[w];
+            uint64_t xv = e | mv[w];
+            uint64_t xh, ph, mh;
+            int hout;
 
-bool __equals ( char a, char b ) {
-    if ( a == b ) {
-        return true;
-    } else {
-        return false;
+            if ( hin < 0 ) {
+                e |= 1;
+            }
+            xh = ( ( ( e & pv[w] ) + pv[w] ) ^ pv[w] ) | e;
+            ph = mv[w] | ~( xh | pv[w] );
+            mh = pv[w] & xh;
+            // Difference on the last row of the query
+            if ( w == words - 1 ) {
+                score += ( int ) ( ( ph >> last ) & 1 ) - ( int ) ( ( mh >> last ) & 1 );
+            }
+            hout = ( ph >> ( AL_WORD - 1 ) ) ? 1 : ( mh >> ( AL_WORD - 1 ) ) ? -1 : 0;
+            ph <<= 1;
+            mh <<= 1;
+            if ( hin < 0 ) {
+                mh |= 1;
+            } else if ( hin > 0 ) {
+                ph |= 1;
+            }
+            pv[w] = mh | ~( xv | ph );
+            mv[w] = ph & xv;
+            hin = hout;
+        }
+
+        if ( wanted < 0 ) {
+            if ( column < 0 || score < *best ) {
+                column = j;
+                *best = score;
+            }
+        } else if ( score == wanted ) {
+            return j;
+        }
     }
+
+    return column;
 }
 
-void __align ( aligner_t * al ) {
-    int ( *nw ) [al->ref_len] = al->nw;
-    char ( *op ) [al->ref_len] = al->op;
-    int left, top;
-    for ( int i = 1; i < al->read_len; i ++ ) {
-        for ( int j = 1; j < al->ref_len; j ++ ) {
-            left = nw[i][j - 1] + GAP;
-            top = nw[i - 1][j] + GAP;
-            // Search for max neighbors
-            if ( __equals ( al->reference[j - 1], al->read[i - 1] ) ) {
-                nw[i][j] = nw[i - 1][j - 1] + MATCH;
-                op[i][j] = '=';
-            } else {
-                nw[i][j] = nw[i - 1][j - 1] + MISMATCH;
-                op[i][j] = 'X';
+/*
+ * Row of the global alignment matrix between
+ * a and b, only the cells whose diagonal j - i
+ * is in [lo, hi] are computed. The row is written
+ * in out, tmp holds the previous one. If reverse
+ * both strings are read backwards.
+ */
+static void __row ( char * a, int n, char * b, int m, int rows, int lo, int hi, bool reverse, int * out, int * tmp ) {
+    int * row[2];
+    int * prev;
+    int * cur;
+    int jlo, jhi;
+    unsigned char ca, cb;
+    int v;
+
+    // Row i is stored in row[i % 2], the last one in out
+    row[rows % 2] = out;
+    row[1 - rows % 2] = tmp;
+    for ( int j = 0; j <= m; j ++ ) {
+        out[j] = AL_INF;
+        tmp[j] = AL_INF;
+    }
+    for ( int j = ( lo > 0 ) ? lo : 0; j <= m && j <= hi; j ++ ) {
+        row[0][j] = j;
+    }
+
+    for ( int i = 1; i <= rows; i ++ ) {
+        prev = row[( i - 1 ) % 2];
+        cur = row[i % 2];
+        jlo = ( i + lo > 0 ) ? i + lo : 0;
+        jhi = ( i + hi < m ) ? i + hi : m;
+        // Left of the band, written two rows ago
+        if ( jlo > 0 ) {
+            cur[jlo - 1] = AL_INF;
+        }
+        ca = toupper ( ( unsigned char ) a[reverse ? n - i : i - 1] );
+        for ( int j = jlo; j <= jhi; j ++ ) {
+            if ( j == 0 ) {
+                cur[j] = i;
+                continue;
             }
-            if ( top > nw[i][j] ) {
-                nw[i][j] = top;
-                op[i][j] = 'D';
+            cb = toupper ( ( unsigned char ) b[reverse ? m - j : j - 1] );
+            v = prev[j - 1] + ( ca != cb );
+            if ( prev[j] + 1 < v ) {
+                v = prev[j] + 1;
             }
-            if ( left > nw[i][j] ) {
-                nw[i][j] = left;
-                op[i][j] = 'I';
+            if ( cur[j - 1] + 1 < v ) {
+                v = cur[j - 1] + 1;
             }
+            cur[j] = v;
         }
     }
 }
 
-char * build_alignment ( aligner_t * al ) {
-    int ( *nw ) [al->ref_len] = al->nw;
-    char ( *op ) [al->ref_len] = al->op;
-    int i, j, k;
-    char * s = malloc ( sizeof ( char ) * ( al->read_len + al->ref_len - 1 ) );
-
-    // Search for the maximum value
-    int max_val = nw[al->read_len - 1][0];
-    int max_i = al->read_len - 1;
-    int max_j = 0;
-    for ( j = 0; j < al->ref_len; j ++ ) {
-        if ( nw[max_i][j] >= max_val ) {
-            max_j = j;
-            max_val = nw[max_i][max_j];
+/*
+ * Appends the alignment of a small subproblem,
+ * traced back on the whole matrix.
+ */
+static void __full ( char * a, int n, char * b, int m, aligner_t * al ) {
+    int * d = al->matrix;
+    int width = m + 1;
+    unsigned char * s = &al->alignment[al->length];
+    int i, j, k, v;
+
+    for ( j = 0; j <= m; j ++ ) {
+        d[j] = j;
+    }
+    for ( i = 1; i <= n; i ++ ) {
+        d[i * width] = i;
+        for ( j = 1; j <= m; j ++ ) {
+            v = d[( i - 1 ) * width + j - 1] + ( toupper ( ( unsigned char ) a[i - 1] ) != toupper ( ( unsigned char ) b[j - 1] ) );
+            if ( d[( i - 1 ) * width + j] + 1 < v ) {
+                v = d[( i - 1 ) * width + j] + 1;
+            }
+            if ( d[i * width + j - 1] + 1 < v ) {
+                v = d[i * width + j - 1] + 1;
+            }
+            d[i * width + j] = v;
         }
     }
 
-    // Alignment
-    i = max_i;
-    j = max_j;
+    // Backwards, preferring the diagonal
+    i = n;
+    j = m;
     k = 0;
-    while ( j != 0 && i != 0 ) {
-        s[k] = op[i][j];
-        if ( s[k] == 'I' ) {
+    while ( i > 0 || j > 0 ) {
+        v = d[i * width + j];
+        if ( i > 0 && j > 0 && v == d[( i - 1 ) * width + j - 1] + ( toupper ( ( unsigned char ) a[i - 1] ) != toupper ( ( unsigned char ) b[j - 1] ) ) ) {
+            s[k++] = ( v == d[( i - 1 ) * width + j - 1] ) ? AL_MATCH : AL_MISMATCH;
+            i --;
             j --;
-        } else if ( s[k] == 'D' ) {
+        } else if ( i > 0 && v == d[( i - 1 ) * width + j] + 1 ) {
+            s[k++] = AL_INSERTION;
             i --;
         } else {
-            i --;
+            s[k++] = AL_DELETION;
             j --;
         }
-        k ++;
-    }
-    while ( i > 0 ) {
-        s[k] = 'D';
-        i --;
-        k ++;
     }
-    s[k] = '\0';
-    al->start = j;
 
     // Reverse string
-    al->alignment = realloc ( al->alignment, sizeof ( char ) * ( k + 1 ) );
-    for ( i = 0, k --; k >= 0; i++, k -- ) al->alignment[i] = s[k];
-    al->alignment[i] = '\0';
-    free ( s );
-
-    return al->alignment;
+    for ( i = 0; i < k / 2; i ++ ) {
+        unsigned char c = s[i];
+        s[i] = s[k - 1 - i];
+        s[k - 1 - i] = c;
+    }
+    al->length += k;
 }
 
-char * alignment ( aligner_t * al ) {
-    char * seq;
-    int i = 0; // read index
-    int j = 0; // reference index
-    int k; // alignment index
-    seq = malloc ( sizeof ( char ) * ( al->read_len + al->ref_len - 1 ) );
-    for ( k = 0; k < al->start; k ++ ) {
-        seq[k] = ' ';
-    }
-    for ( k = 0; k < strlen ( al->alignment ); k ++ ) {
-        if ( al->alignment[k] == 'X' || al->alignment[k] == '=' ) {
-            seq[k + al->start] = al->reference[j + al->start];
-            i ++;
-            j ++;
-        }
-        // Read presents an insertion
-        else if ( al->alignment[k] == 'D' ) {
-            seq[k + al->start] = al->read[i];
-            i ++;
-        }
-        // Read presents a deletion
-        else {
-            seq[k + al->start] = al->reference[j];
-            j ++;
+/*
+ * Appends the global alignment of a and b, whose
+ * edit distance is d. The distance bounds the
+ * diagonals crossed by an optimal alignment, the
+ * matrix is split on the middle row of a in the
+ * cell where the forward and backward costs sum to d.
+ */
+static void __hirschberg ( char * a, int n, char * b, int m, int d, aligner_t * al ) {
+    int diff = m - n;
+    int slack = ( d - abs ( diff ) ) / 2;
+    int lo = ( ( diff < 0 ) ? diff : 0 ) - slack;
+    int hi = ( ( diff > 0 ) ? diff : 0 ) + slack;
+    int * forward = al->rows;
+    int * backward = &al->rows[m + 1];
+    int * tmp = &al->rows[2 * ( m + 1 )];
+    int mid = n / 2;
+    int split = -1;
+    int cost = AL_INF;
+    int left, right;
+
+    if ( n == 0 ) {
+        memset ( &al->alignment[al->length], AL_DELETION, m );
+        al->length += m;
+        return;
+    }
+    if ( m == 0 ) {
+        memset ( &al->alignment[al->length], AL_INSERTION, n );
+        al->length += n;
+        return;
+    }
+    if ( ( long ) ( n + 1 ) * ( m + 1 ) <= AL_BASE ) {
+        __full ( a, n, b, m, al );
+        return;
+    }
+
+    // Middle row from both ends, reversed diagonals for the backward one
+    __row ( a, n, b, m, mid, lo, hi, false, forward, tmp );
+    __row ( a, n, b, m, n - mid, diff - hi, diff - lo, true, backward, tmp );
+    for ( int j = ( mid + lo > 0 ) ? mid + lo : 0; j <= m && j <= mid + hi; j ++ ) {
+        if ( forward[j] + backward[m - j] < cost ) {
+            cost = forward[j] + backward[m - j];
+            split = j;
         }
     }
-    seq[k + al->start] = '\0';
-    return seq;
+    left = forward[split];
+    right = backward[m - split];
+
+    __hirschberg ( a, mid, b, split, left, al );
+    __hirschberg ( &a[mid], n - mid, &b[split], m - split, right, al );
 }
 
-void dump ( aligner_t * al ) {
-    int i, j;
-    int ( *nw ) [al->ref_len] = al->nw;
-    char ( *op ) [al->ref_len] = al->op;
-    for ( i = 0; i < al->read_len; i ++ ) {
-        for ( j = 0; j < al->ref_len; j ++ )
-            printf ( "%d\t", nw[i][j] );
-        printf ( "\n" );
+int al_align ( char * read, int read_len, char * reference, int ref_len, aligner_t * al ) {
+    int best = read_len;
+    int end;
+    int start;
+
+    al->length = 0;
+    al->start = 0;
+    al->distance = read_len;
+    if ( read_len == 0 || ref_len == 0 ) {
+        if ( al->alignment_size < read_len ) {
+            al->alignment_size = read_len;
+            al->alignment = realloc ( al->alignment, sizeof ( unsigned char ) * al->alignment_size );
+            if ( al->alignment == NULL ) {
+                return -1;
+            }
+        }
+        memset ( al->alignment, AL_INSERTION, read_len );
+        al->length = read_len;
+        return al->distance;
+    }
+
+    // Last position of the best alignment
+    end = __search ( read, read_len, reference, ref_len, false, false, -1, &best, al );
+    if ( end < 0 ) {
+        return -1;
+    }
+    // First position, aligning backwards from the last one
+    start = __search ( read, read_len, reference, end + 1, true, true, best, &best, al );
+    start = ( start < 0 ) ? end + 1 : end - start;
+
+    if ( al->alignment_size < read_len + end + 1 - start ) {
+        al->alignment_size = read_len + end + 1 - start;
+        al->alignment = realloc ( al->alignment, sizeof ( unsigned char ) * al->alignment_size );
+    }
+    if ( al->rows_size < 3 * ( end + 2 - start ) ) {
+        al->rows_size = 3 * ( end + 2 - start );
+        al->rows = realloc ( al->rows, sizeof ( int ) * al->rows_size );
     }
-    for ( i = 0; i < al->read_len; i ++ ) {
-        for ( j = 0; j < al->ref_len; j ++ )
-            printf ( "%c ", op[i][j] );
-        printf ( "\n" );
+    if ( al->alignment == NULL || al->rows == NULL ) {
+        return -1;
     }
+
+    __hirschberg ( read, read_len, &reference[start], end + 1 - start, best, al );
+    al->start = start;
+    al->distance = best;
+    return best;
 }
 
 void al_destroy ( aligner_t * al ) {
-    int ( *nw ) [al->ref_len] = al->nw;
-    char ( *op ) [al->ref_len] = al->op;
-    free ( nw );
-    free ( op );
+    if ( al == NULL ) {
+        return;
+    }
+    free ( al->bits );
+    free ( al->rows );
+    free ( al->matrix );
     free ( al->alignment );
     free ( al );
 }
@@ -17,12 +17,15 @@ allele_t * allele_init ( long int size, allele_t * allele ) {
     if ( allele == NULL ) {
         allele = malloc ( sizeof ( allele_t ) );
         allele->sequence = NULL;
-        allele->alignment = NULL;
+        allele->run = NULL;
+        allele->run_size = 0;
     }
     // Update of internal values
     allele->buffer_size = floor ( size * 1.5 );
     allele->sequence = realloc ( allele->sequence, ( sizeof ( char ) ) * allele->buffer_size );
-    allele->alignment = realloc ( allele->alignment, ( sizeof ( char ) ) * allele->buffer_size );
+    allele->n_run = 0;
+    allele->output = NULL;
+    allele->flushed = 0;
     // Initial conditions
     allele->pos = 0;
     allele->ref = 0;
@@ -30,91 +33,261 @@ allele_t * allele_init ( long int size, allele_t * allele ) {
     return allele;
 }
 
-allele_t * allele_point ( long int size, char * sequence, char * alignment, allele_t * allele ) {
+allele_t * allele_stream ( FILE * output, allele_t * allele ) {
+    if ( allele == NULL ) {
+        allele = malloc ( sizeof ( allele_t ) );
+        allele->sequence = malloc ( sizeof ( char ) * ALLELE_BUFFER );
+        allele->run = NULL;
+        allele->run_size = 0;
+    }
+    allele->buffer_size = ALLELE_BUFFER;
+    allele->n_run = 0;
+    allele->output = output;
+    allele->flushed = 0;
+    allele->pos = 0;
+    allele->ref = 0;
+    allele->alg = 0;
+    return allele;
+}
+
+int allele_flush ( allele_t * allele ) {
+    size_t len = allele->pos - allele->flushed;
+
+    if ( allele->output == NULL ) {
+        return 0;
+    }
+    if ( fwrite ( allele->sequence, sizeof ( char ), len, allele->output ) != len ) {
+        return -1;
+    }
+    allele->flushed = allele->pos;
+    return 0;
+}
+
+/*
+ * Writes characters of the sequence at the current
+ * position, flushing the buffer of a streamed allele
+ * when it's full. The position isn't updated.
+ */
+static int __put ( char * s, long int len, allele_t * allele ) {
+    if ( allele->output != NULL && allele->pos - allele->flushed + len > allele->buffer_size ) {
+        if ( allele_flush ( allele ) != 0 ) {
+            return -1;
+        }
+        // Too long to be buffered
+        if ( len > allele->buffer_size ) {
+            if ( fwrite ( s, sizeof ( char ), len, allele->output ) != ( size_t ) len ) {
+                return -1;
+            }
+            allele->flushed += len;
+            return 0;
+        }
+    }
+    memcpy ( &allele->sequence[allele->pos - allele->flushed], s, len );
+    return 0;
+}
+
+allele_t * allele_point ( long int size, char * sequence, allele_run_t * run, long int n_run, allele_t * allele ) {
     if ( allele == NULL ) {
         allele = malloc ( sizeof ( allele_t ) );
     }
     allele->buffer_size = size;
     allele->sequence = sequence;
-    allele->alignment = alignment;
+    allele->run = run;
+    allele->n_run = n_run;
+    allele->run_size = n_run;
+    allele->output = NULL;
+    allele->flushed = 0;
     allele->pos = 0;
     allele->ref = 0;
     allele->alg = 0;
     return allele;
 }
 
+int allele_append ( char op, long int len, allele_t * allele ) {
+    allele_run_t * last = ( allele->n_run > 0 ) ? &allele->run[allele->n_run - 1] : NULL;
+    allele_run_t * run;
+    long int size;
+
+    if ( len <= 0 ) {
+        return 0;
+    }
+
+    // New run
+    if ( last == NULL || last->op != op ) {
+        if ( allele->n_run == allele->run_size ) {
+            // The runs are kept if they can't grow
+            size = ( allele->run_size > 0 ) ? allele->run_size * 2 : 64;
+            run = realloc ( allele->run, sizeof ( allele_run_t ) * size );
+            if ( run == NULL ) {
+                return -1;
+            }
+            allele->run = run;
+            allele->run_size = size;
+        }
+        last = &allele->run[allele->n_run++];
+        last->alg = allele->alg;
+        last->pos = allele->pos;
+        last->ref = allele->ref;
+        last->len = 0;
+        last->op = op;
+    }
+    last->len += len;
+
+    // Update index
+    switch ( op ) {
+      case 'I': allele->pos += len; break;
+      case 'D': allele->ref += len; break;
+      default: allele->pos += len; allele->ref += len; break;
+    }
+    allele->alg += len;
+
+    return 0;
+}
+
+allele_run_t * allele_parse ( char * s, bool compact, long int * n_run ) {
+    allele_t allele;
+    long int len;
+    char * end;
+
+    allele_point ( 0, NULL, NULL, 0, &allele );
+    while ( *s != '\0' ) {
+        if ( compact ) {
+            len = strtol ( s, &end, 10 );
+            if ( end == s || *end == '\0' ) {
+                free ( allele.run );
+                return NULL;
+            }
+            s = end;
+        } else {
+            len = 1;
+        }
+        if ( allele_append ( *s, len, &allele ) != 0 ) {
+            return NULL;
+        }
+        s ++;
+    }
+
+    *n_run = allele.n_run;
+    return allele.run;
+}
+
+void allele_write ( FILE * file, allele_t * allele ) {
+    for ( long int r = 0; r < allele->n_run; r ++ ) {
+        fprintf ( file, "%ld%c", allele->run[r].len, allele->run[r].op );
+    }
+}
+
+/*
+ * Value of the monitored position at
+ * the beginning of a run.
+ */
+static inline long int __start ( allele_run_t * run, bool from_reference ) {
+    return ( from_reference ) ? run->ref : run->pos;
+}
+
 int allele_seek ( int position, bool from_reference, allele_t * allele ) {
-    long int * p;
-    char target;
-    if ( allele->alignment == NULL ) {
+    // Set which character doesn't consume the position
+    char target = ( from_reference ) ? 'I' : 'D';
+    allele_run_t * run;
+    long int lo = 0;
+    long int hi = allele->n_run - 1;
+    long int r = -1;
+
+    if ( allele->run == NULL ) {
         allele->pos = position;
         allele->ref = position;
         return allele->pos;
     }
 
-    // Set which position is to be monitored
-    p = ( from_reference ) ? &(allele->ref) : &(allele->pos);
-    // Set which character has to be ignored
-    target = ( from_reference ) ? 'I' : 'D';
-
-    // Up to the end of the alignment
-    while ( allele->alg < allele->buffer_size ) {
-      // If the desired position is found and
-      // there are no more corresponding ones
-      if ( *p == position && allele->alignment[allele->alg] != target ) {
-        return ( from_reference ) ? allele->pos : allele->ref;
-      }
-      // Increase the pointers
-      switch ( allele->alignment[allele->alg] ) {
-        case 'I': allele->pos ++; break;
-        case 'D': allele->ref ++; break;
-        default: allele->pos ++; allele->ref ++; break;
-      }
-      allele->alg ++;
-    }
-    // Position not found
+    // Last run starting before the position
+    while ( lo <= hi ) {
+        long int mid = ( lo + hi ) / 2;
+        if ( __start ( &allele->run[mid], from_reference ) <= position ) {
+            r = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    // Runs not consuming the position are followed by one starting at the same position
+    if ( r >= 0 && allele->run[r].op != target && position < __start ( &allele->run[r], from_reference ) + allele->run[r].len ) {
+        run = &allele->run[r];
+        long int offset = position - __start ( run, from_reference );
+        allele->alg = run->alg + offset;
+        allele->pos = run->pos + ( ( run->op != 'D' ) ? offset : 0 );
+        allele->ref = run->ref + ( ( run->op != 'I' ) ? offset : 0 );
+    }
+    // Position not found, end of the alignment
+    else if ( allele->n_run > 0 ) {
+        run = &allele->run[allele->n_run - 1];
+        allele->alg = run->alg + run->len;
+        allele->pos = run->pos + ( ( run->op != 'D' ) ? run->len : 0 );
+        allele->ref = run->ref + ( ( run->op != 'I' ) ? run->len : 0 );
+    }
+
     return ( from_reference ) ? allele->pos : allele->ref;
 }
 
+long int allele_run ( long int alg, allele_t * allele ) {
+    long int lo = 0;
+    long int hi = allele->n_run - 1;
+
+    while ( lo <= hi ) {
+        long int mid = ( lo + hi ) / 2;
+        if ( alg < allele->run[mid].alg ) {
+            hi = mid - 1;
+        } else if ( alg >= allele->run[mid].alg + allele->run[mid].len ) {
+            lo = mid + 1;
+        } else {
+            return mid;
+        }
+    }
+    return -1;
+}
+
+int allele_copy ( char * ref, long int len, allele_t * allele ) {
+    if ( __put ( ref, len, allele ) != 0 ) {
+        return -1;
+    }
+    return allele_append ( '=', len, allele );
+}
+
 int allele_variation ( char * ref, char * alt, allele_t * allele ) {
     int ref_len = strlen ( ref );
     int alt_len = strlen ( alt );
     int offset = ref_len - alt_len;
     int min = ( offset < 0 ) ? ref_len : alt_len;
-    int max = ( offset < 0 ) ? alt_len : ref_len;
     char c = ( offset < 0 ) ? 'I' : 'D';
+    int i = 0;
+    int j;
 
     // Application
-    memcpy (
-        &allele->sequence[allele->pos],
-        alt,
-        alt_len
-    );
-
-    // Alignment
-    for ( int i = 0; i < min; i ++ ) {
+    if ( __put ( alt, alt_len, allele ) != 0 ) {
+        return -1;
+    }
+
+    // Alignment, runs of matches and mismatches
+    while ( i < min ) {
+        j = i;
         if ( alt[i] == ref[i] ) {
-            allele->alignment[allele->alg + i] = '=';
+            while ( j < min && alt[j] == ref[j] ) j ++;
+            if ( allele_append ( '=', j - i, allele ) != 0 ) return -1;
         } else {
-            allele->alignment[allele->alg + i] = 'X';
+            while ( j < min && alt[j] != ref[j] ) j ++;
+            if ( allele_append ( 'X', j - i, allele ) != 0 ) return -1;
         }
+        i = j;
+    }
+    if ( allele_append ( c, abs ( offset ), allele ) != 0 ) {
+        return -1;
     }
-    memset (
-        &allele->alignment[allele->alg + min],
-        c,
-        abs ( offset )
-    );
-
-    //  Update index
-    allele->ref += ref_len;
-    allele->pos += alt_len;
-    allele->alg += max;
 
     return 0;
 }
 
 void allele_destroy ( allele_t * allele ) {
     free ( allele->sequence );
-    free ( allele->alignment );
+    free ( allele->run );
     free ( allele );
 }
@@ -0,0 +1,130 @@
+/*
+ * CNRSIM
+ * amplification.c
+ * Map from the positions of an amplified
+ * sequence to the positions of the reference,
+ * the amplified nucleotides are synthesized
+ * only when a window is requested.
+ *
+ * @author Riccardo Massidda
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "amplification.h"
+
+amp_map_t * amp_map_init ( amp_map_t * map ) {
+    if ( map == NULL ) {
+        map = malloc ( sizeof ( amp_map_t ) );
+        if ( map == NULL ) {
+            return NULL;
+        }
+        map->piece = NULL;
+        map->size = 0;
+    }
+    map->n = 0;
+    map->len = 0;
+    return map;
+}
+
+int __append ( long ref, int period, long len, amp_map_t * map ) {
+    if ( map->n == map->size ) {
+        long size = ( map->size == 0 ) ? 64 : 2 * map->size;
+        amp_piece_t * piece = realloc ( map->piece, sizeof ( amp_piece_t ) * size );
+        if ( piece == NULL ) {
+            return -1;
+        }
+        map->piece = piece;
+        map->size = size;
+    }
+    map->piece[map->n].amp = map->len;
+    map->piece[map->n].ref = ref;
+    map->piece[map->n].len = len;
+    map->piece[map->n].period = period;
+    map->n ++;
+    map->len += len;
+    return 0;
+}
+
+int amp_map_copy ( long ref, long len, amp_map_t * map ) {
+    amp_piece_t * last = ( map->n > 0 ) ? &map->piece[map->n - 1] : NULL;
+
+    if ( len <= 0 ) {
+        return 0;
+    }
+    // Contiguous copies are merged
+    if ( last != NULL && last->period == 0 && last->ref + last->len == ref ) {
+        last->len += len;
+        map->len += len;
+        return 0;
+    }
+    return __append ( ref, 0, len, map );
+}
+
+int amp_map_repeat ( long ref, int period, long len, amp_map_t * map ) {
+    if ( len <= 0 ) {
+        return 0;
+    }
+    // A single repetition is a copy
+    if ( len <= period ) {
+        return amp_map_copy ( ref, len, map );
+    }
+    return __append ( ref, period, len, map );
+}
+
+long amp_map_unpack ( long pos, long len, char * out, pack_t * pack, amp_map_t * map ) {
+    long end;
+    long lo, hi;
+    long o = 0;
+
+    // Interval inside the sequence
+    pos = ( pos < map->len ) ? pos : map->len;
+    len = ( len > 0 ) ? len : 0;
+    end = ( len < map->len - pos ) ? pos + len : map->len;
+    out[0] = '\0';
+
+    // Last piece starting before the position
+    lo = 0;
+    hi = map->n;
+    while ( hi - lo > 1 ) {
+        long mid = lo + ( hi - lo ) / 2;
+        if ( map->piece[mid].amp <= pos ) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    for ( long i = lo; i < map->n && pos + o < end; i ++ ) {
+        amp_piece_t * p = &map->piece[i];
+        // Overlap of the piece and the interval
+        long s = pos + o - p->amp;
+        long n = ( p->len - s < end - pos - o ) ? p->len - s : end - pos - o;
+        if ( p->period == 0 ) {
+            pack_unpack ( p->ref + s, n, &out[o], pack );
+        } else {
+            // First period, rotated by the offset
+            long phase = s % p->period;
+            long head = ( p->period - phase < n ) ? p->period - phase : n;
+            pack_unpack ( p->ref + phase, head, &out[o], pack );
+            if ( head < n ) {
+                pack_unpack ( p->ref, ( phase < n - head ) ? phase : n - head, &out[o + head], pack );
+            }
+            // Repetitions of the first period
+            for ( long j = p->period; j < n; j ++ ) {
+                out[o + j] = out[o + j - p->period];
+            }
+        }
+        o += n;
+    }
+    out[o] = '\0';
+
+    return o;
+}
+
+void amp_map_destroy ( amp_map_t * map ) {
+    if ( map == NULL ) {
+        return;
+    }
+    free ( map->piece );
+    free ( map );
+}
@@ -0,0 +1,274 @@
+/*
+ * CNRSIM
+ * encoding.c
+ * Conversions between the representations
+ * of the nucleotides, through lookup tables
+ * or vector instructions if available.
+ *
+ * @author Riccardo Massidda
+ */
+#include <string.h>
+#include "encoding.h"
+#if defined ( __AVX2__ )
+#include <immintrin.h>
+#elif defined ( __SSSE3__ )
+#include <tmmintrin.h>
+#endif
+
+const uint8_t enc_code[256] = {
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 0, 4, 1, 4, 4, 4, 2, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 0, 4, 1, 4, 4, 4, 2, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4
+};
+
+const char enc_base[256] =
+    "ACGTNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNN"
+    "NNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNN"
+    "NNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNN"
+    "NNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNN";
+
+// Symbols of the 4 bit nucleotides of BAM
+static const char __nt16[16] = "=ACMGRSVTWYHKDBN";
+
+// Nucleotides of each byte of a BAM sequence
+static const char __nibbles[256][2] = {
+    "==", "=A", "=C", "=M", "=G", "=R", "=S", "=V",
+    "=T", "=W", "=Y", "=H", "=K", "=D", "=B", "=N",
+    "A=", "AA", "AC", "AM", "AG", "AR", "AS", "AV",
+    "AT", "AW", "AY", "AH", "AK", "AD", "AB", "AN",
+    "C=", "CA", "CC", "CM", "CG", "CR", "CS", "CV",
+    "CT", "CW", "CY", "CH", "CK", "CD", "CB", "CN",
+    "M=", "MA", "MC", "MM", "MG", "MR", "MS", "MV",
+    "MT", "MW", "MY", "MH", "MK", "MD", "MB", "MN",
+    "G=", "GA", "GC", "GM", "GG", "GR", "GS", "GV",
+    "GT", "GW", "GY", "GH", "GK", "GD", "GB", "GN",
+    "R=", "RA", "RC", "RM", "RG", "RR", "RS", "RV",
+    "RT", "RW", "RY", "RH", "RK", "RD", "RB", "RN",
+    "S=", "SA", "SC", "SM", "SG", "SR", "SS", "SV",
+    "ST", "SW", "SY", "SH", "SK", "SD", "SB", "SN",
+    "V=", "VA", "VC", "VM", "VG", "VR", "VS", "VV",
+    "VT", "VW", "VY", "VH", "VK", "VD", "VB", "VN",
+    "T=", "TA", "TC", "TM", "TG", "TR", "TS", "TV",
+    "TT", "TW", "TY", "TH", "TK", "TD", "TB", "TN",
+    "W=", "WA", "WC", "WM", "WG", "WR", "WS", "WV",
+    "WT", "WW", "WY", "WH", "WK", "WD", "WB", "WN",
+    "Y=", "YA", "YC", "YM", "YG", "YR", "YS", "YV",
+    "YT", "YW", "YY", "YH", "YK", "YD", "YB", "YN",
+    "H=", "HA", "HC", "HM", "HG", "HR", "HS", "HV",
+    "HT", "HW", "HY", "HH", "HK", "HD", "HB", "HN",
+    "K=", "KA", "KC", "KM", "KG", "KR", "KS", "KV",
+    "KT", "KW", "KY", "KH", "KK", "KD", "KB", "KN",
+    "D=", "DA", "DC", "DM", "DG", "DR", "DS", "DV",
+    "DT", "DW", "DY", "DH", "DK", "DD", "DB", "DN",
+    "B=", "BA", "BC", "BM", "BG", "BR", "BS", "BV",
+    "BT", "BW", "BY", "BH", "BK", "BD", "BB", "BN",
+    "N=", "NA", "NC", "NM", "NG", "NR", "NS", "NV",
+    "NT", "NW", "NY", "NH", "NK", "ND", "NB", "NN"
+};
+
+// Nucleotides of each packed byte
+static const char __unpack[256][4] = {
+    "AAAA", "AAAC", "AAAG", "AAAT", "AACA", "AACC", "AACG", "AACT",
+    "AAGA", "AAGC", "AAGG", "AAGT", "AATA", "AATC", "AATG", "AATT",
+    "ACAA", "ACAC", "ACAG", "ACAT", "ACCA", "ACCC", "ACCG", "ACCT",
+    "ACGA", "ACGC", "ACGG", "ACGT", "ACTA", "ACTC", "ACTG", "ACTT",
+    "AGAA", "AGAC", "AGAG", "AGAT", "AGCA", "AGCC", "AGCG", "AGCT",
+    "AGGA", "AGGC", "AGGG", "AGGT", "AGTA", "AGTC", "AGTG", "AGTT",
+    "ATAA", "ATAC", "ATAG", "ATAT", "ATCA", "ATCC", "ATCG", "ATCT",
+    "ATGA", "ATGC", "ATGG", "ATGT", "ATTA", "ATTC", "ATTG", "ATTT",
+    "CAAA", "CAAC", "CAAG", "CAAT", "CACA", "CACC", "CACG", "CACT",
+    "CAGA", "CAGC", "CAGG", "CAGT", "CATA", "CATC", "CATG", "CATT",
+    "CCAA", "CCAC", "CCAG", "CCAT", "CCCA", "CCCC", "CCCG", "CCCT",
+    "CCGA", "CCGC", "CCGG", "CCGT", "CCTA", "CCTC", "CCTG", "CCTT",
+    "CGAA", "CGAC", "CGAG", "CGAT", "CGCA", "CGCC", "CGCG", "CGCT",
+    "CGGA", "CGGC", "CGGG", "CGGT", "CGTA", "CGTC", "CGTG", "CGTT",
+    "CTAA", "CTAC", "CTAG", "CTAT", "CTCA", "CTCC", "CTCG", "CTCT",
+    "CTGA", "CTGC", "CTGG", "CTGT", "CTTA", "CTTC", "CTTG", "CTTT",
+    "GAAA", "GAAC", "GAAG", "GAAT", "GACA", "GACC", "GACG", "GACT",
+    "GAGA", "GAGC", "GAGG", "GAGT", "GATA", "GATC", "GATG", "GATT",
+    "GCAA", "GCAC", "GCAG", "GCAT", "GCCA", "GCCC", "GCCG", "GCCT",
+    "GCGA", "GCGC", "GCGG", "GCGT", "GCTA", "GCTC", "GCTG", "GCTT",
+    "GGAA", "GGAC", "GGAG", "GGAT", "GGCA", "GGCC", "GGCG", "GGCT",
+    "GGGA", "GGGC", "GGGG", "GGGT", "GGTA", "GGTC", "GGTG", "GGTT",
+    "GTAA", "GTAC", "GTAG", "GTAT", "GTCA", "GTCC", "GTCG", "GTCT",
+    "GTGA", "GTGC", "GTGG", "GTGT", "GTTA", "GTTC", "GTTG", "GTTT",
+    "TAAA", "TAAC", "TAAG", "TAAT", "TACA", "TACC", "TACG", "TACT",
+    "TAGA", "TAGC", "TAGG", "TAGT", "TATA", "TATC", "TATG", "TATT",
+    "TCAA", "TCAC", "TCAG", "TCAT", "TCCA", "TCCC", "TCCG", "TCCT",
+    "TCGA", "TCGC", "TCGG", "TCGT", "TCTA", "TCTC", "TCTG", "TCTT",
+    "TGAA", "TGAC", "TGAG", "TGAT", "TGCA", "TGCC", "TGCG", "TGCT",
+    "TGGA", "TGGC", "TGGG", "TGGT", "TGTA", "TGTC", "TGTG", "TGTT",
+    "TTAA", "TTAC", "TTAG", "TTAT", "TTCA", "TTCC", "TTCG", "TTCT",
+    "TTGA", "TTGC", "TTGG", "TTGT", "TTTA", "TTTC", "TTTG", "TTTT"
+};
+
+void enc_nibbles ( const uint8_t * nibbles, long len, char * out ) {
+    long i = 0;
+
+#if defined ( __AVX2__ )
+    // 64 nucleotides at once, the symbols are shuffled by the nibbles
+    __m256i table = _mm256_broadcastsi128_si256 ( _mm_loadu_si128 ( ( const __m128i * ) __nt16 ) );
+    __m256i low = _mm256_set1_epi8 ( 0x0f );
+    for ( ; i + 64 <= len; i += 64 ) {
+        __m256i v = _mm256_loadu_si256 ( ( const __m256i * ) &nibbles[i >> 1] );
+        __m256i hi = _mm256_shuffle_epi8 ( table, _mm256_and_si256 ( _mm256_srli_epi16 ( v, 4 ), low ) );
+        __m256i lo = _mm256_shuffle_epi8 ( table, _mm256_and_si256 ( v, low ) );
+        // Interleaved inside the lanes, then sorted
+        __m256i a = _mm256_unpacklo_epi8 ( hi, lo );
+        __m256i b = _mm256_unpackhi_epi8 ( hi, lo );
+        _mm256_storeu_si256 ( ( __m256i * ) &out[i], _mm256_permute2x128_si256 ( a, b, 0x20 ) );
+        _mm256_storeu_si256 ( ( __m256i * ) &out[i + 32], _mm256_permute2x128_si256 ( a, b, 0x31 ) );
+    }
+#endif
+#if defined ( __SSSE3__ )
+    // 32 nucleotides at once
+    __m128i table_sse = _mm_loadu_si128 ( ( const __m128i * ) __nt16 );
+    __m128i low_sse = _mm_set1_epi8 ( 0x0f );
+    for ( ; i + 32 <= len; i += 32 ) {
+        __m128i v = _mm_loadu_si128 ( ( const __m128i * ) &nibbles[i >> 1] );
+        __m128i hi = _mm_shuffle_epi8 ( table_sse, _mm_and_si128 ( _mm_srli_epi16 ( v, 4 ), low_sse ) );
+        __m128i lo = _mm_shuffle_epi8 ( table_sse, _mm_and_si128 ( v, low_sse ) );
+        _mm_storeu_si128 ( ( __m128i * ) &out[i], _mm_unpacklo_epi8 ( hi, lo ) );
+        _mm_storeu_si128 ( ( __m128i * ) &out[i + 16], _mm_unpackhi_epi8 ( hi, lo ) );
+    }
+#endif
+
+    // Two nucleotides per byte
+    for ( ; i + 2 <= len; i += 2 ) {
+        memcpy ( &out[i], __nibbles[nibbles[i >> 1]], 2 );
+    }
+    if ( i < len ) {
+        out[i] = __nt16[nibbles[i >> 1] >> 4];
+    }
+}
+
+void enc_pack ( const char * seq, long len, uint8_t * out ) {
+    const unsigned char * s = ( const unsigned char * ) seq;
+    long i = 0;
+
+    /*
+     * The two bits of A, C, G and T in any case are
+     * ( ( c >> 1 ) ^ ( c >> 2 ) ) & 3, the other characters
+     * are cleared, then each four codes are summed
+     * with the weights of their bits.
+     */
+#if defined ( __AVX2__ )
+    __m256i three = _mm256_set1_epi8 ( 3 );
+    __m256i upper = _mm256_set1_epi8 ( ( char ) 0xdf );
+    __m256i weight = _mm256_set1_epi32 ( 0x01041040 );
+    for ( ; i + 32 <= len; i += 32 ) {
+        __m256i c = _mm256_loadu_si256 ( ( const __m256i * ) &s[i] );
+        __m256i u = _mm256_and_si256 ( c, upper );
+        __m256i ok = _mm256_or_si256 (
+                _mm256_or_si256 ( _mm256_cmpeq_epi8 ( u, _mm256_set1_epi8 ( 'A' ) ), _mm256_cmpeq_epi8 ( u, _mm256_set1_epi8 ( 'C' ) ) ),
+                _mm256_or_si256 ( _mm256_cmpeq_epi8 ( u, _mm256_set1_epi8 ( 'G' ) ), _mm256_cmpeq_epi8 ( u, _mm256_set1_epi8 ( 'T' ) ) ) );
+        __m256i code = _mm256_xor_si256 ( _mm256_srli_epi16 ( c, 1 ), _mm256_srli_epi16 ( c, 2 ) );
+        code = _mm256_and_si256 ( _mm256_and_si256 ( code, three ), ok );
+        __m256i quad = _mm256_madd_epi16 ( _mm256_maddubs_epi16 ( code, weight ), _mm256_set1_epi16 ( 1 ) );
+        quad = _mm256_packs_epi32 ( quad, quad );
+        quad = _mm256_packus_epi16 ( quad, quad );
+        // Four bytes in each lane
+        uint32_t word[2] = { _mm256_extract_epi32 ( quad, 0 ), _mm256_extract_epi32 ( quad, 4 ) };
+        memcpy ( &out[i >> 2], word, 8 );
+    }
+#endif
+#if defined ( __SSSE3__ )
+    __m128i three_sse = _mm_set1_epi8 ( 3 );
+    __m128i upper_sse = _mm_set1_epi8 ( ( char ) 0xdf );
+    __m128i weight_sse = _mm_set1_epi32 ( 0x01041040 );
+    for ( ; i + 16 <= len; i += 16 ) {
+        __m128i c = _mm_loadu_si128 ( ( const __m128i * ) &s[i] );
+        __m128i u = _mm_and_si128 ( c, upper_sse );
+        __m128i ok = _mm_or_si128 (
+                _mm_or_si128 ( _mm_cmpeq_epi8 ( u, _mm_set1_epi8 ( 'A' ) ), _mm_cmpeq_epi8 ( u, _mm_set1_epi8 ( 'C' ) ) ),
+                _mm_or_si128 ( _mm_cmpeq_epi8 ( u, _mm_set1_epi8 ( 'G' ) ), _mm_cmpeq_epi8 ( u, _mm_set1_epi8 ( 'T' ) ) ) );
+        __m128i code = _mm_xor_si128 ( _mm_srli_epi16 ( c, 1 ), _mm_srli_epi16 ( c, 2 ) );
+        code = _mm_and_si128 ( _mm_and_si128 ( code, three_sse ), ok );
+        __m128i quad = _mm_madd_epi16 ( _mm_maddubs_epi16 ( code, weight_sse ), _mm_set1_epi16 ( 1 ) );
+        quad = _mm_packs_epi32 ( quad, quad );
+        quad = _mm_packus_epi16 ( quad, quad );
+        uint32_t word = _mm_cvtsi128_si32 ( quad );
+        memcpy ( &out[i >> 2], &word, 4 );
+    }
+#endif
+
+    // Four nucleotides per byte
+    for ( ; i + 4 <= len; i += 4 ) {
+        uint8_t byte = 0;
+        for ( int k = 0; k < 4; k ++ ) {
+            uint8_t code = enc_code[s[i + k]];
+            byte = ( byte << 2 ) | ( ( code < 4 ) ? code : 0 );
+        }
+        out[i >> 2] = byte;
+    }
+    if ( i < len ) {
+        uint8_t byte = 0;
+        for ( int k = 0; k < 4; k ++ ) {
+            uint8_t code = ( i + k < len ) ? enc_code[s[i + k]] : 0;
+            byte = ( byte << 2 ) | ( ( code < 4 ) ? code : 0 );
+        }
+        out[i >> 2] = byte;
+    }
+}
+
+void enc_unpack ( const uint8_t * bases, long pos, long len, char * out ) {
+    long end = pos + len;
+    long p;
+    char * o = out;
+
+    // Up to the first byte boundary
+    for ( p = pos; p < end && ( p & 3 ) != 0; p ++ ) {
+        *o++ = "ACGT"[( bases[p >> 2] >> ( 6 - 2 * ( p & 3 ) ) ) & 3];
+    }
+#if defined ( __SSSE3__ )
+    /*
+     * Each byte is repeated for its four nucleotides,
+     * that are shifted to the low bits and shuffled
+     * to their symbol.
+     */
+    __m128i spread = _mm_setr_epi8 ( 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3 );
+    __m128i symbol = _mm_setr_epi8 ( 'A', 'C', 'G', 'T', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 );
+    __m128i first = _mm_set1_epi32 ( 0x000000ff );
+    __m128i second = _mm_set1_epi32 ( 0x0000ff00 );
+    __m128i third = _mm_set1_epi32 ( 0x00ff0000 );
+    __m128i fourth = _mm_set1_epi32 ( ( int ) 0xff000000 );
+    __m128i three = _mm_set1_epi8 ( 3 );
+    for ( ; p + 16 <= end; p += 16, o += 16 ) {
+        uint32_t word;
+        memcpy ( &word, &bases[p >> 2], 4 );
+        __m128i x = _mm_shuffle_epi8 ( _mm_cvtsi32_si128 ( word ), spread );
+        __m128i code = _mm_or_si128 (
+                _mm_or_si128 ( _mm_and_si128 ( _mm_srli_epi16 ( x, 6 ), first ), _mm_and_si128 ( _mm_srli_epi16 ( x, 4 ), second ) ),
+                _mm_or_si128 ( _mm_and_si128 ( _mm_srli_epi16 ( x, 2 ), third ), _mm_and_si128 ( x, fourth ) ) );
+        code = _mm_and_si128 ( code, three );
+        _mm_storeu_si128 ( ( __m128i * ) o, _mm_shuffle_epi8 ( symbol, code ) );
+    }
+#else
+    for ( ; p + 16 <= end; p += 16, o += 16 ) {
+        memcpy ( o, __unpack[bases[p >> 2]], 4 );
+        memcpy ( o + 4, __unpack[bases[( p >> 2 ) + 1]], 4 );
+        memcpy ( o + 8, __unpack[bases[( p >> 2 ) + 2]], 4 );
+        memcpy ( o + 12, __unpack[bases[( p >> 2 ) + 3]], 4 );
+    }
+#endif
+    // Four nucleotides per byte
+    for ( ; p + 4 <= end; p += 4, o += 4 ) {
+        memcpy ( o, __unpack[bases[p >> 2]], 4 );
+    }
+    for ( ; p < end; p ++ ) {
+        *o++ = "ACGT"[( bases[p >> 2] >> ( 6 - 2 * ( p & 3 ) ) ) & 3];
+    }
+}
@@ -18,8 +18,12 @@
 #include <htslib/sam.h>
 #include <htslib/kseq.h>
 #include <time.h>
+#include <pthread.h>
+#include "align.h"
 #include "allele.h"
+#include "encoding.h"
 #include "model.h"
+#include "reference.h"
 #include "stats.h"
 #include "tandem.h"
 #include "translate_notation.h"
@@ -29,8 +33,85 @@
 // Init kseq structure
 KSEQ_INIT ( gzFile, gzread );
 
+typedef struct contig_t contig_t;
+typedef struct profiler_t profiler_t;
+typedef struct worker_t worker_t;
+
+/*
+ * Unit of work, the same sequence
+ * in each of the alleles.
+ */
+struct contig_t {
+    char * name; // name of the sequence
+    char ** seq; // sequence of each allele
+    allele_run_t ** run; // alignment of each allele, or NULL
+    long * n_run; // runs in the alignment of each allele
+    long * len; // length of each allele
+    long beg; // first position of the profiled interval
+    long end; // last position of the profiled interval, excluded
+    contig_t * next; // next contig in the queue
+};
+
+/*
+ * Options and queue of contigs
+ * shared by the workers.
+ */
+struct profiler_t {
+    char * bam_fn; // path of the BAM file
+    char * region; // profiled region, NULL for the whole file
+    int ploidy; // number of alleles
+    int tandem; // maximum number of repetitions
+    int max_insert_size; // maximum insert size
+    int size_granularity; // insert size granularity
+    int cycles; // read positions profiled one by one, 0 for all of them
+    int bin_width; // positions of each following bin, 0 for logarithmic bins
+    int density; // one read every density is profiled
+    bool verbose; // dump of the alignments
+    bool realign; // ignore the CIGAR and always realign the reads
+    bool bit_parallel; // realign with the internal aligner instead of edlib
+    region_index_t * alias_index; // alias dictionary
+    tandem_cache_t ** annotation; // repetitions of each allele, NULL if not analyzed
+    EdlibAlignConfig config; // aligner configuration
+    contig_t * head; // first contig in the queue
+    contig_t * tail; // last contig in the queue
+    int queued; // contigs in the queue
+    bool finished; // no more contigs will be queued
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/*
+ * State of a thread, each worker has its
+ * own accumulator, BAM handle and buffers.
+ */
+struct worker_t {
+    profiler_t * profiler; // shared data
+    pthread_t thread;
+    model_t * model; // statistics learned by the worker
+    htsFile * fp;
+    bam_hdr_t * hdr;
+    bam1_t * line;
+    hts_idx_t * index;
+    allele_t ** allele;
+    tandem_set_t ** trs;
+    EdlibAlignResult * edlib_alg;
+    aligner_t ** aligner; // internal aligner of each allele
+    char * read; // buffer of the read
+    unsigned char * alg; // buffer of the alignment derived from the CIGAR
+    int alg_size;
+    long long read_counter;
+    long long skipped;
+};
+
+EdlibEqualityPair additionalEqualities[4] = {
+    {'A', 'a'},
+    {'C', 'c'},
+    {'G', 'g'},
+    {'T', 't'}
+};
+
 void usage ( char * name ) {
-    fprintf ( stderr, "Usage: %s [-d dictionary] [-t] [-v] [-s] bam_file fasta_file [allele_file ...]\n", name );
+    fprintf ( stderr, "Usage: %s [-d dictionary] [-t] [-j threads] [-o binary_model] [-e] [-b] [-v] [-s] [-r region] [-c cycles] [-w bin_width] bam_file fasta_file [allele_file ...]\n", name );
 }
 
 void dump_read ( char * ref, unsigned char * alignment, int alg_len, char * read, uint8_t * quality ) {
@@ -96,94 +177,689 @@ void dump_read ( char * ref, unsigned char * alignment, int alg_len, char * read
     printf ( "\n" );
 }
 
-int main ( int argc, char ** argv ) {
-    // Parser
-    int opt;
-    char * dictionary = NULL;
-    char * bam_fn;
-    bool verbose = false;
-    bool silent = false;
-    int ploidy;
-    // FASTA
-    gzFile * fasta;
-    kseq_t ** seq;
-    kseq_t * curr_seq;
-    char * align;
-    allele_t ** allele;
-    bool last = false;
-    // Tandem repeats
-    int tandem = 16;
-    tandem_set_t ** trs;
-    // Insert size granularity
-    int size_granularity = 1024;
-    // BAM
-    htsFile * fp;
-    bam_hdr_t * hdr;
-    bam1_t * line;
-    hts_idx_t * index;
+/*
+ * Checks that an allele has no variation in the
+ * before positions preceding its current one and
+ * in the after positions following it, so that the
+ * allele can be read in the coordinates of the
+ * reference. Substitutions are tolerated if snp.
+ */
+bool __unvaried ( allele_t * allele, int before, int after, bool snp ) {
+    allele_run_t * run = allele->run;
+    long r;
+
+    if ( allele->pos - before < 0 || allele->pos + after > allele->buffer_size ) {
+        return false;
+    }
+    if ( run == NULL ) {
+        return true;
+    }
+    r = allele_run ( allele->alg - before, allele );
+    if ( r < 0 || allele_run ( allele->alg + after - 1, allele ) < 0 ) {
+        return false;
+    }
+    for ( ; r < allele->n_run && run[r].alg < allele->alg + after; r ++ ) {
+        if ( run[r].op != '=' && ( !snp || run[r].op != 'X' ) ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Derives the alignment of a read from its CIGAR,
+ * comparing the read with the first allele to tell
+ * matches from mismatches. Soft clipped bases are
+ * aligned without gaps to the flanking sequence, as
+ * the realignment would do. The alleles must be
+ * already sought to the position of the read.
+ *
+ * @param w     worker owning the alignment buffer
+ * @param line  aligned read
+ * @param read  nucleotides of the read
+ * @param start first position of the alignment in the allele
+ * @returns     length of the alignment, -1 if the read has to be realigned
+ */
+int cigar_alignment ( worker_t * w, bam1_t * line, char * read, long * start ) {
+    uint32_t * cigar = bam_get_cigar ( line );
+    int n_cigar = line->core.n_cigar;
+    int ploidy = w->profiler->ploidy;
+    int clip[2] = { 0, 0 };
+    int query = 0;
+    int span = 0;
+    int deleted = 0;
+    int op;
+    int oplen;
+    int a = 0;
+    int q = 0;
+    char * ref;
+    unsigned char * alg;
+
+    // Lengths of the alignment
+    for ( int k = 0; k < n_cigar; k ++ ) {
+        op = bam_cigar_op ( cigar[k] );
+        oplen = bam_cigar_oplen ( cigar[k] );
+        switch ( op ) {
+        case BAM_CSOFT_CLIP:
+            clip[query > 0] += oplen;
+            query += oplen;
+            break;
+        case BAM_CMATCH:
+        case BAM_CEQUAL:
+        case BAM_CDIFF:
+            query += oplen;
+            span += oplen;
+            break;
+        case BAM_CINS:
+            query += oplen;
+            break;
+        case BAM_CDEL:
+            span += oplen;
+            deleted += oplen;
+            break;
+        case BAM_CREF_SKIP:
+            // Spliced reads are realigned
+            return -1;
+        }
+    }
+    if ( span == 0 || query != line->core.l_qseq ) {
+        return -1;
+    }
+
+    // The best allele is ambiguous if they differ
+    for ( int i = 0; i < ploidy; i ++ ) {
+        if ( !__unvaried ( w->allele[i], clip[0], span + clip[1], ploidy == 1 ) ) {
+            return -1;
+        }
+    }
+
+    if ( w->alg_size < query + deleted ) {
+        // Realigned by the caller if the buffer can't grow
+        alg = realloc ( w->alg, sizeof ( unsigned char ) * ( query + deleted ) );
+        if ( alg == NULL ) {
+            return -1;
+        }
+        w->alg = alg;
+        w->alg_size = query + deleted;
+    }
+    *start = w->allele[0]->pos - clip[0];
+    ref = &w->allele[0]->sequence[*start];
+
+    // Alignment codes as in edlib
+    for ( int k = 0; k < n_cigar; k ++ ) {
+        op = bam_cigar_op ( cigar[k] );
+        oplen = bam_cigar_oplen ( cigar[k] );
+        switch ( op ) {
+        case BAM_CSOFT_CLIP:
+        case BAM_CMATCH:
+        case BAM_CEQUAL:
+        case BAM_CDIFF:
+            for ( int z = 0; z < oplen; z ++ ) {
+                w->alg[a++] = ( read[q] == toupper ( *ref ) ) ? 0 : 3;
+                q ++;
+                ref ++;
+            }
+            break;
+        case BAM_CINS:
+            memset ( &w->alg[a], 1, oplen );
+            a += oplen;
+            q += oplen;
+            break;
+        case BAM_CDEL:
+            memset ( &w->alg[a], 2, oplen );
+            a += oplen;
+            ref += oplen;
+            break;
+        }
+    }
+
+    return a;
+}
+
+/*
+ * Profiles the reads aligned on a contig
+ * updating the model of the worker.
+ */
+void profile_contig ( worker_t * w, contig_t * contig ) {
+    profiler_t * pr = w->profiler;
+    model_t * model = w->model;
+    int ploidy = pr->ploidy;
+    int tandem = pr->tandem;
+    bool verbose = pr->verbose;
+    EdlibAlignResult * edlib_alg = w->edlib_alg;
+    allele_t ** allele = w->allele;
+    tandem_set_t ** trs = w->trs;
     hts_itr_t * itr;
-    // Alias dictionary
-    region_index_t * alias_index = NULL;
+    char * query;
     char * alias = NULL;
-    // Aligner
-    EdlibAlignResult  * edlib_alg;
-    EdlibAlignConfig config;
-    EdlibEqualityPair additionalEqualities[4] = {
-        {'A', 'a'},
-        {'C', 'c'},
-        {'G', 'g'},
-        {'T', 't'}
-    };
-    char * read = NULL;
+    char * read;
     int pos;
     int len;
     uint8_t * read_seq;
     uint8_t * qual;
     int insert_size;
-    int max_insert_size = 4096;
     int orientation;
     int flank_1;
     int flank_2;
     int start;
     int end;
-    // Statistics
-    model_t * model;
     stats_t * curr_stats;
-    int min_score;
-    int min_start = 0;
+    int min_score = 0;
+    long min_start = 0;
     int min_index = 0;
-    long long int read_counter = 0;
-    long long int skipped = 0;
-    int density = 1;
+    unsigned char * alg_str;
+    int alg_len;
+    bool realigned;
+    long long read_counter = 0;
+    long long skipped = 0;
+
+    // Alleles of the contig
+    for ( int i = 0; i < ploidy; i ++ ) {
+        allele[i] = allele_point (
+                contig->len[i],
+                contig->seq[i],
+                contig->run[i],
+                contig->n_run[i],
+                allele[i]
+                );
+        if ( tandem != 0 ) {
+            trs[i] = tandem_cache_analyze ( contig->name, contig->seq[i], contig->len[i], model->max_motif, tandem, 1, trs[i], pr->annotation[i] );
+            if ( trs[i] == NULL ) {
+                fprintf ( stderr, "Can't analyze the repetitions of %s.\n", contig->name );
+                exit ( EXIT_FAILURE );
+            }
+        }
+    }
+
+    // Seek on the BAM
+    if ( pr->alias_index != NULL ) {
+        alias = tr_translate ( pr->alias_index, contig->name );
+    }
+    if ( alias == NULL ){
+        alias = contig->name;
+    }
+    if ( pr->region != NULL ) {
+        // Only the reads in the interval of the region
+        query = malloc ( sizeof ( char ) * ( strlen ( alias ) + 48 ) );
+        sprintf ( query, "%s:%ld-%ld", alias, contig->beg + 1, contig->end );
+        itr = bam_itr_querys ( w->index, w->hdr, query );
+        free ( query );
+    } else {
+        itr = bam_itr_querys ( w->index, w->hdr, alias );
+    }
+    if ( itr == NULL ) {
+        fprintf ( stderr, "%s not found.\n", contig->name );
+        return;
+    }
+
+    while ( bam_itr_next ( w->fp, itr, w->line ) > 0 ) {
+        bam1_t * line = w->line;
+        read_counter++;
+        if ( read_counter % pr->density != 0 ) {
+          skipped ++;
+          continue;
+        }
+
+        if ( (( line->core.flag & 1 ) && ( line->core.flag & 2 )) || line->core.flag == 0 || line->core.flag == 16 ){
+          // Read information
+          pos = line->core.pos;
+          len = line->core.l_qseq;
+          read_seq = bam_get_seq ( line ); // Read nucleotides
+          qual = bam_get_qual ( line ); // Quality score
+          curr_stats = ( line->core.flag & 64 ) ? model->single : model->pair;
+          curr_stats = ( line->core.flag & 128 ) ? model->pair : model->single;
+          if ( line->core.flag == 0 || line->core.flag == 16 ) {
+            curr_stats = model->single;
+          }
+        }
+        else{
+            skipped++;
+            continue;
+        }
+
+        if ( curr_stats == model->single && ( line->core.tid == line->core.mtid || line->core.mtid == -1 ) ){
+          insert_size = line->core.mpos - ( pos + len );
+          insert_size = ( insert_size < 0 ) ? -insert_size : insert_size;
+          // Longer inserts are in the last bin
+          insert_size = ( insert_size < pr->max_insert_size ) ? insert_size : pr->max_insert_size - 1;
+          insert_size = ( int ) ( ( long ) insert_size * pr->size_granularity / pr->max_insert_size );
+          insert_size = ( line->core.mtid == -1 ) ? 0 : insert_size;
+          source_update ( NULL, 0, 0, insert_size, model->insert_size );
+          orientation = ( line->core.flag & 48 ) >> 4;
+          source_update ( NULL, 0, 0, orientation, model->orientation );
+        }
+
+        // Interval of the reference
+        flank_1 = floor ( log ( 2 * len ) / log ( 2 ) );
+        flank_2 = flank_1;
+
+        // Read string
+        int i;
+        read = realloc ( w->read, sizeof ( char ) * ( len + 1 ) );
+        if ( read == NULL ) {
+            fprintf ( stderr, "Can't allocate the read.\n" );
+            exit ( EXIT_FAILURE );
+        }
+        w->read = read;
+        enc_nibbles ( read_seq, len, read );
+        read[len] = 0;
+
+        // Dumps of different threads aren't mixed
+        if ( verbose ) {
+            flockfile ( stdout );
+        }
+
+        // Seek on the alleles
+        for ( i = 0; i < ploidy; i ++ ) {
+            allele_seek ( pos, true, allele[i] );
+        }
+
+        // Alignment of the aligner if the alleles don't differ around the read
+        alg_len = ( pr->realign ) ? -1 : cigar_alignment ( w, line, read, &min_start );
+        realigned = ( alg_len < 0 );
+        if ( !realigned ) {
+            min_index = 0;
+            alg_str = w->alg;
+            if ( verbose ) {
+                printf ( "Sequence no.0 %d->%ld\n", pos, allele[0]->pos );
+                dump_read ( &contig->seq[0][min_start], alg_str, alg_len, read, qual );
+            }
+        }
+
+        for ( i = 0; realigned && i < ploidy; i ++ ) {
+            // Flanking regions
+            start = allele[i]->pos;
+            if ( start - flank_1 < 0 ) {
+                start = 0;
+            } else {
+                start -= flank_1;
+            }
+
+            end = allele[i]->pos + len;
+            if ( end + flank_2 >= contig->len[i] ) {
+                end = contig->len[i] - 1;
+            } else {
+                end += flank_2;
+            }
+
+            // Align
+            if ( pr->bit_parallel ) {
+                if ( al_align ( read, len, &contig->seq[i][start], end - start, w->aligner[i] ) < 0 ) {
+                    fprintf ( stderr, "Can't align the read.\n" );
+                    exit ( EXIT_FAILURE );
+                }
+                // Result exposed as the edlib one, the buffers belong to the aligner
+                edlib_alg[i].editDistance = w->aligner[i]->distance;
+                edlib_alg[i].startLocations = &w->aligner[i]->start;
+                edlib_alg[i].alignment = w->aligner[i]->alignment;
+                edlib_alg[i].alignmentLength = w->aligner[i]->length;
+            } else {
+                edlib_alg[i] = edlibAlign (
+                                   read,
+                                   len,
+                                   &contig->seq[i][start],
+                                   end - start,
+                                   pr->config );
+            }
+
+            // Select best alignment
+            if ( i == 0 || edlib_alg[i].editDistance < min_score ) {
+                min_index = i;
+                min_start = start + edlib_alg[i].startLocations[0];
+                min_score = edlib_alg[i].editDistance;
+            }
+
+            // Note: edlib c(GAP) = c(MM)
+            if ( ( line->core.flag == 147 || line->core.flag == 83 ) && edlib_alg[i].alignment[edlib_alg[i].alignmentLength-1] == 1 )
+                edlib_alg[i].alignment[edlib_alg[i].alignmentLength-1] = 3;
+
+            if ( verbose ) {
+                printf ( "Sequence no.%d %d->%ld\n", i, pos, allele[i]->pos );
+                dump_read (
+                    &contig->seq[i][start + edlib_alg[i].startLocations[0]],
+                    edlib_alg[i].alignment,
+                    edlib_alg[i].alignmentLength,
+                    read,
+                    qual );
+            }
+        }
+        if ( realigned ) {
+            alg_str = edlib_alg[min_index].alignment;
+            alg_len = edlib_alg[min_index].alignmentLength;
+        }
+
+        if ( tandem != 0 ){
+            // Tandem index
+            int tin = trs[min_index]->i;
+            // Number of tandems
+            int n = trs[min_index]->n;
+            // Tandems set
+            tandem_t * set = trs[min_index]->set;
+
+            // Tandem not in the reads
+            while ( tin < n && set[tin].pos < min_start ){
+                tin ++;
+            }
+            // Reads are sorted, so these tandems will never be used
+            trs[min_index]->i = tin;
+
+            // Possibile tandems
+            int read_end = min_start + strlen ( read );
+            while ( tin < n && set[tin].pos < read_end ){
+                // Learning example
+                int motif = set[tin].pat;
+                unsigned char in = set[tin].rep;
+                unsigned char out = 0;
+                // Find position
+                int read_pos = -1;
+                int ref_pos = min_start - 1;
+                int alg = 0;
+                // Adjust ref_pos and ref_pos
+                while ( alg < alg_len && ( ref_pos < 0 || ref_pos < set[tin].pos ) ) {
+                    switch ( alg_str[alg] ){
+                        case 1:
+                            read_pos ++;
+                            break;
+                        case 2:
+                            ref_pos ++;
+                            break;
+                        default:
+                            read_pos ++;
+                            ref_pos ++;
+                    }
+                    alg ++;
+                }
+                if ( read_pos + (out + 1) * motif < len ){
+                    // Compare pattern
+                    if ( strncasecmp ( &contig->seq[min_index][set[tin].pos], &read[read_pos], motif ) == 0 ){
+                        out = 1;
+                        // Compare right patterns
+                        while ( read_pos + (out + 1) * motif < len ){
+                            if ( strncasecmp ( &read[read_pos], &read[read_pos + out * motif], motif ) == 0 ){
+                                out ++;
+                            }
+                            else{
+                                break;
+                            }
+                        }
+                    }
+                }
+                if ( verbose ) {
+                    alg = 0;
+                    // Print of the reference tandem
+                    int z = min_start - set[tin].pos;
+                    while ( z < motif * in ){
+                        if ( alg_str[alg] == 1 ){
+                            printf ( " " );
+                        }
+                        else if ( z < 0 ){
+                            printf ( " " );
+                            z ++;
+                        }
+                        else {
+                            printf ( "%c", contig->seq[min_index][set[tin].pos+z] );
+                            z ++;
+                        }
+                        alg ++;
+                    }
+                    printf ( "\n" );
+                    alg = 0;
+                    // Print of the read tandem
+                    z = - read_pos;
+                    while ( z < motif * out ){
+                        if ( alg_str[alg] == 2 ){
+                            printf ( " " );
+                        }
+                        else if ( z < 0 ){
+                            printf ( " " );
+                            z ++;
+                        }
+                        else {
+                            printf ( "%c", read[read_pos + z] );
+                            z ++;
+                        }
+                        alg ++;
+                    }
+                    printf ( "\n" );
+                }
+                // Update tandem statistics
+                if ( in < tandem && out < tandem ) {
+                    source_update ( &in, 1, motif, out, model->amplification );
+                }
+                tin ++;
+            }
+        }
+
+        stats_update (
+            alg_str,
+            alg_len,
+            read,
+            &allele[min_index]->sequence[min_start],
+            qual,
+            curr_stats                    
+        );
+
+        if ( verbose ) {
+            funlockfile ( stdout );
+        }
+
+        for ( int i = 0; realigned && !pr->bit_parallel && i < ploidy; i ++ ) {
+            edlibFreeAlignResult ( edlib_alg[i] );
+        }
+    }
 
-    // Init pseudorandom generator
-    srand ( time ( NULL ) );
+    bam_itr_destroy ( itr );
+    w->read_counter += read_counter;
+    w->skipped += skipped;
+    fprintf ( stderr, "%s:\t%lld reads\t%lld skipped\n", contig->name, read_counter, skipped );
+}
+
+void contig_destroy ( contig_t * contig, int ploidy ) {
+    for ( int i = 0; i < ploidy; i ++ ) {
+        free ( contig->seq[i] );
+        free ( contig->run[i] );
+    }
+    free ( contig->seq );
+    free ( contig->run );
+    free ( contig->n_run );
+    free ( contig->len );
+    free ( contig->name );
+    free ( contig );
+}
+
+/*
+ * Worker thread, profiles the contigs
+ * in the queue until it's empty and closed.
+ */
+void * worker ( void * arg ) {
+    worker_t * w = arg;
+    profiler_t * pr = w->profiler;
+    contig_t * contig;
 
-    while ( ( opt = getopt ( argc, argv, "svm:i:t:d:p:" ) ) != -1 ) {
+    while ( true ) {
+        pthread_mutex_lock ( &pr->lock );
+        while ( pr->head == NULL && !pr->finished ) {
+            pthread_cond_wait ( &pr->cond, &pr->lock );
+        }
+        contig = pr->head;
+        if ( contig == NULL ) {
+            pthread_mutex_unlock ( &pr->lock );
+            break;
+        }
+        pr->head = contig->next;
+        if ( pr->head == NULL ) {
+            pr->tail = NULL;
+        }
+        pr->queued --;
+        pthread_cond_broadcast ( &pr->cond );
+        pthread_mutex_unlock ( &pr->lock );
+
+        profile_contig ( w, contig );
+        contig_destroy ( contig, pr->ploidy );
+    }
+
+    return NULL;
+}
+
+/*
+ * Initializes the state of a worker,
+ * opening its own handle of the BAM file.
+ */
+worker_t * worker_init ( profiler_t * pr, int max_motif ) {
+    worker_t * w = malloc ( sizeof ( worker_t ) );
+    w->profiler = pr;
+    w->fp = hts_open ( pr->bam_fn, "r" );
+    if ( w->fp == NULL ) {
+        fprintf ( stderr, "File %s not found.\n", pr->bam_fn );
+        exit ( EXIT_FAILURE );
+    }
+    w->hdr = sam_hdr_read ( w->fp );
+    w->line = bam_init1 ();
+    // BAM index
+    w->index = bam_index_load ( pr->bam_fn );
+    if ( w->index == NULL ) {
+        // File not indexed
+        perror ( "Can't load BAM index" );
+        exit ( EXIT_FAILURE );
+    }
+    w->model = model_init ( max_motif, pr->tandem, pr->max_insert_size, pr->size_granularity );
+    model_bin ( pr->cycles, pr->bin_width, w->model );
+    w->allele = malloc ( sizeof ( allele_t * ) * pr->ploidy );
+    w->trs = malloc ( sizeof ( tandem_set_t * ) * pr->ploidy );
+    w->edlib_alg = malloc ( sizeof ( EdlibAlignResult ) * pr->ploidy );
+    w->aligner = malloc ( sizeof ( aligner_t * ) * pr->ploidy );
+    for ( int i = 0; i < pr->ploidy; i ++ ) {
+        w->allele[i] = NULL;
+        w->trs[i] = NULL;
+        w->aligner[i] = ( pr->bit_parallel ) ? al_init () : NULL;
+    }
+    w->read = NULL;
+    w->alg = NULL;
+    w->alg_size = 0;
+    w->read_counter = 0;
+    w->skipped = 0;
+    return w;
+}
+
+void worker_destroy ( worker_t * w ) {
+    for ( int i = 0; i < w->profiler->ploidy; i ++ ) {
+        tandem_set_destroy ( w->trs[i] );
+        // Free and not destroy because
+        // the sequence is externally allocated
+        free ( w->allele[i] );
+        al_destroy ( w->aligner[i] );
+    }
+    free ( w->allele );
+    free ( w->trs );
+    free ( w->edlib_alg );
+    free ( w->aligner );
+    free ( w->read );
+    free ( w->alg );
+    bam_destroy1 ( w->line );
+    bam_hdr_destroy ( w->hdr );
+    hts_idx_destroy ( w->index );
+    sam_close ( w->fp );
+    model_destroy ( w->model );
+    free ( w );
+}
+
+/*
+ * Copies a string of kseq, that
+ * reuses its buffers on the next read.
+ */
+char * __copy ( char * s, size_t l ) {
+    char * c = malloc ( sizeof ( char ) * ( l + 1 ) );
+    memcpy ( c, s, l );
+    c[l] = '\0';
+    return c;
+}
+
+int main ( int argc, char ** argv ) {
+    // Parser
+    int opt;
+    char * dictionary = NULL;
+    char * model_fn = NULL;
+    FILE * model_fp;
+    bool silent = false;
+    int threads = 1;
+    // FASTA
+    reference_t ** ref;
+    gzFile * aln_fp;
+    kseq_t ** aln;
+    char * aln_fn = NULL;
+    bool last = false;
+    // Shared data
+    profiler_t pr;
+    worker_t ** workers;
+    contig_t * contig;
+    // Statistics
+    model_t * model;
+    long long read_counter = 0;
+    long long skipped = 0;
+
+    // Default options
+    pr.tandem = 16;
+    pr.size_granularity = 1024;
+    pr.max_insert_size = 4096;
+    pr.cycles = 0;
+    pr.bin_width = 0;
+    pr.density = 1;
+    pr.verbose = false;
+    pr.realign = false;
+    pr.bit_parallel = false;
+    pr.alias_index = NULL;
+    pr.region = NULL;
+
+    while ( ( opt = getopt ( argc, argv, "sebvm:i:t:d:p:j:o:r:c:w:" ) ) != -1 ) {
         switch ( opt ) {
         case 's':
             silent = true;
             break;
         case 'v':
-            verbose = true;
+            pr.verbose = true;
+            break;
+        case 'e':
+            pr.realign = true;
+            break;
+        case 'b':
+            pr.bit_parallel = true;
             break;
         case 't':
-            tandem = atoi ( optarg );
+            pr.tandem = atoi ( optarg );
             break;
         case 'i':
-            size_granularity = atoi ( optarg );
+            pr.size_granularity = atoi ( optarg );
             break;
         case 'm':
-            max_insert_size = atoi ( optarg );
+            pr.max_insert_size = atoi ( optarg );
             break;
         case 'd':
             dictionary = optarg;
             break;
+        case 'o':
+            model_fn = optarg;
+            break;
+        case 'r':
+            pr.region = optarg;
+            break;
         case 'p':
-            density = atoi ( optarg );
+            pr.density = atoi ( optarg );
+            break;
+        case 'c':
+            pr.cycles = atoi ( optarg );
+            break;
+        case 'w':
+            pr.bin_width = atoi ( optarg );
+            break;
+        case 'j':
+            threads = atoi ( optarg );
+            if ( threads < 1 ) {
+                fprintf ( stderr, "The number of threads must be positive.\n" );
+                exit ( EXIT_FAILURE );
+            }
             break;
         case '?':
-            if ( optopt == 'p' || optopt == 'd' || optopt == 'm' || optopt == 'i' || optopt == 't' )
+            if ( optopt == 'p' || optopt == 'd' || optopt == 'm' || optopt == 'i' || optopt == 't' || optopt == 'j' || optopt == 'o' || optopt == 'r' || optopt == 'c' || optopt == 'w' )
                 fprintf ( stderr, "Option -%c requires an argument.\n", optopt );
             else if ( isprint ( optopt ) )
                 fprintf ( stderr, "Unknown option `-%c'.\n", optopt );
@@ -198,13 +874,18 @@ int main ( int argc, char ** argv ) {
 
     if ( dictionary != NULL ) {
         // Alias dictionary
-        alias_index = tr_init ( dictionary );
-        if ( alias_index == NULL ) {
+        pr.alias_index = tr_init ( dictionary );
+        if ( pr.alias_index == NULL ) {
             perror ( "Can't load alias dictionary" );
             exit ( EXIT_FAILURE );
         }
     }
 
+    if ( pr.cycles < 0 || pr.bin_width < 0 ) {
+        fprintf ( stderr, "The binning of the positions can't be negative.\n" );
+        exit ( EXIT_FAILURE );
+    }
+
     // Non optional arguments
     if ( argc - optind < 2 ) {
         usage ( argv[0] );
@@ -212,302 +893,173 @@ int main ( int argc, char ** argv ) {
     }
 
     // BAM file
-    bam_fn = argv[optind++];
-    fp = hts_open ( bam_fn, "r" );
-    hdr = sam_hdr_read ( fp );
-    line = bam_init1 ();
-    // BAM index
-    index = bam_index_load ( bam_fn );
-    if ( index == NULL ) {
-        // File not indexed
-        perror ( "Can't load BAM index" );
-        exit ( EXIT_FAILURE );
-    }
+    pr.bam_fn = argv[optind++];
 
     // FASTA files
-    ploidy = argc - optind;
+    pr.ploidy = argc - optind;
 
     // Malloc of the structures
-    fasta = malloc ( sizeof ( gzFile ) * ploidy );
-    seq = malloc ( sizeof ( kseq_t * ) * ploidy );
-    allele = malloc ( sizeof ( allele_t * ) * ploidy );
-    edlib_alg = malloc ( sizeof ( EdlibAlignResult ) * ploidy );
-    trs = malloc ( sizeof ( tandem_set_t * ) * ploidy );
+    ref = malloc ( sizeof ( reference_t * ) * pr.ploidy );
+
+    aln_fp = malloc ( sizeof ( gzFile ) * pr.ploidy );
+    aln = malloc ( sizeof ( kseq_t * ) * pr.ploidy );
+    pr.annotation = malloc ( sizeof ( tandem_cache_t * ) * pr.ploidy );
 
     // Init sequences
-    for ( int i = 0; i < ploidy; i ++ ) {
-        // Read of the allele
-        fasta[i] = gzopen ( argv[optind], "r" );
-        if ( fasta[i] == NULL ) {
-            fprintf ( stderr, "File %s not found.\n", argv[optind] );
+    for ( int i = 0; i < pr.ploidy; i ++ ) {
+        // Read of the allele, whole contigs are needed by the alignment
+        ref[i] = ref_open ( argv[optind], pr.region, true );
+        if ( ref[i] == NULL ) {
+            fprintf ( stderr, "Can't open %s%s%s.\n", argv[optind], ( pr.region != NULL ) ? " at " : "", ( pr.region != NULL ) ? pr.region : "" );
             exit ( EXIT_FAILURE );
         }
-        seq[i] = kseq_init ( fasta[i] );
-        trs[i] = NULL;
-        allele[i] = NULL;
+        // Alignment of the allele, if any, in the sidecar file
+        aln_fn = realloc ( aln_fn, sizeof ( char ) * ( strlen ( argv[optind] ) + 5 ) );
+        sprintf ( aln_fn, "%s.aln", argv[optind] );
+        aln_fp[i] = gzopen ( aln_fn, "r" );
+        aln[i] = ( aln_fp[i] != NULL ) ? kseq_init ( aln_fp[i] ) : NULL;
+        // Repetitions analyzed by previous runs
+        pr.annotation[i] = NULL;
+        if ( pr.tandem != 0 ) {
+            pr.annotation[i] = tandem_cache_open ( argv[optind] );
+            if ( pr.annotation[i] == NULL ) {
+                fprintf ( stderr, "Can't open the repetitions of %s.\n", argv[optind] );
+                exit ( EXIT_FAILURE );
+            }
+        }
         optind ++;
     }
+    free ( aln_fn );
 
     // Edlib configuration
-    config = edlibNewAlignConfig ( -1, EDLIB_MODE_HW, EDLIB_TASK_PATH, additionalEqualities, 4 );
+    pr.config = edlibNewAlignConfig ( -1, EDLIB_MODE_HW, EDLIB_TASK_PATH, additionalEqualities, 4 );
+
+    model = model_init ( MAX_MOTIF, pr.tandem, pr.max_insert_size, pr.size_granularity );
+    model_bin ( pr.cycles, pr.bin_width, model );
 
-    model = model_init ( MAX_MOTIF, tandem, max_insert_size, size_granularity );
+    // Queue of the contigs
+    pr.head = NULL;
+    pr.tail = NULL;
+    pr.queued = 0;
+    pr.finished = false;
+    pthread_mutex_init ( &pr.lock, NULL );
+    pthread_cond_init ( &pr.cond, NULL );
+
+    // Pool of workers
+    workers = malloc ( sizeof ( worker_t * ) * threads );
+    for ( int t = 0; t < threads; t ++ ) {
+        workers[t] = worker_init ( &pr, MAX_MOTIF );
+        if ( pthread_create ( &workers[t]->thread, NULL, worker, workers[t] ) != 0 ) {
+            fprintf ( stderr, "Can't create the threads.\n" );
+            exit ( EXIT_FAILURE );
+        }
+    }
 
     // While there are sequences to read in the FASTA file
     while ( ! last ) {
+        contig = malloc ( sizeof ( contig_t ) );
+        contig->seq = malloc ( sizeof ( char * ) * pr.ploidy );
+        contig->run = malloc ( sizeof ( allele_run_t * ) * pr.ploidy );
+        contig->n_run = malloc ( sizeof ( long ) * pr.ploidy );
+        contig->len = malloc ( sizeof ( long ) * pr.ploidy );
+        contig->name = NULL;
+        contig->next = NULL;
         // Next sequence
-        for ( int i = 0; i < ploidy; i ++ ) {
-            int x = kseq_read ( seq[i] );
-            if ( x >= 0 || x == -2 ) {
-                // Alignment of the sequence
-                align = ( seq[i]->qual.l > 0 ) ? seq[i]->qual.s : NULL;
-                // Update allele
-                allele[i] = allele_point (
-                        seq[i]->seq.l,
-                        seq[i]->seq.s,
-                        align,                        
-                        allele[i]
-                        );
-                if ( tandem != 0 ) {
-                    trs[i] = tandem_set_init ( seq[i]->seq.l, model->max_motif, tandem, trs[i] );
-                    trs[i] = tandem_set_analyze ( seq[i]->seq.s, seq[i]->seq.l, trs[i] );
+        for ( int i = 0; i < pr.ploidy; i ++ ) {
+            contig->seq[i] = NULL;
+            contig->run[i] = NULL;
+            contig->n_run[i] = 0;
+            int x = ref_next ( ref[i] );
+            if ( x > 0 ) {
+                contig->seq[i] = __copy ( ref[i]->seq, ref[i]->len );
+                contig->len[i] = ref[i]->len;
+                // Alignment of the sequence, compact or a character per base
+                if ( aln[i] != NULL ) {
+                    // Alignments of the sequences out of the region are skipped
+                    do {
+                        x = kseq_read ( aln[i] );
+                    } while ( x >= 0 && pr.region != NULL && strcmp ( aln[i]->name.s, ref[i]->name ) != 0 );
+                    if ( x < 0 || strcmp ( aln[i]->name.s, ref[i]->name ) != 0 ) {
+                        fprintf ( stderr, "Missing alignment of %s.\n", ref[i]->name );
+                        exit ( EXIT_FAILURE );
+                    }
+                    contig->run[i] = allele_parse ( aln[i]->seq.s, true, &contig->n_run[i] );
+                }
+                else if ( ref[i]->qual != NULL ) {
+                    contig->run[i] = allele_parse ( ref[i]->qual, false, &contig->n_run[i] );
+                }
+                if ( ( aln[i] != NULL || ref[i]->qual != NULL ) && contig->run[i] == NULL ) {
+                    fprintf ( stderr, "Can't parse the alignment of %s.\n", ref[i]->name );
+                    exit ( EXIT_FAILURE );
                 }
             }
-            else{
+            else if ( x == 0 ) {
                 last = true;
             }
+            else {
+                fprintf ( stderr, "Can't read the alleles.\n" );
+                exit ( EXIT_FAILURE );
+            }
         }
-        
-        if ( last ) { break; }
-        // Seek on the BAM
-        alias = NULL;
-        if ( dictionary != NULL ) {
-            alias = tr_translate ( alias_index, (*seq)->name.s );
-        }
-        if ( alias == NULL ){
-            alias = (*seq)->name.s;
-        }
-        itr = bam_itr_querys ( index, hdr, alias );
-        if ( itr != NULL ) {
-            while ( bam_itr_next ( fp, itr, line ) > 0 ) {
-                read_counter++;
-                double done = 100.0 * ( read_counter - skipped ) / read_counter;
-                fprintf ( stderr, "READ> %lld : %s ( %.3f done ) actually in %s  #\r", read_counter, bam_get_qname ( line ), done, alias );
-                if ( read_counter % density != 0 ) {
-                  skipped ++;
-                  continue;
-                }
-
-                if ( (( line->core.flag & 1 ) && ( line->core.flag & 2 )) || line->core.flag == 0 || line->core.flag == 16 ){
-                  // Read information
-                  pos = line->core.pos;
-                  len = line->core.l_qseq;
-                  read_seq = bam_get_seq ( line ); // Read nucleotides
-                  qual = bam_get_qual ( line ); // Quality score
-                  curr_stats = ( line->core.flag & 64 ) ? model->single : model->pair;
-                  curr_stats = ( line->core.flag & 128 ) ? model->pair : model->single;
-                  if ( line->core.flag == 0 || line->core.flag == 16 ) {
-                    curr_stats = model->single;
-                  }
-                }
-                else{
-                    skipped++;
-                    continue;
-                }
-
-                if ( curr_stats == model->single && ( line->core.tid == line->core.mtid || line->core.mtid == -1 ) ){
-                  insert_size = line->core.mpos - ( pos + len );
-                  insert_size = ( insert_size < 0 ) ? -insert_size : insert_size;
-                  insert_size = ( insert_size < max_insert_size ) ? insert_size : max_insert_size; 
-                  insert_size = ( insert_size * size_granularity ) / max_insert_size;
-                  insert_size = ( line->core.mtid == -1 ) ? 0 : insert_size;
-                  source_update ( NULL, 0, 0, insert_size, model->insert_size );
-                  orientation = ( line->core.flag & 48 ) >> 4;
-                  source_update ( NULL, 0, 0, orientation, model->orientation );
-                }
-
-                // Interval of the reference
-                flank_1 = floor ( log ( 2 * len ) / log ( 2 ) );
-                flank_2 = flank_1;
 
-                // Read string
-                read = realloc ( read, sizeof ( char ) * ( len + 1 ) );
-                int i;
-                for ( i = 0; i < len; i++ ) {
-                    read[i] = seq_nt16_str[ bam_seqi ( read_seq, i ) ];
-                }
-                read[i] = 0;
-
-                for ( i = 0; i < ploidy; i ++ ) {
-                    curr_seq = seq[i];
-                    // Seek on the allele
-                    allele_seek ( pos, true, allele[i] );
-
-                    // Flanking regions
-                    start = allele[i]->pos;
-                    if ( start - flank_1 < 0 ) {
-                        start = 0;
-                    } else {
-                        start -= flank_1;
-                    }
-
-                    end = allele[i]->pos + len;
-                    if ( end + flank_2 >= curr_seq->seq.l ) {
-                        end = curr_seq->seq.l - 1;
-                    } else {
-                        end += flank_2;
-                    }
-
-                    // Align
-                    edlib_alg[i] = edlibAlign (
-                                       read,
-                                       len,
-                                       &curr_seq->seq.s[start],
-                                       end - start,
-                                       config );
-
-                    // Select best alignment
-                    if ( i == 0 || edlib_alg[i].editDistance < min_score ) {
-                        min_index = i;
-                        min_start = start + edlib_alg[i].startLocations[0];
-                        min_score = edlib_alg[i].editDistance;
-                    }
+        if ( last ) {
+            contig_destroy ( contig, pr.ploidy );
+            break;
+        }
+        contig->name = __copy ( (*ref)->name, strlen ( (*ref)->name ) );
+        contig->beg = (*ref)->beg;
+        contig->end = (*ref)->end;
 
-                    // Note: edlib c(GAP) = c(MM)
-                    if ( ( line->core.flag == 147 || line->core.flag == 83 ) && edlib_alg[i].alignment[edlib_alg[i].alignmentLength-1] == 1 )
-                        edlib_alg[i].alignment[edlib_alg[i].alignmentLength-1] = 3;
-
-                    if ( verbose ) {
-                        printf ( "Sequence no.%d %d->%ld\n", i, pos, allele[i]->pos );
-                        dump_read (
-                            &curr_seq->seq.s[start + edlib_alg[i].startLocations[0]],
-                            edlib_alg[i].alignment,
-                            edlib_alg[i].alignmentLength,
-                            read,
-                            qual );
-                    }
-                }
+        // Bounded queue, a contig per thread
+        pthread_mutex_lock ( &pr.lock );
+        while ( pr.queued >= threads ) {
+            pthread_cond_wait ( &pr.cond, &pr.lock );
+        }
+        if ( pr.tail == NULL ) {
+            pr.head = contig;
+        } else {
+            pr.tail->next = contig;
+        }
+        pr.tail = contig;
+        pr.queued ++;
+        pthread_cond_broadcast ( &pr.cond );
+        pthread_mutex_unlock ( &pr.lock );
+    }
 
-                if ( tandem != 0 ){
-                    // Tandem index
-                    int tin = trs[min_index]->i;
-                    // Number of tandems
-                    int n = trs[min_index]->n;
-                    // Tandems set
-                    tandem_t * set = trs[min_index]->set;
-
-                    // Tandem not in the reads
-                    while ( tin < n && set[tin].pos < min_start ){
-                        tin ++;
-                    }
-                    // Reads are sorted, so these tandems will never be used
-                    trs[min_index]->i = tin;
-
-                    // Possibile tandems
-                    int read_end = min_start + strlen ( read );
-                    while ( tin < n && set[tin].pos < read_end ){
-                        // Learning example
-                        int motif = set[tin].pat;
-                        unsigned char in = set[tin].rep;
-                        unsigned char out = 0;
-                        // Find position
-                        int read_pos = -1;
-                        int ref_pos = min_start - 1;
-                        int alg = 0;
-                        unsigned char * alg_str = edlib_alg[min_index].alignment;
-                        int alg_len = edlib_alg[min_index].alignmentLength;
-                        // Adjust ref_pos and ref_pos
-                        while ( alg < alg_len && ( ref_pos < 0 || ref_pos < set[tin].pos ) ) {
-                            switch ( alg_str[alg] ){
-                                case 1:
-                                    read_pos ++;
-                                    break;
-                                case 2:
-                                    ref_pos ++;
-                                    break;
-                                default:
-                                    read_pos ++;
-                                    ref_pos ++;
-                            }
-                            alg ++;
-                        }
-                        if ( read_pos + (out + 1) * motif < len ){
-                            // Compare pattern
-                            if ( strncasecmp ( &seq[min_index]->seq.s[set[tin].pos], &read[read_pos], motif ) == 0 ){
-                                out = 1;
-                                // Compare right patterns
-                                while ( read_pos + (out + 1) * motif < len ){
-                                    if ( strncasecmp ( &read[read_pos], &read[read_pos + out * motif], motif ) == 0 ){
-                                        out ++;
-                                    }
-                                    else{
-                                        break;
-                                    }
-                                }
-                            }
-                        }
-                        if ( verbose ) {
-                            alg = 0;
-                            // Print of the reference tandem
-                            int z = min_start - set[tin].pos;
-                            while ( z < motif * in ){
-                                if ( alg_str[alg] == 1 ){
-                                    printf ( " " );
-                                }
-                                else if ( z < 0 ){
-                                    printf ( " " );
-                                    z ++;
-                                }
-                                else {
-                                    printf ( "%c", seq[min_index]->seq.s[set[tin].pos+z] );
-                                    z ++;
-                                }
-                                alg ++;
-                            }
-                            printf ( "\n" );
-                            alg = 0;
-                            // Print of the read tandem
-                            z = - read_pos;
-                            while ( z < motif * out ){
-                                if ( alg_str[alg] == 2 ){
-                                    printf ( " " );
-                                }
-                                else if ( z < 0 ){
-                                    printf ( " " );
-                                    z ++;
-                                }
-                                else {
-                                    printf ( "%c", read[read_pos + z] );
-                                    z ++;
-                                }
-                                alg ++;
-                            }
-                            printf ( "\n" );
-                        }
-                        // Update tandem statistics
-                        if ( in < tandem && out < tandem ) {
-                            source_update ( &in, 1, motif, out, model->amplification );
-                        }
-                        tin ++;
-                    }
-                }
+    // No more contigs
+    pthread_mutex_lock ( &pr.lock );
+    pr.finished = true;
+    pthread_cond_broadcast ( &pr.cond );
+    pthread_mutex_unlock ( &pr.lock );
 
-                stats_update (
-                    edlib_alg[min_index].alignment,
-                    edlib_alg[min_index].alignmentLength,
-                    read,
-                    &allele[min_index]->sequence[min_start],
-                    qual,
-                    curr_stats                    
-                );
+    // Reduction of the models
+    for ( int t = 0; t < threads; t ++ ) {
+        pthread_join ( workers[t]->thread, NULL );
+        if ( model_merge ( model, workers[t]->model ) != 0 ) {
+            fprintf ( stderr, "Can't merge the models.\n" );
+            exit ( EXIT_FAILURE );
+        }
+        read_counter += workers[t]->read_counter;
+        skipped += workers[t]->skipped;
+        worker_destroy ( workers[t] );
+    }
+    if ( read_counter > 0 ) {
+        fprintf ( stderr, "READ> %lld ( %.3f done )\n", read_counter, 100.0 * ( read_counter - skipped ) / read_counter );
+    }
 
-                for ( int i = 0; i < ploidy; i ++ ) {
-                    edlibFreeAlignResult ( edlib_alg[i] );
-                }
-            }
+    // Not fatal, the repetitions are analyzed again by the next run
+    for ( int i = 0; i < pr.ploidy; i ++ ) {
+        if ( pr.annotation[i] != NULL && tandem_cache_write ( pr.annotation[i] ) != 0 ) {
+            fprintf ( stderr, "Can't write %s.\n", pr.annotation[i]->filename );
         }
-        else{
-            fprintf ( stderr, "%s not found.\n", (*seq)->name.s );
+    }
+
+    // Binary model for the simulator
+    if ( model_fn != NULL ) {
+        model_fp = fopen ( model_fn, "w" );
+        if ( model_fp == NULL || model_write ( model_fp, model ) != 0 || fclose ( model_fp ) != 0 ) {
+            fprintf ( stderr, "Can't write the model to %s.\n", model_fn );
+            exit ( EXIT_FAILURE );
         }
     }
 
@@ -517,26 +1069,22 @@ int main ( int argc, char ** argv ) {
     }
 
     // Cleanup
-    for ( int i = 0; i < ploidy; i ++ ) {
-        gzclose ( fasta[i] );
-        kseq_destroy( seq[i] );
-        tandem_set_destroy ( trs[i] );
-        // Free and not destroy because
-        // the sequence is externally allocated
-        free ( allele[i] );
-    }
-    free ( fasta );
-    free ( seq );
-    free ( trs );
-    free ( allele );
-    free ( edlib_alg );
-    bam_destroy1 ( line );
-    bam_hdr_destroy ( hdr );
-    bam_itr_destroy ( itr );
-    hts_idx_destroy ( index );
+    for ( int i = 0; i < pr.ploidy; i ++ ) {
+        ref_close ( ref[i] );
+        tandem_cache_destroy ( pr.annotation[i] );
+        if ( aln[i] != NULL ) {
+            gzclose ( aln_fp[i] );
+            kseq_destroy ( aln[i] );
+        }
+    }
+    free ( ref );
+    free ( pr.annotation );
+    free ( aln_fp );
+    free ( aln );
+    free ( workers );
     model_destroy ( model );
-    sam_close ( fp );
-    free ( read );
-    tr_destroy ( alias_index );
+    tr_destroy ( pr.alias_index );
+    pthread_mutex_destroy ( &pr.lock );
+    pthread_cond_destroy ( &pr.cond );
     return 0;
 }
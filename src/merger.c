@@ -0,0 +1,92 @@
+/*
+ * CNRSIM
+ * merger.c
+ * Sums the statistics of different models,
+ * e.g. profiled on different shards of the
+ * same BAM file. A single model is converted
+ * between the text and the binary format.
+ *
+ * @author Riccardo Massidda
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <unistd.h>
+#include "model.h"
+
+void usage ( char * name ) {
+    fprintf ( stderr, "Usage: %s [-o binary_model] model_file [model_file ...]\n", name );
+}
+
+model_t * load ( char * model_name ) {
+    model_t * model;
+
+    model = model_load ( model_name );
+    if ( model == NULL ) {
+        fprintf ( stderr, "Can't load the model %s.\n", model_name );
+        exit ( EXIT_FAILURE );
+    }
+
+    return model;
+}
+
+int main ( int argc, char ** argv ) {
+    int opt;
+    char * out_fn = NULL;
+    FILE * out_fp;
+    model_t * model;
+    model_t * shard;
+
+    while ( ( opt = getopt ( argc, argv, "o:" ) ) != -1 ) {
+        switch ( opt ) {
+        case 'o':
+            out_fn = optarg;
+            break;
+        case '?':
+            if ( optopt == 'o' )
+                fprintf ( stderr, "Option -%c requires an argument.\n", optopt );
+            else if ( isprint ( optopt ) )
+                fprintf ( stderr, "Unknown option `-%c'.\n", optopt );
+            else
+                fprintf ( stderr, "Unknown option character `\\x%x'.\n", optopt );
+            exit ( EXIT_FAILURE );
+        default:
+            usage ( argv[0] );
+            exit ( EXIT_FAILURE );
+        }
+    }
+
+    if ( argc - optind < 1 ) {
+        usage ( argv[0] );
+        exit ( EXIT_FAILURE );
+    }
+
+    // Mapped models are read-only, the parameters of the first one are used
+    shard = load ( argv[optind] );
+    model = model_init ( shard->max_motif, shard->max_repetition, shard->max_insert_size, shard->size_granularity );
+    model_bin ( shard->single->quality->exact, shard->single->quality->width, model );
+    for ( int i = optind; i < argc; i ++ ) {
+        if ( i > optind ) {
+            shard = load ( argv[i] );
+        }
+        if ( model_merge ( model, shard ) != 0 ) {
+            fprintf ( stderr, "Parameters of %s don't match the ones of %s.\n", argv[i], argv[optind] );
+            exit ( EXIT_FAILURE );
+        }
+        model_destroy ( shard );
+    }
+
+    if ( out_fn != NULL ) {
+        out_fp = fopen ( out_fn, "w" );
+        if ( out_fp == NULL || model_write ( out_fp, model ) != 0 || fclose ( out_fp ) != 0 ) {
+            fprintf ( stderr, "Can't write the model to %s.\n", out_fn );
+            exit ( EXIT_FAILURE );
+        }
+    }
+    else {
+        model_dump ( stdout, model );
+    }
+
+    model_destroy ( model );
+    exit ( EXIT_SUCCESS );
+}
@@ -8,11 +8,34 @@
  */
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <ctype.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "stats.h"
 #include "model.h"
 
+// Number of sources in a model
+#define MODEL_SOURCES 11
+
+/*
+ * Header of the binary model, the sizes and the
+ * byte order of the platform that wrote the model
+ * are checked since the tables are mapped as they are.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t word_size;
+    int32_t max_motif;
+    int32_t max_repetition;
+    int32_t max_insert_size;
+    int32_t size_granularity;
+    char padding[SOURCE_ALIGNMENT - 8 - 7 * sizeof ( int32_t )];
+} model_header_t;
+
 model_t * model_init ( int max_motif, int max_repetition, int max_insert_size, int size_granularity ){
     model_t * model = malloc ( sizeof ( model_t ) );
     if ( model == NULL ) return model;
@@ -26,6 +49,8 @@ model_t * model_init ( int max_motif, int max_repetition, int max_insert_size, i
     model->amplification = source_init ( max_repetition, max_repetition, 1, 0 );
     model->insert_size = source_init ( 1, size_granularity, 0, 0 );
     model->orientation = source_init ( 1, 4, 0, 0 );
+    model->map = NULL;
+    model->map_size = 0;
 
     return model;
 }
@@ -53,6 +78,8 @@ model_t * model_parse ( FILE * file ){
         // Parse first token
         token = strtok ( line, " " );    
         if ( token == NULL ) {
+          // Position of a sparse source without observed outcomes
+          n_line += ( curr_source != NULL ) ? 1 : 0;
           continue;
         }
 
@@ -123,26 +150,48 @@ model_t * model_parse ( FILE * file ){
                 fprintf ( stderr, "%s not parsable.\n", token );
                 exit ( EXIT_FAILURE );
             }
-            // Get length
-            token = strtok ( NULL, " " );    
-            curr_source->n = atoi ( token );
+            // Matrixes, prefixes, outcomes, positions and binning
+            int header[6] = { 0, 0, 0, -1, 0, 0 };
+            for ( int k = 0; k < 6 && ( token = strtok ( NULL, " " ) ) != NULL; k ++ ) {
+                header[k] = atoi ( token );
+            }
+            if ( source_bin ( header[4], header[5], curr_source ) != 0 ) {
+                fprintf ( stderr, "Can't bin the positions of the model.\n" );
+                exit ( EXIT_FAILURE );
+            }
+            curr_source->n = header[0];
+            // Positions of models without binning
+            curr_source->length = ( header[3] >= 0 ) ? header[3] : header[0];
             // Pre-allocate matrixes
-            curr_source->normalized = NULL;
-            curr_source->raw = malloc ( sizeof ( unsigned long * ) * curr_source->n );
-            for ( int i = 0; i < curr_source->n; i ++ ) {
-                curr_source->raw[i] = malloc ( 
-                        curr_source->omega * curr_source->prefix * sizeof ( unsigned long )
-                        );
+            if ( source_reserve ( curr_source->n, curr_source ) != 0 ) {
+                fprintf ( stderr, "Can't allocate the model.\n" );
+                exit ( EXIT_FAILURE );
             }
             n_line = 0;
         }
-        // Load data
+        // Load data, every count or only the observed ones as row:outcome:count
         else{
-            for ( int i = 0; i < curr_source->prefix; i ++ ) {
-                for ( int j = 0; j < curr_source->omega; j ++ ) {
-                    curr_source->raw[n_line][ i * curr_source->omega + j] = strtoul ( token, NULL, 10 );
-                    token = strtok ( NULL, " " );    
+            if ( curr_source == NULL ) {
+                fprintf ( stderr, "%s not parsable.\n", token );
+                exit ( EXIT_FAILURE );
+            }
+            for ( int k = 0; token != NULL; k ++ ) {
+                int row = k / curr_source->omega;
+                int out = k % curr_source->omega;
+                unsigned long count;
+                int ret;
+                if ( strchr ( token, ':' ) != NULL ) {
+                    ret = ( sscanf ( token, "%d:%d:%lu", &row, &out, &count ) == 3 ) ? 0 : -1;
                 }
+                else {
+                    count = strtoul ( token, NULL, 10 );
+                    ret = 0;
+                }
+                if ( ret != 0 || source_add ( n_line, row, out, count, curr_source ) != 0 ) {
+                    fprintf ( stderr, "%s not parsable.\n", token );
+                    exit ( EXIT_FAILURE );
+                }
+                token = strtok ( NULL, " " );    
             }
             n_line ++;
         }
@@ -153,6 +202,149 @@ model_t * model_parse ( FILE * file ){
     return model;
 }
 
+/*
+ * Sources of the model in the order
+ * of the binary format.
+ */
+static void __sources ( model_t * model, source_t ** sources ) {
+    stats_t * end[2] = { model->single, model->pair };
+    int i = 0;
+
+    for ( int e = 0; e < 2; e ++ ) {
+        sources[i++] = end[e]->alignment;
+        sources[i++] = end[e]->mismatch;
+        sources[i++] = end[e]->quality;
+        sources[i++] = end[e]->distribution;
+    }
+    sources[i++] = model->amplification;
+    sources[i++] = model->insert_size;
+    sources[i++] = model->orientation;
+}
+
+model_t * model_load ( char * filename ){
+    FILE * file;
+    model_header_t header;
+    struct stat st;
+    model_t * model;
+    source_t * sources[MODEL_SOURCES];
+    char * map;
+    long offset;
+    long size;
+
+    file = fopen ( filename, "r" );
+    if ( file == NULL ) {
+        return NULL;
+    }
+
+    // Text models don't start with the magic number
+    if ( fread ( &header, sizeof ( model_header_t ), 1, file ) != 1 ||
+         memcmp ( header.magic, MODEL_MAGIC, sizeof ( header.magic ) ) != 0 ) {
+        rewind ( file );
+        model = model_parse ( file );
+        fclose ( file );
+        return model;
+    }
+
+    // Binary model written by a different version or platform
+    if ( header.version != MODEL_VERSION || header.byte_order != 0x01020304 ||
+         header.word_size != sizeof ( unsigned long ) || fstat ( fileno ( file ), &st ) != 0 ) {
+        fclose ( file );
+        return NULL;
+    }
+
+    map = mmap ( NULL, st.st_size, PROT_READ, MAP_SHARED, fileno ( file ), 0 );
+    fclose ( file );
+    if ( map == MAP_FAILED ) {
+        return NULL;
+    }
+
+    model = model_init ( header.max_motif, header.max_repetition, header.max_insert_size, header.size_granularity );
+    if ( model == NULL ) {
+        munmap ( map, st.st_size );
+        return NULL;
+    }
+    model->map = map;
+    model->map_size = st.st_size;
+
+    // Sources follow the header
+    __sources ( model, sources );
+    offset = sizeof ( model_header_t );
+    for ( int i = 0; i < MODEL_SOURCES; i ++ ) {
+        size = source_map ( &map[offset], st.st_size - offset, sources[i] );
+        if ( size < 0 ) {
+            model_destroy ( model );
+            return NULL;
+        }
+        offset += size;
+    }
+
+    return model;
+}
+
+int model_write ( FILE * file, model_t * model ){
+    model_header_t header;
+    source_t * sources[MODEL_SOURCES];
+
+    memset ( &header, 0, sizeof ( model_header_t ) );
+    memcpy ( header.magic, MODEL_MAGIC, sizeof ( header.magic ) );
+    header.version = MODEL_VERSION;
+    header.byte_order = 0x01020304;
+    header.word_size = sizeof ( unsigned long );
+    header.max_motif = model->max_motif;
+    header.max_repetition = model->max_repetition;
+    header.max_insert_size = model->max_insert_size;
+    header.size_granularity = model->size_granularity;
+    if ( fwrite ( &header, sizeof ( model_header_t ), 1, file ) != 1 ) {
+        return -1;
+    }
+
+    __sources ( model, sources );
+    for ( int i = 0; i < MODEL_SOURCES; i ++ ) {
+        if ( source_write ( file, sources[i] ) != 0 ) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int model_merge ( model_t * dst, model_t * src ){
+    // The counts of different parameters have different meanings
+    if ( dst->max_motif != src->max_motif ||
+         dst->max_repetition != src->max_repetition ||
+         dst->max_insert_size != src->max_insert_size ||
+         dst->size_granularity != src->size_granularity ) {
+        return -1;
+    }
+    if ( stats_merge ( dst->single, src->single ) != 0 ||
+         stats_merge ( dst->pair, src->pair ) != 0 ||
+         source_merge ( dst->amplification, src->amplification ) != 0 ||
+         source_merge ( dst->insert_size, src->insert_size ) != 0 ||
+         source_merge ( dst->orientation, src->orientation ) != 0 ) {
+        return -1;
+    }
+    return 0;
+}
+
+int model_bin ( int exact, int width, model_t * model ){
+    if ( stats_bin ( exact, width, model->single ) != 0 ||
+         stats_bin ( exact, width, model->pair ) != 0 ) {
+        return -1;
+    }
+    return 0;
+}
+
+int model_normalize ( model_t * model ){
+    if ( stats_normalize ( model->single ) != 0 ||
+         stats_normalize ( model->pair ) != 0 ||
+         source_normalize ( model->amplification ) != 0 ||
+         source_normalize ( model->insert_size ) != 0 ||
+         source_normalize ( model->orientation ) != 0 ) {
+        return -1;
+    }
+    return 0;
+}
+
 void model_destroy ( model_t * model ){
     if ( model == NULL ){
         return;
@@ -162,6 +354,9 @@ void model_destroy ( model_t * model ){
     source_destroy ( model->amplification );
     source_destroy ( model->insert_size );
     source_destroy ( model->orientation );
+    if ( model->map != NULL ) {
+        munmap ( model->map, model->map_size );
+    }
     free ( model );
 }
 
@@ -0,0 +1,327 @@
+/*
+ * CNRSIM
+ * pack.c
+ * Sequences stored with two bits per
+ * nucleotide, and a mask of the characters
+ * that can't be represented this way.
+ *
+ * @author Riccardo Massidda
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "encoding.h"
+#include "pack.h"
+
+// Alignment of the records in the file
+#define PACK_ALIGNMENT 8
+
+/*
+ * Header of the file, the sizes and the
+ * byte order are checked since the
+ * sequences are mapped as they are.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t word_size;
+    char padding[64 - 8 - 3 * sizeof ( uint32_t )];
+} pack_header_t;
+
+/*
+ * Header of a sequence, followed by its
+ * name, the nucleotides and the mask.
+ */
+typedef struct {
+    int64_t len;
+    int64_t n_run;
+    int64_t name_size;
+    char padding[64 - 3 * sizeof ( int64_t )];
+} pack_record_t;
+
+long __padded ( long size ) {
+    return ( size + PACK_ALIGNMENT - 1 ) / PACK_ALIGNMENT * PACK_ALIGNMENT;
+}
+
+/*
+ * Extends the mask with a character,
+ * merging it with the last run if possible.
+ */
+int __mask ( long pos, char c, pack_t * pack ) {
+    pack_run_t * last = ( pack->n_run > 0 ) ? &pack->run[pack->n_run - 1] : NULL;
+
+    if ( last != NULL && last->c == c && last->pos + last->len == pos ) {
+        last->len ++;
+        return 0;
+    }
+    if ( pack->n_run == pack->run_size ) {
+        long size = ( pack->run_size == 0 ) ? 64 : 2 * pack->run_size;
+        pack_run_t * run = realloc ( pack->run, sizeof ( pack_run_t ) * size );
+        if ( run == NULL ) {
+            return -1;
+        }
+        pack->run = run;
+        pack->run_size = size;
+    }
+    pack->run[pack->n_run].pos = pos;
+    pack->run[pack->n_run].len = 1;
+    pack->run[pack->n_run].c = c;
+    pack->n_run ++;
+    return 0;
+}
+
+/*
+ * Checks that the runs of a mask are
+ * ordered, disjoint, not empty and
+ * inside the sequence.
+ */
+bool __valid_mask ( pack_t * pack ) {
+    long end = 0;
+
+    for ( long i = 0; i < pack->n_run; i ++ ) {
+        if ( pack->run[i].pos < end || pack->run[i].len <= 0 ||
+             pack->run[i].len > pack->len - pack->run[i].pos ) {
+            return false;
+        }
+        end = pack->run[i].pos + pack->run[i].len;
+    }
+    return true;
+}
+
+pack_t * pack_init ( char * name, char * seq, long len ) {
+    pack_t * pack = malloc ( sizeof ( pack_t ) );
+    if ( pack == NULL ) {
+        return NULL;
+    }
+
+    pack->name = strdup ( name );
+    pack->len = len;
+    pack->bases = calloc ( __padded ( ( len + 3 ) / 4 ), sizeof ( uint8_t ) );
+    pack->run = NULL;
+    pack->n_run = 0;
+    pack->run_size = 0;
+    pack->mapped = false;
+    if ( pack->name == NULL || pack->bases == NULL ) {
+        pack_destroy ( pack );
+        return NULL;
+    }
+
+    // The other characters are restored by the mask
+    enc_pack ( seq, len, pack->bases );
+    for ( long i = 0; i < len; i ++ ) {
+        unsigned char c = seq[i];
+        int ret = 0;
+        if ( enc_code[c] > 3 ) {
+            // Not a nucleotide, e.g. N
+            ret = __mask ( i, c, pack );
+        } else if ( c >= 'a' ) {
+            ret = __mask ( i, 0, pack );
+        }
+        if ( ret != 0 ) {
+            pack_destroy ( pack );
+            return NULL;
+        }
+    }
+
+    return pack;
+}
+
+long pack_unpack ( long pos, long len, char * out, pack_t * pack ) {
+    long end;
+    long lo, hi;
+
+    // Interval inside the sequence
+    pos = ( pos < pack->len ) ? pos : pack->len;
+    len = ( len > 0 ) ? len : 0;
+    end = ( len < pack->len - pos ) ? pos + len : pack->len;
+
+    enc_unpack ( pack->bases, pos, end - pos, out );
+    out[end - pos] = '\0';
+
+    // First run ending after the position
+    lo = 0;
+    hi = pack->n_run;
+    while ( lo < hi ) {
+        long mid = lo + ( hi - lo ) / 2;
+        if ( pack->run[mid].pos + pack->run[mid].len <= pos ) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    // Runs overlapping the interval
+    for ( long i = lo; i < pack->n_run && pack->run[i].pos < end; i ++ ) {
+        long s = ( pack->run[i].pos > pos ) ? pack->run[i].pos : pos;
+        long e = ( pack->run[i].pos + pack->run[i].len < end ) ? pack->run[i].pos + pack->run[i].len : end;
+        if ( pack->run[i].c != 0 ) {
+            memset ( &out[s - pos], pack->run[i].c, e - s );
+        } else {
+            for ( long j = s - pos; j < e - pos; j ++ ) {
+                out[j] |= 0x20;
+            }
+        }
+    }
+
+    return end - pos;
+}
+
+void pack_destroy ( pack_t * pack ) {
+    if ( pack == NULL ) {
+        return;
+    }
+    if ( ! pack->mapped ) {
+        free ( pack->name );
+        free ( pack->bases );
+        free ( pack->run );
+    }
+    free ( pack );
+}
+
+int pack_header ( FILE * file ) {
+    pack_header_t header;
+
+    memset ( &header, 0, sizeof ( pack_header_t ) );
+    memcpy ( header.magic, PACK_MAGIC, sizeof ( header.magic ) );
+    header.version = PACK_VERSION;
+    header.byte_order = 0x01020304;
+    header.word_size = sizeof ( long );
+    if ( fwrite ( &header, sizeof ( pack_header_t ), 1, file ) != 1 ) {
+        return -1;
+    }
+    return 0;
+}
+
+int pack_write ( FILE * file, pack_t * pack ) {
+    pack_record_t record;
+    char padding[PACK_ALIGNMENT] = { 0 };
+    long name_len = strlen ( pack->name );
+    long bases_len = ( pack->len + 3 ) / 4;
+
+    memset ( &record, 0, sizeof ( pack_record_t ) );
+    record.len = pack->len;
+    record.n_run = pack->n_run;
+    record.name_size = __padded ( name_len + 1 );
+
+    // Name and nucleotides are padded to the alignment
+    if ( fwrite ( &record, sizeof ( pack_record_t ), 1, file ) != 1 ||
+         fwrite ( pack->name, sizeof ( char ), name_len, file ) != ( size_t ) name_len ||
+         fwrite ( padding, sizeof ( char ), record.name_size - name_len, file ) != ( size_t ) ( record.name_size - name_len ) ||
+         fwrite ( pack->bases, sizeof ( uint8_t ), bases_len, file ) != ( size_t ) bases_len ||
+         fwrite ( padding, sizeof ( char ), __padded ( bases_len ) - bases_len, file ) != ( size_t ) ( __padded ( bases_len ) - bases_len ) ||
+         ( pack->n_run > 0 && fwrite ( pack->run, sizeof ( pack_run_t ), pack->n_run, file ) != ( size_t ) pack->n_run ) ) {
+        return -1;
+    }
+
+    return 0;
+}
+
+pack_set_t * pack_load ( char * filename ) {
+    FILE * file;
+    pack_header_t header;
+    struct stat st;
+    pack_set_t * set;
+    char * map;
+    long offset;
+
+    file = fopen ( filename, "r" );
+    if ( file == NULL ) {
+        return NULL;
+    }
+
+    // Written by a different version or platform
+    if ( fread ( &header, sizeof ( pack_header_t ), 1, file ) != 1 ||
+         memcmp ( header.magic, PACK_MAGIC, sizeof ( header.magic ) ) != 0 ||
+         header.version != PACK_VERSION || header.byte_order != 0x01020304 ||
+         header.word_size != sizeof ( long ) || fstat ( fileno ( file ), &st ) != 0 ) {
+        fclose ( file );
+        return NULL;
+    }
+
+    map = mmap ( NULL, st.st_size, PROT_READ, MAP_SHARED, fileno ( file ), 0 );
+    fclose ( file );
+    if ( map == MAP_FAILED ) {
+        return NULL;
+    }
+
+    set = malloc ( sizeof ( pack_set_t ) );
+    if ( set == NULL ) {
+        munmap ( map, st.st_size );
+        return NULL;
+    }
+    set->seq = NULL;
+    set->n = 0;
+    set->map = map;
+    set->map_size = st.st_size;
+
+    // Sequences follow the header
+    offset = sizeof ( pack_header_t );
+    while ( offset < st.st_size ) {
+        pack_record_t * record = ( pack_record_t * ) &map[offset];
+        pack_t * pack;
+        pack_t ** seq;
+        long total;
+
+        if ( st.st_size - offset < ( long ) sizeof ( pack_record_t ) ||
+             record->len < 0 || record->n_run < 0 || record->name_size <= 0 ||
+             // Sizes that can't fit in the file, before computing the total
+             record->len / 4 > st.st_size || record->name_size > st.st_size ||
+             record->n_run > st.st_size / ( long ) sizeof ( pack_run_t ) ) {
+            pack_set_destroy ( set );
+            return NULL;
+        }
+        total = sizeof ( pack_record_t ) + record->name_size +
+                __padded ( ( record->len + 3 ) / 4 ) + record->n_run * sizeof ( pack_run_t );
+        seq = realloc ( set->seq, sizeof ( pack_t * ) * ( set->n + 1 ) );
+        pack = malloc ( sizeof ( pack_t ) );
+        if ( total > st.st_size - offset || seq == NULL || pack == NULL ) {
+            free ( pack );
+            set->seq = ( seq != NULL ) ? seq : set->seq;
+            pack_set_destroy ( set );
+            return NULL;
+        }
+        set->seq = seq;
+
+        // Tables point into the mapped file
+        pack->mapped = true;
+        pack->len = record->len;
+        pack->n_run = record->n_run;
+        pack->run_size = record->n_run;
+        pack->name = &map[offset + sizeof ( pack_record_t )];
+        pack->bases = ( uint8_t * ) &map[offset + sizeof ( pack_record_t ) + record->name_size];
+        pack->run = ( pack_run_t * ) &map[offset + sizeof ( pack_record_t ) + record->name_size + __padded ( ( record->len + 3 ) / 4 )];
+        if ( pack->name[record->name_size - 1] != '\0' || ! __valid_mask ( pack ) ) {
+            free ( pack );
+            pack_set_destroy ( set );
+            return NULL;
+        }
+        set->seq[set->n ++] = pack;
+        offset += total;
+    }
+
+    return set;
+}
+
+int pack_find ( char * name, pack_set_t * set ) {
+    for ( int i = 0; i < set->n; i ++ ) {
+        if ( strcmp ( set->seq[i]->name, name ) == 0 ) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void pack_set_destroy ( pack_set_t * set ) {
+    if ( set == NULL ) {
+        return;
+    }
+    for ( int i = 0; i < set->n; i ++ ) {
+        pack_destroy ( set->seq[i] );
+    }
+    free ( set->seq );
+    if ( set->map != NULL ) {
+        munmap ( set->map, set->map_size );
+    }
+    free ( set );
+}
@@ -0,0 +1,352 @@
+/*
+ * CNRSIM
+ * reference.c
+ * Access to the sequences of a FASTA file,
+ * fetched on demand through an existing faidx
+ * index or streamed when the file isn't indexed.
+ *
+ * @author Riccardo Massidda
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <htslib/hts.h>
+#include <htslib/kseq.h>
+#include "reference.h"
+
+// Init kseq structure
+KSEQ_INIT ( gzFile, gzread );
+
+/*
+ * Allocates the structure and parses the
+ * name and the interval of the region.
+ */
+reference_t * __init ( char * region, bool whole ) {
+    reference_t * ref = malloc ( sizeof ( reference_t ) );
+    if ( ref == NULL ) {
+        return NULL;
+    }
+
+    ref->fai = NULL;
+    ref->fp = NULL;
+    ref->stream = NULL;
+    ref->cache = NULL;
+    ref->pack = NULL;
+    ref->region = NULL;
+    ref->beg = 0;
+    ref->end = HTS_POS_MAX;
+    ref->whole = whole;
+    ref->fastq = false;
+    ref->done = false;
+    ref->n = 0;
+    ref->index = -1;
+    ref->name = NULL;
+    ref->seq = NULL;
+    ref->len = 0;
+    ref->qual = NULL;
+    ref->start = 0;
+    ref->fetched = NULL;
+    ref->fetched_qual = NULL;
+
+    if ( region != NULL ) {
+        // Name and interval of the region
+        hts_pos_t beg, end;
+        const char * name_end = hts_parse_reg64 ( region, &beg, &end );
+        if ( name_end == NULL ) {
+            ref_close ( ref );
+            return NULL;
+        }
+        ref->region = strndup ( region, name_end - region );
+        ref->beg = beg;
+        ref->end = end;
+    }
+
+    return ref;
+}
+
+/*
+ * Whether the file holds FASTQ records,
+ * from its first character.
+ */
+bool __fastq ( char * filename ) {
+    gzFile fp = gzopen ( filename, "r" );
+    int c;
+
+    if ( fp == NULL ) {
+        return false;
+    }
+    c = gzgetc ( fp );
+    gzclose ( fp );
+    return c == '@';
+}
+
+reference_t * ref_open ( char * filename, char * region, bool whole ) {
+    reference_t * ref = __init ( region, whole );
+    if ( ref == NULL ) {
+        return NULL;
+    }
+
+    // Existing index only, nothing is written next to the inputs
+    ref->fastq = __fastq ( filename );
+    ref->fai = fai_load3_format ( filename, NULL, NULL, 0, ( ref->fastq ) ? FAI_FASTQ : FAI_FASTA );
+
+    if ( ref->fai != NULL ) {
+        ref->n = faidx_nseq ( ref->fai );
+        if ( ref->region != NULL && ! faidx_has_seq ( ref->fai, ref->region ) ) {
+            ref_close ( ref );
+            return NULL;
+        }
+    } else {
+        // Not indexed, or not indexable as plain gzip
+        ref->fp = gzopen ( filename, "r" );
+        if ( ref->fp == NULL ) {
+            ref_close ( ref );
+            return NULL;
+        }
+        ref->stream = kseq_init ( ref->fp );
+    }
+
+    return ref;
+}
+
+/*
+ * Interval to be loaded from
+ * a sequence of the given length.
+ */
+void __clip ( long len, bool whole, long * beg, long * end, reference_t * ref ) {
+    *beg = ( whole ) ? 0 : ref->beg;
+    *end = ( whole ) ? len : ref->end;
+    // Interval inside the sequence
+    *beg = ( *beg < len ) ? *beg : len;
+    *end = ( *end < len ) ? *end : len;
+    *end = ( *end > *beg ) ? *end : *beg;
+}
+
+int __fetch ( reference_t * ref ) {
+    long beg, end;
+    hts_pos_t len;
+    int index;
+
+    if ( ref->region != NULL ) {
+        // Only the requested sequence
+        ref->done = true;
+        for ( index = 0; index < ref->n; index ++ ) {
+            if ( strcmp ( faidx_iseq ( ref->fai, index ), ref->region ) == 0 ) {
+                break;
+            }
+        }
+    } else {
+        index = ref->index + 1;
+    }
+    if ( index >= ref->n ) {
+        ref->done = true;
+        return 0;
+    }
+
+    ref->index = index;
+    ref->name = ( char * ) faidx_iseq ( ref->fai, index );
+    __clip ( faidx_seq_len64 ( ref->fai, ref->name ), ref->whole, &beg, &end, ref );
+
+    free ( ref->fetched );
+    free ( ref->fetched_qual );
+    ref->fetched_qual = NULL;
+    if ( end > beg ) {
+        // Inclusive interval
+        ref->fetched = faidx_fetch_seq64 ( ref->fai, ref->name, beg, end - 1, &len );
+    } else {
+        ref->fetched = calloc ( 1, sizeof ( char ) );
+        len = 0;
+    }
+    if ( ref->fetched == NULL || len < 0 ) {
+        return -1;
+    }
+    // Qualities of the interval, e.g. the alignment of an allele
+    if ( ref->fastq && end > beg ) {
+        hts_pos_t qual_len;
+        ref->fetched_qual = faidx_fetch_qual64 ( ref->fai, ref->name, beg, end - 1, &qual_len );
+        if ( ref->fetched_qual == NULL || qual_len != len ) {
+            return -1;
+        }
+    }
+
+    ref->seq = ref->fetched;
+    ref->len = len;
+    ref->qual = ref->fetched_qual;
+    ref->start = beg;
+    return 1;
+}
+
+int __read ( reference_t * ref ) {
+    kseq_t * ks = ref->stream;
+    long beg, end;
+    int ret;
+
+    // Truncated quality lines are accepted
+    while ( ( ret = kseq_read ( ks ) ) >= 0 || ret == -2 ) {
+        ref->index ++;
+        // Sequences before the region are skipped
+        if ( ref->region != NULL && strcmp ( ks->name.s, ref->region ) != 0 ) {
+            continue;
+        }
+        __clip ( ks->seq.l, ref->whole, &beg, &end, ref );
+        ks->seq.s[end] = '\0';
+        ref->name = ks->name.s;
+        ref->seq = &ks->seq.s[beg];
+        ref->len = end - beg;
+        // Qualities of the interval, the whole line otherwise
+        ref->qual = NULL;
+        if ( ks->qual.l > 0 && ref->whole ) {
+            ref->qual = ks->qual.s;
+        } else if ( ks->qual.l > 0 && ks->qual.l >= ( size_t ) end ) {
+            ks->qual.s[end] = '\0';
+            ref->qual = &ks->qual.s[beg];
+        }
+        ref->start = beg;
+        if ( ref->region != NULL ) {
+            ref->done = true;
+            ref->n = ref->index + 1;
+        }
+        return 1;
+    }
+
+    ref->done = true;
+    ref->n = ref->index + 1;
+    return ( ret == -1 ) ? 0 : -1;
+}
+
+/*
+ * Packs the sequences of a FASTA file, the
+ * file is renamed when complete so that other
+ * processes never map a partial file.
+ */
+int __build ( char * filename, char * pack_fn ) {
+    reference_t * ref;
+    pack_t * pack;
+    FILE * file;
+    char * tmp_fn;
+    int ret;
+
+    ref = ref_open ( filename, NULL, false );
+    if ( ref == NULL ) {
+        return -1;
+    }
+    tmp_fn = malloc ( sizeof ( char ) * ( strlen ( pack_fn ) + 24 ) );
+    sprintf ( tmp_fn, "%s.%ld", pack_fn, ( long ) getpid () );
+    file = fopen ( tmp_fn, "w" );
+    ret = ( file != NULL && pack_header ( file ) == 0 ) ? 1 : -1;
+    while ( ret > 0 && ( ret = ref_next ( ref ) ) > 0 ) {
+        pack = pack_init ( ref->name, ref->seq, ref->len );
+        if ( pack == NULL || pack_write ( file, pack ) != 0 ) {
+            ret = -1;
+        }
+        pack_destroy ( pack );
+    }
+    if ( file != NULL && fclose ( file ) != 0 ) {
+        ret = -1;
+    }
+    if ( ret == 0 && rename ( tmp_fn, pack_fn ) != 0 ) {
+        ret = -1;
+    }
+    if ( ret != 0 ) {
+        remove ( tmp_fn );
+    }
+
+    free ( tmp_fn );
+    ref_close ( ref );
+    return ret;
+}
+
+reference_t * ref_open_packed ( char * filename, char * region ) {
+    reference_t * ref;
+    struct stat st_fasta, st_pack;
+    char * pack_fn;
+
+    ref = __init ( region, false );
+    if ( ref == NULL ) {
+        return NULL;
+    }
+    if ( stat ( filename, &st_fasta ) != 0 ) {
+        ref_close ( ref );
+        return NULL;
+    }
+
+    // Packed copy, rebuilt if outdated
+    pack_fn = malloc ( sizeof ( char ) * ( strlen ( filename ) + 6 ) );
+    sprintf ( pack_fn, "%s.pack", filename );
+    if ( stat ( pack_fn, &st_pack ) != 0 || st_pack.st_mtime < st_fasta.st_mtime ) {
+        if ( __build ( filename, pack_fn ) != 0 ) {
+            free ( pack_fn );
+            ref_close ( ref );
+            return NULL;
+        }
+    }
+    ref->cache = pack_load ( pack_fn );
+    free ( pack_fn );
+    if ( ref->cache == NULL ||
+         ( ref->region != NULL && pack_find ( ref->region, ref->cache ) < 0 ) ) {
+        ref_close ( ref );
+        return NULL;
+    }
+    ref->n = ref->cache->n;
+
+    return ref;
+}
+
+int __cached ( reference_t * ref ) {
+    long beg, end;
+    int index;
+
+    if ( ref->region != NULL ) {
+        // Only the requested sequence
+        ref->done = true;
+        index = pack_find ( ref->region, ref->cache );
+    } else {
+        index = ref->index + 1;
+    }
+    if ( index >= ref->n ) {
+        ref->done = true;
+        return 0;
+    }
+
+    ref->index = index;
+    ref->pack = ref->cache->seq[index];
+    ref->name = ref->pack->name;
+    __clip ( ref->pack->len, false, &beg, &end, ref );
+    ref->seq = NULL;
+    ref->len = end - beg;
+    ref->qual = NULL;
+    ref->start = beg;
+    return 1;
+}
+
+int ref_next ( reference_t * ref ) {
+    if ( ref->done ) {
+        return 0;
+    }
+    if ( ref->cache != NULL ) {
+        return __cached ( ref );
+    }
+    return ( ref->fai != NULL ) ? __fetch ( ref ) : __read ( ref );
+}
+
+void ref_close ( reference_t * ref ) {
+    if ( ref == NULL ) {
+        return;
+    }
+    if ( ref->fai != NULL ) {
+        fai_destroy ( ref->fai );
+    }
+    if ( ref->stream != NULL ) {
+        kseq_destroy ( ref->stream );
+    }
+    if ( ref->fp != NULL ) {
+        gzclose ( ref->fp );
+    }
+    pack_set_destroy ( ref->cache );
+    free ( ref->fetched );
+    free ( ref->fetched_qual );
+    free ( ref->region );
+    free ( ref );
+}
@@ -0,0 +1,126 @@
+/*
+ * CNRSIM
+ * repeats.c
+ * Precomputes the tandem repeats of the
+ * sequences of FASTA files, that are then
+ * mapped by the profiler and the simulator.
+ *
+ * @author Riccardo Massidda
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <unistd.h>
+#include "model.h"
+#include "reference.h"
+#include "tandem.h"
+
+// Same motif size of the profiler
+#define MAX_MOTIF 6
+
+void usage ( char * name ) {
+    fprintf ( stderr, "Usage: %s [-t max_repetition] [-m model] [-j threads] [-r region] [-w] fasta_file [fasta_file ...]\n", name );
+}
+
+int main ( int argc, char ** argv ) {
+    int opt;
+    int threads = 1;
+    int max_motif = MAX_MOTIF;
+    int max_repetition = 16;
+    char * region = NULL;
+    bool whole = false;
+    model_t * model;
+    reference_t * ref;
+    tandem_cache_t * annotation;
+    tandem_set_t * tandem = NULL;
+    int ret;
+
+    while ( ( opt = getopt ( argc, argv, "wt:m:j:r:" ) ) != -1 ) {
+        switch ( opt ) {
+        case 'w':
+            whole = true;
+            break;
+        case 't':
+            max_repetition = atoi ( optarg );
+            break;
+        case 'm':
+            // Parameters of the model used by the simulator
+            model = model_load ( optarg );
+            if ( model == NULL ) {
+                fprintf ( stderr, "Can't load the model %s.\n", optarg );
+                exit ( EXIT_FAILURE );
+            }
+            max_motif = model->max_motif;
+            max_repetition = model->max_repetition;
+            model_destroy ( model );
+            break;
+        case 'j':
+            threads = atoi ( optarg );
+            if ( threads < 1 ) {
+                fprintf ( stderr, "The number of threads must be positive.\n" );
+                exit ( EXIT_FAILURE );
+            }
+            break;
+        case 'r':
+            region = optarg;
+            break;
+        case '?':
+            if ( optopt == 't' || optopt == 'm' || optopt == 'j' || optopt == 'r' )
+                fprintf ( stderr, "Option -%c requires an argument.\n", optopt );
+            else if ( isprint ( optopt ) )
+                fprintf ( stderr, "Unknown option `-%c'.\n", optopt );
+            else
+                fprintf ( stderr, "Unknown option character `\\x%x'.\n", optopt );
+            exit ( EXIT_FAILURE );
+        default:
+            usage ( argv[0] );
+            exit ( EXIT_FAILURE );
+        }
+    }
+
+    if ( argc - optind < 1 || max_repetition <= 0 ) {
+        usage ( argv[0] );
+        exit ( EXIT_FAILURE );
+    }
+
+    /*
+     * The profiler analyzes whole sequences (-w),
+     * the simulator only the interval of the region.
+     */
+    for ( int i = optind; i < argc; i ++ ) {
+        ref = ref_open ( argv[i], region, whole );
+        if ( ref == NULL ) {
+            fprintf ( stderr, "Can't open %s%s%s.\n", argv[i], ( region != NULL ) ? " at " : "", ( region != NULL ) ? region : "" );
+            exit ( EXIT_FAILURE );
+        }
+        annotation = tandem_cache_open ( argv[i] );
+        if ( annotation == NULL ) {
+            fprintf ( stderr, "Can't open the repetitions of %s.\n", argv[i] );
+            exit ( EXIT_FAILURE );
+        }
+        while ( ( ret = ref_next ( ref ) ) > 0 ) {
+            tandem = tandem_cache_analyze ( ref->name, ref->seq, ref->len, max_motif, max_repetition, threads, tandem, annotation );
+            if ( tandem == NULL ) {
+                fprintf ( stderr, "Can't analyze the repetitions of %s.\n", ref->name );
+                exit ( EXIT_FAILURE );
+            }
+            fprintf ( stderr, "%s:\t%d tandems\n", ref->name, tandem->n );
+        }
+        if ( ret < 0 ) {
+            fprintf ( stderr, "Can't read %s.\n", argv[i] );
+            exit ( EXIT_FAILURE );
+        }
+        if ( tandem_cache_write ( annotation ) != 0 ) {
+            fprintf ( stderr, "Can't write %s.\n", annotation->filename );
+            exit ( EXIT_FAILURE );
+        }
+        // Sets shared with the cache aren't valid anymore
+        tandem_set_destroy ( tandem );
+        tandem = NULL;
+        tandem_cache_destroy ( annotation );
+        ref_close ( ref );
+    }
+
+    exit ( EXIT_SUCCESS );
+}
@@ -0,0 +1,106 @@
+/*
+ * CNRSIM
+ * rng.c
+ * Counter-based pseudorandom generator,
+ * Philox4x32-10 by Salmon et al.
+ *
+ * @author Riccardo Massidda
+ */
+#include <stdint.h>
+#include "rng.h"
+
+// Philox4x32 constants
+#define PHILOX_M0 0xD2511F53
+#define PHILOX_M1 0xCD9E8D57
+#define PHILOX_W0 0x9E3779B9
+#define PHILOX_W1 0xBB67AE85
+#define PHILOX_ROUNDS 10
+
+static void __philox ( const uint32_t * counter, const uint32_t * key, uint32_t * output ) {
+    uint32_t c[4] = { counter[0], counter[1], counter[2], counter[3] };
+    uint32_t k[2] = { key[0], key[1] };
+    uint64_t p0, p1;
+
+    for ( int r = 0; r < PHILOX_ROUNDS; r ++ ) {
+        p0 = ( uint64_t ) PHILOX_M0 * c[0];
+        p1 = ( uint64_t ) PHILOX_M1 * c[2];
+        c[0] = ( uint32_t ) ( p1 >> 32 ) ^ c[1] ^ k[0];
+        c[1] = ( uint32_t ) p1;
+        c[2] = ( uint32_t ) ( p0 >> 32 ) ^ c[3] ^ k[1];
+        c[3] = ( uint32_t ) p0;
+        // Bump of the key
+        k[0] += PHILOX_W0;
+        k[1] += PHILOX_W1;
+    }
+
+    output[0] = c[0];
+    output[1] = c[1];
+    output[2] = c[2];
+    output[3] = c[3];
+}
+
+void rng_init ( uint64_t seed, uint32_t stream, uint32_t substream, rng_t * rng ) {
+    rng->key[0] = ( uint32_t ) seed;
+    rng->key[1] = ( uint32_t ) ( seed >> 32 );
+    // The first two words count the blocks
+    rng->counter[0] = 0;
+    rng->counter[1] = 0;
+    rng->counter[2] = stream;
+    rng->counter[3] = substream;
+    // Empty block
+    rng->used = 4;
+}
+
+static void __block ( rng_t * rng, uint32_t * output ) {
+    __philox ( rng->counter, rng->key, output );
+    // 64 bit block counter
+    if ( ++ rng->counter[0] == 0 ) {
+        rng->counter[1] ++;
+    }
+}
+
+uint32_t rng_next ( rng_t * rng ) {
+    if ( rng->used == 4 ) {
+        __block ( rng, rng->output );
+        rng->used = 0;
+    }
+    return rng->output[rng->used ++];
+}
+
+double rng_uniform ( rng_t * rng ) {
+    uint32_t a = rng_next ( rng ) >> 5;
+    uint32_t b = rng_next ( rng ) >> 6;
+    // ( a * 2^26 + b ) / 2^53
+    return ( a * 67108864.0 + b ) / 9007199254740992.0;
+}
+
+void rng_fill ( uint32_t * out, long n, rng_t * rng ) {
+    long i = 0;
+
+    // Rest of the current block
+    while ( i < n && rng->used < 4 ) {
+        out[i ++] = rng->output[rng->used ++];
+    }
+    // Whole blocks straight to the buffer
+    while ( n - i >= 4 ) {
+        __block ( rng, &out[i] );
+        i += 4;
+    }
+    while ( i < n ) {
+        out[i ++] = rng_next ( rng );
+    }
+}
+
+uint32_t rng_range ( uint32_t n, rng_t * rng ) {
+    // Lemire's multiply and reject
+    uint64_t m = ( uint64_t ) rng_next ( rng ) * n;
+    uint32_t low = ( uint32_t ) m;
+    if ( low < n ) {
+        uint32_t threshold = -n % n;
+        while ( low < threshold ) {
+            m = ( uint64_t ) rng_next ( rng ) * n;
+            low = ( uint32_t ) m;
+        }
+    }
+    return ( uint32_t ) ( m >> 32 );
+}
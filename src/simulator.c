@@ -9,51 +9,369 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <zlib.h>
 #include <htslib/sam.h>
-#include <htslib/kseq.h>
 #include <time.h>
+#include "amplification.h"
 #include "model.h"
+#include "pack.h"
+#include "reference.h"
+#include "rng.h"
 #include "stats.h"
 #include "source.h"
 #include "tandem.h"
+#include "writer.h"
 
-// Init kseq structure
-KSEQ_INIT ( gzFile, gzread );
+// Size of the work units in the amplified sequence
+#define CHUNK_SIZE 1000000
+// Work units ahead of the writer per thread
+#define UNITS_AHEAD 4
+// Pairs generated together
+#define PAIR_BATCH 64
+
+typedef struct unit_t unit_t;
+typedef struct simulation_t simulation_t;
+
+/*
+ * Independent portion of an amplified sequence,
+ * its reads are generated by a single thread.
+ */
+struct unit_t {
+    long start; // first position of the unit
+    long end; // last position of the unit, excluded
+    int index; // index of the unit in the sequence
+    rng_t rng; // pseudorandom stream of the unit
+    fastq_buffer_t fastq[2]; // FASTQ records of the two ends
+    long sequenced; // sequenced bases
+    bool done; // the unit can be written
+};
+
+/*
+ * Data shared by the threads working
+ * on the same sequence.
+ */
+struct simulation_t {
+    model_t * model; // error model
+    writer_t * out[2]; // output streams of the two ends
+    bool interleaved; // both ends on the first stream
+    uint64_t seed; // seed of the run
+    int contig; // index of the sequence, first index of the streams
+    char * name; // name of the sequence
+    long offset; // position of the sequence in the contig
+    pack_t * pack; // packed reference
+    amp_map_t * map; // map of the amplified sequence
+    long length; // length of the amplified sequence
+    int coverage; // required coverage
+    bool single_only; // no pair reads in the model
+    unit_t * units; // work units
+    int n_units; // number of units
+    int next; // next unit to be generated
+    int written; // units already written
+    int ahead; // maximum units ahead of the writer
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
 
 void usage ( char * name ) {
-    fprintf ( stderr, "Usage: %s coverage error_model fastq [fastq ...]\n", name );
+    fprintf ( stderr, "Usage: %s [-t threads] [-S seed] [-o output_prefix] [-r region] [-c] coverage error_model fastq [fastq ...]\n", name );
+}
+
+/*
+ * Generates the reads of a unit until
+ * the coverage is reached. The pairs are
+ * generated in batches: the alignments fix
+ * the position of each read, then the reads
+ * of each end are generated together. A pair
+ * is written only if both ends are complete.
+ */
+void unit_generate ( simulation_t * sim, unit_t * unit ) {
+    model_t * model = sim->model;
+    stats_t * end[2] = { model->single, model->pair };
+    read_batch_t * batch[2] = { NULL, NULL };
+    int ends = ( sim->single_only ) ? 1 : 2;
+    long unit_len = unit->end - unit->start;
+    long pos = unit->start;
+    int orientation[PAIR_BATCH];
+    int insert_size[PAIR_BATCH];
+    bool reverse;
+    bool cut;
+    long id = 0;
+    // Nucleotides that can be used by a read, plus the end of the sequence
+    int window_len = ( ( end[0]->alignment->length > end[1]->alignment->length ) ? end[0]->alignment->length : end[1]->alignment->length ) + 1;
+    long window_stride = window_len + 2;
+    char * window[2];
+    long n;
+
+    for ( int e = 0; e < ends; e ++ ) {
+        batch[e] = stats_batch_init ( PAIR_BATCH, end[e] );
+        window[e] = malloc ( sizeof ( char ) * PAIR_BATCH * window_stride );
+        if ( batch[e] == NULL || window[e] == NULL ) {
+            fprintf ( stderr, "Can't allocate the reads.\n" );
+            exit ( EXIT_FAILURE );
+        }
+    }
+
+    unit->sequenced = 0;
+    unit->fastq[0].len = 0;
+    unit->fastq[1].len = 0;
+
+    // Reach the coverage
+    while ( sim->coverage > ( unit->sequenced / unit_len ) ) {
+        for ( int b = 0; b < PAIR_BATCH; b ++ ) {
+            // Two bits: ++,+-,-+,--
+            orientation[b] = source_generate ( NULL, 0, 0, &unit->rng, model->orientation );
+            // Not sequenced nucleotides between pairs
+            int bin = source_generate ( NULL, 0, 0, &unit->rng, model->insert_size );
+            int lo_bound = bin * ( model->max_insert_size / model->size_granularity );
+            int up_bound = ( bin + 1 ) * ( model->max_insert_size / model->size_granularity );
+            insert_size[b] = rng_range ( up_bound - lo_bound + 1, &unit->rng ) + lo_bound;
+        }
+        for ( int e = 0; e < ends; e ++ ) {
+            stats_batch_align ( PAIR_BATCH, batch[e], &unit->rng, end[e] );
+        }
+
+        // Windows and positions of the reads
+        for ( int b = 0; b < PAIR_BATCH; b ++ ) {
+            cut = false;
+            for ( int e = 0; e < ends; e ++ ) {
+                char * w = &window[e][b * window_stride];
+                batch[e]->start[b] = pos;
+                // The mate of a cut read isn't generated
+                if ( cut ) {
+                    w[0] = '\0';
+                    continue;
+                }
+                // Window of the sequence starting at the read, NULL terminated at the end of the sequence
+                n = amp_map_unpack ( pos, window_len, w, sim->pack, sim->map );
+                // A mate starting after the end is cut at its first operation
+                w[n + 1] = '\0';
+                if ( n < window_len ) {
+                    stats_batch_clip ( b, n, batch[e] );
+                }
+                cut = batch[e]->cut[b];
+                // There is no insert size after mate pair
+                pos += batch[e]->length[b] + ( ( e == 0 ) ? insert_size[b] : 0 );
+            }
+            // Update start position
+            if ( pos >= unit->end ) {
+                // Start from the beginning of the unit
+                pos = unit->start;
+            }
+        }
+        for ( int e = 0; e < ends; e ++ ) {
+            if ( stats_generate_batch ( window[e], window_stride, batch[e], &unit->rng, end[e] ) != 0 ) {
+                fprintf ( stderr, "Can't allocate the reads.\n" );
+                exit ( EXIT_FAILURE );
+            }
+        }
+
+        // Pairs whose ends are complete
+        for ( int b = 0; b < PAIR_BATCH && sim->coverage > ( unit->sequenced / unit_len ); b ++ ) {
+            cut = false;
+            for ( int e = 0; e < ends; e ++ ) {
+                cut = cut || batch[e]->cut[b];
+            }
+            if ( cut ) {
+                continue;
+            }
+            for ( int e = 0; e < ends; e ++ ) {
+                reverse = ( e == 0 ) ? ( orientation[b] & 2 ) : ( orientation[b] & 1 );
+                if ( writer_format (
+                        sim->name, unit->index, id, sim->offset + batch[e]->start[b], reverse, batch[e], b,
+                        &unit->fastq[ ( sim->interleaved ) ? 0 : e ] ) != 0 ) {
+                    fprintf ( stderr, "Can't allocate the reads.\n" );
+                    exit ( EXIT_FAILURE );
+                }
+                // Update sequenced bases
+                unit->sequenced += batch[e]->length[b];
+            }
+            id ++;
+        }
+    }
+
+    for ( int e = 0; e < ends; e ++ ) {
+        stats_batch_destroy ( batch[e] );
+        free ( window[e] );
+    }
+}
+
+/*
+ * Worker thread, generates the units in order
+ * keeping at most sim->ahead units in memory.
+ */
+void * worker ( void * arg ) {
+    simulation_t * sim = arg;
+    int u;
+
+    pthread_mutex_lock ( &sim->lock );
+    while ( sim->next < sim->n_units ) {
+        // Too far from the writer
+        if ( sim->next >= sim->written + sim->ahead ) {
+            pthread_cond_wait ( &sim->cond, &sim->lock );
+            continue;
+        }
+        u = sim->next ++;
+        pthread_mutex_unlock ( &sim->lock );
+
+        unit_generate ( sim, &sim->units[u] );
+
+        pthread_mutex_lock ( &sim->lock );
+        sim->units[u].done = true;
+        pthread_cond_broadcast ( &sim->cond );
+    }
+    pthread_mutex_unlock ( &sim->lock );
+
+    return NULL;
+}
+
+/*
+ * Generates the reads of a sequence with
+ * the given number of threads, writing them
+ * on the output in the order of the units.
+ * The stream of each unit depends only on the
+ * seed, the sequence and the unit, so that the
+ * output doesn't depend on the number of threads.
+ */
+void simulate ( simulation_t * sim, long length, int threads ) {
+    pthread_t * pool = malloc ( sizeof ( pthread_t ) * threads );
+    long sequenced = 0;
+
+    sim->length = length;
+    // Split of the sequence, the last unit
+    // includes the remainder
+    sim->n_units = ( length / CHUNK_SIZE > 0 ) ? length / CHUNK_SIZE : 1;
+    sim->units = malloc ( sizeof ( unit_t ) * sim->n_units );
+    for ( int u = 0; u < sim->n_units; u ++ ) {
+        sim->units[u].start = ( long ) u * CHUNK_SIZE;
+        sim->units[u].end = ( u == sim->n_units - 1 ) ? length : ( long ) ( u + 1 ) * CHUNK_SIZE;
+        rng_init ( sim->seed, sim->contig, u + 1, &sim->units[u].rng );
+        sim->units[u].index = u;
+        for ( int e = 0; e < 2; e ++ ) {
+            sim->units[u].fastq[e].data = NULL;
+            sim->units[u].fastq[e].size = 0;
+            sim->units[u].fastq[e].len = 0;
+        }
+        sim->units[u].done = false;
+    }
+    sim->next = 0;
+    sim->written = 0;
+    sim->ahead = UNITS_AHEAD * threads;
+
+    for ( int t = 0; t < threads; t ++ ) {
+        if ( pthread_create ( &pool[t], NULL, worker, sim ) != 0 ) {
+            fprintf ( stderr, "Can't create the threads.\n" );
+            exit ( EXIT_FAILURE );
+        }
+    }
+
+    // Write the units in order
+    pthread_mutex_lock ( &sim->lock );
+    while ( sim->written < sim->n_units ) {
+        unit_t * unit = &sim->units[sim->written];
+        if ( !unit->done ) {
+            pthread_cond_wait ( &sim->cond, &sim->lock );
+            continue;
+        }
+        pthread_mutex_unlock ( &sim->lock );
+
+        for ( int e = 0; e < 2; e ++ ) {
+            if ( unit->fastq[e].len > 0 && writer_write ( &unit->fastq[e], sim->out[e] ) != 0 ) {
+                fprintf ( stderr, "Can't write the simulated reads.\n" );
+                exit ( EXIT_FAILURE );
+            }
+            free ( unit->fastq[e].data );
+            unit->fastq[e].data = NULL;
+        }
+        sequenced += unit->sequenced;
+        fprintf ( stderr, "\t(sequenced):\t%.3f%%\r", (100.0 * sequenced / length ));
+
+        pthread_mutex_lock ( &sim->lock );
+        sim->written ++;
+        pthread_cond_broadcast ( &sim->cond );
+    }
+    pthread_mutex_unlock ( &sim->lock );
+
+    for ( int t = 0; t < threads; t ++ ) {
+        pthread_join ( pool[t], NULL );
+    }
+    fprintf ( stderr, "\t(sequenced):\t%ld\t%ld\t%.3f%%\n", sequenced, length, (100.0 * sequenced / length ));
+
+    free ( sim->units );
+    free ( pool );
 }
 
 int main ( int argc, char ** argv ) {
+    // Parser
+    int opt;
+    int threads = 1;
+    char * out_fn = NULL;
+    hts_tpool * pool = NULL;
     // Input
     int ploidy;
     char * model_name;
     char * fastq;
+    char * region = NULL;
+    bool cache = false;
     // Error
-    FILE * model_fp;
     model_t * model;
-    read_t * generated = NULL;
     // FASTA
-    gzFile * fp;
-    kseq_t ** seq;
+    reference_t * ref;
+    int base = 0;
+    int ret;
     // Amplification
-    char * amplified_seq = NULL;
+    char * nucleotides;
+    pack_t * packed = NULL;
+    amp_map_t * map = NULL;
+    long origin;
+    int map_ret = 0;
     tandem_set_t * tandem = NULL;
-    // Coverage
-    int coverage;
-    long sequenced;
+    tandem_cache_t * annotation = NULL;
     // Generation
-    bool single_only = true;
-    int insert_size = 0;
-    int orientation = 0;
-    int length;
-    int reverse;
-    int pos;
-    stats_t * curr_end;
+    simulation_t sim;
+    rng_t rng;
 
     // Init pseudorandom generator
-    srand ( time ( NULL ) );
+    sim.seed = time ( NULL );
+    sim.contig = 0;
+
+    while ( ( opt = getopt ( argc, argv, "ct:S:o:r:" ) ) != -1 ) {
+        switch ( opt ) {
+        case 'r':
+            region = optarg;
+            break;
+        case 'c':
+            cache = true;
+            break;
+        case 'o':
+            out_fn = optarg;
+            break;
+        case 'S':
+            sim.seed = strtoull ( optarg, NULL, 10 );
+            break;
+        case 't':
+            threads = atoi ( optarg );
+            if ( threads < 1 ) {
+                fprintf ( stderr, "The number of threads must be positive.\n" );
+                exit ( EXIT_FAILURE );
+            }
+            break;
+        case '?':
+            if ( optopt == 't' || optopt == 'S' || optopt == 'o' || optopt == 'r' )
+                fprintf ( stderr, "Option -%c requires an argument.\n", optopt );
+            else if ( isprint ( optopt ) )
+                fprintf ( stderr, "Unknown option `-%c'.\n", optopt );
+            else
+                fprintf ( stderr, "Unknown option character `\\x%x'.\n", optopt );
+            exit ( EXIT_FAILURE );
+        default:
+            usage ( argv[0] );
+            exit ( EXIT_FAILURE );
+        }
+    }
 
     // Non optional arguments
     if ( argc - optind < 3 ) {
@@ -61,55 +379,125 @@ int main ( int argc, char ** argv ) {
         exit ( EXIT_FAILURE );
     }
 
+    // Seed needed to reproduce the run
+    fprintf ( stderr, "Seed: %llu\n", ( unsigned long long ) sim.seed );
+
     // Coverage
-    coverage = atoi ( argv[optind++] );
+    sim.coverage = atoi ( argv[optind++] );
 
     // Error Model
     model_name = argv[optind++];
-    // File open
-    model_fp = fopen ( model_name, "r" );
-    if ( model_fp == NULL ) {
-        fprintf ( stderr, "File %s not found.\n", model_name );
+    // Init model, binary models are mapped with their tables
+    model = model_load ( model_name );
+    if ( model == NULL ) {
+        fprintf ( stderr, "Can't load the model %s.\n", model_name );
+        exit ( EXIT_FAILURE );
+    }
+    // Tables shared by the threads
+    if ( model_normalize ( model ) != 0 ) {
+        fprintf ( stderr, "Can't normalize the model %s.\n", model_name );
         exit ( EXIT_FAILURE );
     }
-
-    // Init model
-    model = model_parse ( model_fp );
-    fclose ( model_fp );
 
     // Check if there are pair reads
-    single_only = ( model->pair->alignment->n == 0 );
+    sim.model = model;
+    sim.single_only = ( model->pair->alignment->length == 0 );
+    pthread_mutex_init ( &sim.lock, NULL );
+    pthread_cond_init ( &sim.cond, NULL );
+
+    /*
+     * Output files, compressed if a prefix is given
+     * prefix.fq.gz for single-end models
+     * [prefix_1.fq.gz, prefix_2.fq.gz] for pair-end models
+     * otherwise the pairs are interleaved on the standard output.
+     */
+    sim.out[0] = NULL;
+    sim.out[1] = NULL;
+    sim.interleaved = ( out_fn == NULL );
+    if ( out_fn != NULL ) {
+        char * str = malloc ( sizeof ( char ) * ( strlen ( out_fn ) + 20 ) );
+        // Threads shared by the compression of the two streams
+        pool = hts_tpool_init ( threads );
+        for ( int e = 0; e < ( ( sim.single_only ) ? 1 : 2 ); e ++ ) {
+            if ( sim.single_only ) {
+                sprintf ( str, "%s.fq.gz", out_fn );
+            } else {
+                sprintf ( str, "%s_%d.fq.gz", out_fn, e + 1 );
+            }
+            sim.out[e] = writer_open ( str, pool );
+            if ( sim.out[e] == NULL ) {
+                fprintf ( stderr, "Can't open %s.\n", str );
+                exit ( EXIT_FAILURE );
+            }
+        }
+        free ( str );
+    } else {
+        sim.out[0] = writer_open ( NULL, NULL );
+        if ( sim.out[0] == NULL ) {
+            fprintf ( stderr, "Can't open the output.\n" );
+            exit ( EXIT_FAILURE );
+        }
+    }
 
     // Input sequences
     ploidy = argc - optind;
-    fp = malloc ( sizeof ( gzFile ) * ploidy );
-    seq = malloc ( sizeof ( kseq_t * ) * ploidy );
 
-    // Open input files
+    // Simulated read generation
     for ( int i = 0; i < ploidy; i ++ ){
+        // Sequences fetched through the index, if any
         fastq = argv[optind++];
-        fp[i] = gzopen ( fastq, "r" );
-        if ( fp[i] == NULL ) {
-            fprintf ( stderr, "File %s not found.\n", fastq );
+        ref = ( cache ) ? ref_open_packed ( fastq, region ) : ref_open ( fastq, region, false );
+        if ( ref == NULL ) {
+            fprintf ( stderr, "Can't open %s%s%s.\n", fastq, ( region != NULL ) ? " at " : "", ( region != NULL ) ? region : "" );
             exit ( EXIT_FAILURE );
         }
-        seq[i] = kseq_init ( fp[i] );
-    }
-
-    // Simulated read generation
-    for ( int i = 0; i < ploidy; i ++ ){
-        while ( kseq_read ( seq[i] ) >= 0 ) {
+        // Repetitions analyzed by previous runs
+        if ( model->amplification->n != 0 ) {
+            annotation = tandem_cache_open ( fastq );
+            if ( annotation == NULL ) {
+                fprintf ( stderr, "Can't open the repetitions of %s.\n", fastq );
+                exit ( EXIT_FAILURE );
+            }
+        }
+        while ( ( ret = ref_next ( ref ) ) > 0 ) {
             // Sequence loaded
-            fprintf ( stderr, "%s\n", seq[i]->name.s );
+            fprintf ( stderr, "%s\n", ref->name );
+            // Streams depend on the index of the sequence, not on the region
+            sim.contig = base + ref->index;
+            // Stream of the amplification
+            rng_init ( sim.seed, sim.contig, 0, &rng );
+            // Cached sequences are shared, the others are packed
+            packed = ( ref->pack == NULL ) ? pack_init ( ref->name, ref->seq, ref->len ) : NULL;
+            sim.pack = ( ref->pack != NULL ) ? ref->pack : packed;
+            if ( sim.pack == NULL ) {
+              fprintf ( stderr, "Can't pack %s.\n", ref->name );
+              exit ( EXIT_FAILURE );
+            }
+            // Position of the sequence in the packed copy
+            origin = ( ref->pack != NULL ) ? ref->start : 0;
             // Index for the FASTA sequence
             long seq_p = 0;
-            // Index for the amplified sequence
-            long aseq_p = 0;
+            map = amp_map_init ( map );
+            if ( map == NULL ) {
+              fprintf ( stderr, "Can't amplify %s.\n", ref->name );
+              exit ( EXIT_FAILURE );
+            }
             // Analysis of the repetitions in the original sequence
             if ( model->amplification->n != 0 ) {
-              tandem = tandem_set_init ( seq[i]->seq.l, model->max_motif, model->max_repetition, tandem );
-              tandem = tandem_set_analyze ( seq[i]->seq.s, seq[i]->seq.l, tandem );
-              amplified_seq = realloc ( amplified_seq, sizeof ( char ) * ( seq[i]->seq.l * 2 ) );
+              // Cached sequences are unpacked for the analysis
+              nucleotides = ref->seq;
+              if ( ref->pack != NULL ) {
+                nucleotides = malloc ( sizeof ( char ) * ( ref->len + 1 ) );
+                pack_unpack ( ref->start, ref->len, nucleotides, ref->pack );
+              }
+              tandem = tandem_cache_analyze ( ref->name, nucleotides, ref->len, model->max_motif, model->max_repetition, threads, tandem, annotation );
+              if ( tandem == NULL ) {
+                fprintf ( stderr, "Can't analyze the repetitions of %s.\n", ref->name );
+                exit ( EXIT_FAILURE );
+              }
+              if ( ref->pack != NULL ) {
+                free ( nucleotides );
+              }
 
               for ( int t = 0; t < tandem->n; t ++ ) {
                 unsigned char in = tandem->set[t].rep;
@@ -119,11 +507,7 @@ int main ( int argc, char ** argv ) {
                 int gap = tandem->set[t].pos - seq_p;
                 // Copy of the nucleotides between different tandems
                 if ( gap > 0 ) {
-                  memcpy (
-                      &amplified_seq[aseq_p],
-                      &seq[i]->seq.s[seq_p],
-                      sizeof ( char ) * gap );
-                  aseq_p += gap; 
+                  map_ret |= amp_map_copy ( origin + seq_p, gap, map );
                   seq_p += gap;
                 }
                 else if ( gap < 0 ) {
@@ -134,120 +518,63 @@ int main ( int argc, char ** argv ) {
                     &in,
                     1,
                     tandem->set[t].pat,
+                    &rng,
                     model->amplification );
                 int rep = out;
-                memcpy (
-                    &amplified_seq[aseq_p],
-                    &seq[i]->seq.s[seq_p],
-                    sizeof ( char ) * rep * tandem->set[t].pat );
+                // Repetitions of the motif
+                map_ret |= amp_map_repeat ( origin + seq_p, tandem->set[t].pat, ( long ) rep * tandem->set[t].pat, map );
                 seq_p += ( tandem->set[t].rep * tandem->set[t].pat );
-                aseq_p += ( rep * tandem->set[t].pat );
               }
               // Copy of the remaining sequence
-              memcpy (
-                  &amplified_seq[aseq_p],
-                  &seq[i]->seq.s[seq_p],
-                  sizeof ( char ) * ( seq[i]->seq.l - seq_p ) );
-              aseq_p += ( seq[i]->seq.l - seq_p );
-              seq_p = seq[i]->seq.l;
-              amplified_seq[aseq_p] = '\0';
-              fprintf ( stderr, "\t(amplified):\t%ld\t%ld\t%.3f\n", aseq_p, seq_p, (aseq_p*100.0/seq_p));
+              map_ret |= amp_map_copy ( origin + seq_p, ref->len - seq_p, map );
+              fprintf ( stderr, "\t(amplified):\t%ld\t%ld\t%.3f\n", map->len, ref->len, (map->len*100.0/ref->len));
             }
             else {
-              seq_p = seq[i]->seq.l;
-              aseq_p = seq_p;
-              amplified_seq = seq[i]->seq.s;
-            }
-
-            // Initial conditions
-            sequenced = 0;
-            pos = 0;
-            curr_end = model->single;
-
-            // Reach the coverage
-            while ( coverage > ( sequenced / aseq_p ) ) {
-              if ( curr_end == model->single ) {
-                // Two bits: ++,+-,-+,--
-                orientation = source_generate ( NULL, 0, 0, model->orientation );
-                // Not sequenced nucleotides between pairs
-                insert_size = source_generate ( NULL, 0, 0, model->insert_size );
-                int lo_bound = insert_size * ( model->max_insert_size / model->size_granularity );
-                int up_bound = ( insert_size + 1 ) * ( model->max_insert_size / model->size_granularity );
-                insert_size = rand () % ( up_bound - lo_bound + 1 );
-                insert_size += lo_bound;
-              }
-              else {
-                // There is no insert size after mate pair
-                insert_size = 0;
-              }
-
-              // Generate new read
-              generated = stats_generate_read ( &amplified_seq[pos], generated, curr_end );
-              length = strlen ( generated->read );
-              reverse = ( curr_end == model->single ) ? ( orientation & 2 ) : ( orientation & 1 );
-
-              // The read reached the limit of the sequence
-              if ( !generated->cut ) {
-                // Reverse the order of the nucleotides
-                if ( reverse ) {
-                  char swap;
-                  for ( int j = 0; j < (length/2); j ++ ) {
-                    swap = generated->read[j];
-                    generated->read[j] = generated->read[length-j-1];
-                    generated->read[length-j-1] = swap;
-                    swap = generated->quality[j];
-                    generated->quality[j] = generated->quality[length-j-1];
-                    generated->quality[length-j-1] = swap;
-                  }
-                }
-
-                // Adjust quality score for visualization
-                for ( int j = 0; j < length; j ++ ) {
-                  generated->quality[j] += 33;
-                }
-
-                // Print result to file
-                printf ( "@%s %d %c\n", seq[i]->name.s, pos, ( reverse ) ? '-' : '+' );
-                printf ( "%s\n", generated->read );
-                printf ( "+\n" );
-                printf ( "%s\n\n", generated->quality );
-
-                // Update sequenced bases
-                sequenced += length;
+              map_ret |= amp_map_copy ( origin, ref->len, map );
+            }
+            if ( map_ret != 0 ) {
+              fprintf ( stderr, "Can't amplify %s.\n", ref->name );
+              exit ( EXIT_FAILURE );
+            }
 
-                // Change read-end
-                curr_end = ( curr_end == model->single ) ? model->pair : model->single;
-                curr_end = single_only ? model->single : curr_end;
-              }
+            // Generation of the reads
+            sim.name = ref->name;
+            sim.offset = ref->start;
+            sim.map = map;
+            simulate ( &sim, map->len, threads );
+            pack_destroy ( packed );
+            packed = NULL;
+        }
+        if ( ret < 0 ) {
+            fprintf ( stderr, "Can't read %s.\n", fastq );
+            exit ( EXIT_FAILURE );
+        }
+        // Not fatal, the repetitions are analyzed again by the next run
+        if ( annotation != NULL && tandem_cache_write ( annotation ) != 0 ) {
+            fprintf ( stderr, "Can't write %s.\n", annotation->filename );
+        }
+        tandem_cache_destroy ( annotation );
+        annotation = NULL;
+        // Sequences of the following files
+        base += ref->n;
+        ref_close ( ref );
+    }
 
-              // Update start position
-              pos += ( insert_size + length );
-              if ( pos >= aseq_p ) {
-                // Start from the beginning
-                pos = 0;
-                curr_end = model->single;
-              }
-              fprintf ( stderr, "\t(sequenced):\t%.3f%%\r", (100.0 * sequenced / aseq_p ));
-            }
-            fprintf ( stderr, "\t(sequenced):\t%ld\t%ld\t%.3f%%\n", sequenced, aseq_p, (100.0 * sequenced / aseq_p ));
+    for ( int e = 0; e < 2; e ++ ) {
+        if ( sim.out[e] != NULL && writer_close ( sim.out[e] ) != 0 ) {
+            fprintf ( stderr, "Can't write the simulated reads.\n" );
+            exit ( EXIT_FAILURE );
         }
     }
+    if ( pool != NULL ) {
+        hts_tpool_destroy ( pool );
+    }
 
     // Cleanup
-    for ( int i = 0; i < ploidy; i++ ) {
-        gzclose ( fp[i] );
-        kseq_destroy ( seq[i] );
-    }
-    if ( generated != NULL ){
-        free ( generated->read );
-        free ( generated->align );
-        free ( generated->quality );
-    }
-    free ( generated );
-    free ( fp );
-    free ( amplified_seq );
-    free ( seq );
+    amp_map_destroy ( map );
     tandem_set_destroy ( tandem );
     model_destroy ( model );
+    pthread_mutex_destroy ( &sim.lock );
+    pthread_cond_destroy ( &sim.cond );
     exit ( EXIT_SUCCESS );
 }
@@ -7,12 +7,31 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <assert.h>
 #include <time.h>
 #include <math.h>
 #include "source.h"
 
+/*
+ * Header of a source in the binary model, padded
+ * so that the tables following it are aligned.
+ */
+typedef struct {
+    int32_t n;
+    int32_t sigma;
+    int32_t omega;
+    int32_t m;
+    int32_t stride;
+    int32_t sparse;
+    int64_t entries;
+    int32_t length;
+    int32_t exact;
+    int32_t width;
+    char padding[SOURCE_ALIGNMENT - 9 * sizeof ( int32_t ) - sizeof ( int64_t )];
+} source_header_t;
+
 source_t * source_init ( int sigma, int omega, int m, int graph ) {
     source_t * source = malloc ( sizeof ( source_t ) );
     if ( source == NULL ) {
@@ -21,6 +40,12 @@ source_t * source_init ( int sigma, int omega, int m, int graph ) {
 
     // Matrixes
     source->n = 0;
+    source->capacity = 0;
+
+    // Positions, not binned
+    source->length = 0;
+    source->exact = 0;
+    source->width = 0;
 
     // Memory
     source->m = m;
@@ -30,13 +55,43 @@ source_t * source_init ( int sigma, int omega, int m, int graph ) {
     source->omega = omega + graph; // exceptional end character
     source->prefix = ( int ) pow ( source->sigma, source->m );
 
+    // Matrixes padded to the alignment of every arena
+    int align = SOURCE_ALIGNMENT / sizeof ( int );
+    source->stride = ( ( source->prefix * source->omega + align - 1 ) / align ) * align;
+
     // Data
     source->raw = NULL;
+    source->cdf = NULL;
+    source->rows = NULL;
+    source->offset = NULL;
+    source->entry = NULL;
+    source->entries = 0;
     source->normalized = NULL;
+    source->alias = NULL;
+    source->mapped = false;
+
+    // Only the observed outcomes of wide alphabets
+    source->sparse = ( source->omega > SOURCE_SCAN_WIDTH );
 
     return source;
 }
 
+/*
+ * Allocates an aligned arena for
+ * n matrixes of the source.
+ */
+void * __arena ( int n, size_t size, source_t * source ) {
+    return aligned_alloc ( SOURCE_ALIGNMENT, ( size_t ) n * source->stride * size );
+}
+
+/*
+ * Bytes of a table padded
+ * to the alignment.
+ */
+long __aligned ( long size ) {
+    return ( size + SOURCE_ALIGNMENT - 1 ) / SOURCE_ALIGNMENT * SOURCE_ALIGNMENT;
+}
+
 int __index ( unsigned char * in, int len, source_t * source ) {
     int i;
     int empty = source->m - len;
@@ -64,24 +119,202 @@ int __index ( unsigned char * in, int len, source_t * source ) {
 }
 
 
-int source_update ( unsigned char * in, int len, int pos, unsigned char out, source_t * source ) {
-    if ( pos >= source->n ) {
-        source->raw = realloc ( source->raw, sizeof ( unsigned long * ) * ( pos + 1 ) );
+int source_reserve ( int n, source_t * source ) {
+    unsigned long * raw;
+    int capacity;
 
-        // New matrices
-        for ( int i = source->n; i <= pos; i ++ ) {
-            source->raw[i] = calloc (
-                                 source->omega * source->prefix,
-                                 sizeof ( unsigned long )
-                             );
+    if ( n <= source->capacity ) {
+        return 0;
+    }
+    if ( source->mapped || source->entry != NULL ) {
+        return -1;
+    }
+
+    // Geometric growth
+    capacity = ( source->capacity > 0 ) ? source->capacity : 16;
+    while ( capacity < n ) {
+        capacity *= 2;
+    }
+
+    // Rows of the new matrixes are empty
+    if ( source->sparse ) {
+        source_row_t * rows = realloc ( source->rows, sizeof ( source_row_t ) * capacity * source->prefix );
+        if ( rows == NULL ) {
+            return -1;
+        }
+        memset (
+            &rows[ ( long ) source->capacity * source->prefix ],
+            0,
+            sizeof ( source_row_t ) * ( capacity - source->capacity ) * source->prefix );
+        source->rows = rows;
+        source->capacity = capacity;
+        return 0;
+    }
+
+    raw = __arena ( capacity, sizeof ( unsigned long ), source );
+    if ( raw == NULL ) {
+        return -1;
+    }
+    // Old matrixes are kept, new ones are empty
+    if ( source->raw != NULL ) {
+        memcpy ( raw, source->raw, sizeof ( unsigned long ) * source->capacity * source->stride );
+    }
+    memset (
+        &raw[ ( long ) source->capacity * source->stride ],
+        0,
+        sizeof ( unsigned long ) * ( capacity - source->capacity ) * source->stride );
+    free ( source->raw );
+
+    source->raw = raw;
+    source->capacity = capacity;
+    return 0;
+}
+
+/*
+ * Adds examples to a row of a sparse source,
+ * keeping its outcomes ordered.
+ */
+int __insert ( source_row_t * row, int out, unsigned long count ) {
+    int k = 0;
+
+    while ( k < row->n && row->entry[k].col < out ) {
+        k ++;
+    }
+    if ( k < row->n && row->entry[k].col == out ) {
+        row->entry[k].count += count;
+        return 0;
+    }
+
+    if ( row->n == row->size ) {
+        int size = ( row->size > 0 ) ? 2 * row->size : 4;
+        source_entry_t * entry = realloc ( row->entry, sizeof ( source_entry_t ) * size );
+        if ( entry == NULL ) {
+            return -1;
+        }
+        row->entry = entry;
+        row->size = size;
+    }
+    memmove ( &row->entry[k + 1], &row->entry[k], sizeof ( source_entry_t ) * ( row->n - k ) );
+    row->entry[k].col = out;
+    row->entry[k].count = count;
+    row->n ++;
+    return 0;
+}
+
+int source_add ( int pos, int row, int out, unsigned long count, source_t * source ) {
+    if ( pos < 0 || row < 0 || row >= source->prefix || out < 0 || out >= source->omega ) {
+        return -1;
+    }
+    if ( pos >= source->n ) {
+        if ( source_reserve ( pos + 1, source ) != 0 ) {
+            return -1;
         }
         source->n = pos + 1;
     }
+    // Unobserved outcomes aren't stored
+    if ( count == 0 ) {
+        return 0;
+    }
+
+    if ( source->sparse ) {
+        if ( source->rows == NULL ) {
+            return -1;
+        }
+        return __insert ( &source->rows[ ( long ) pos * source->prefix + row ], out, count );
+    }
+    source->raw[ ( long ) pos * source->stride + row * source->omega + out ] += count;
+    return 0;
+}
+
+int source_bin ( int exact, int width, source_t * source ) {
+    if ( exact < 0 || width < 0 || source->n > 0 || source->mapped ) {
+        return -1;
+    }
+    source->exact = exact;
+    source->width = width;
+    return 0;
+}
+
+/*
+ * Matrix of a position
+ */
+int __bin ( int pos, source_t * source ) {
+    int exact = source->exact;
+    long base;
+    int k;
+
+    if ( exact == 0 || pos < exact ) {
+        return pos;
+    }
+    if ( source->width > 0 ) {
+        return exact + ( pos - exact ) / source->width;
+    }
+
+    // Largest k such that exact * 2^k <= pos
+    k = __builtin_clz ( exact ) - __builtin_clz ( pos );
+    if ( ( ( long ) exact << k ) > pos ) {
+        k --;
+    }
+    base = ( long ) exact << k;
+    return exact + k * SOURCE_LOG_BINS + ( int ) ( ( pos - base ) * SOURCE_LOG_BINS / base );
+}
+
+int source_update ( unsigned char * in, int len, int pos, int out, source_t * source ) {
+    if ( pos < 0 || source_add ( __bin ( pos, source ), __index ( in, len, source ), out, 1, source ) != 0 ) {
+        return -1;
+    }
+    source->length = ( pos < source->length ) ? source->length : pos + 1;
+    return 0;
+}
 
-    int index = __index ( in, len, source );
+/*
+ * Entries of a row of a sparse
+ * source, while learning or normalized.
+ */
+source_entry_t * __row ( long row, int * n, source_t * source ) {
+    if ( source->entry != NULL ) {
+        *n = source->offset[row + 1] - source->offset[row];
+        return &source->entry[source->offset[row]];
+    }
+    *n = source->rows[row].n;
+    return source->rows[row].entry;
+}
 
-    //  Update stats
-    source->raw[pos][ index * source->omega + out ] ++;
+int source_merge ( source_t * dst, source_t * src ) {
+    if ( dst->mapped || dst->sigma != src->sigma || dst->omega != src->omega || dst->m != src->m ||
+         dst->exact != src->exact || dst->width != src->width ) {
+        return -1;
+    }
+    if ( src->n > dst->n ) {
+        if ( source_reserve ( src->n, dst ) != 0 ) {
+            return -1;
+        }
+        dst->n = src->n;
+    }
+    dst->length = ( src->length < dst->length ) ? dst->length : src->length;
+
+    // Same kind of storage for sources with the same alphabets
+    if ( dst->sparse ) {
+        if ( dst->entry != NULL ) {
+            return -1;
+        }
+        for ( long row = 0; row < ( long ) src->n * src->prefix; row ++ ) {
+            int n;
+            source_entry_t * entry = __row ( row, &n, src );
+            for ( int k = 0; k < n; k ++ ) {
+                if ( __insert ( &dst->rows[row], entry[k].col, entry[k].count ) != 0 ) {
+                    return -1;
+                }
+            }
+        }
+        return 0;
+    }
+
+    // Same stride for sources with the same alphabets
+    long size = ( long ) src->n * src->stride;
+    for ( long i = 0; i < size; i ++ ) {
+        dst->raw[i] += src->raw[i];
+    }
 
     return 0;
 }
@@ -101,72 +334,284 @@ void source_learn_word ( unsigned char * w, int size, source_t * source ) {
     source_update ( &w[i - len], len, i, source->omega - 1, source );
 }
 
-void __normalize ( source_t * source ) {
-    unsigned long sum;
+/*
+ * Builds the alias table of a single row
+ * following Vose's method. Integer arithmetic
+ * is used to pair the outcomes, so that an
+ * outcome never seen while learning can't be
+ * generated because of rounding errors.
+ */
+void __alias ( unsigned long * raw, double * prob, int * alias, int omega, unsigned long * scaled, int * small, int * large ) {
+    unsigned long sum = 0;
+    int n_small = 0;
+    int n_large = 0;
+    int s, l;
 
-    // Alloc matrix
-    source->normalized = malloc ( sizeof ( double * ) * source->n );
-    for ( int i = 0; i < source->n; i ++ ) {
-        source->normalized[i] = calloc (
-                                    source->omega * source->prefix,
-                                    sizeof ( double )
-                                );
-        for ( int j = 0; j < source->prefix; j ++ ) {
-            sum = 0;
-            for ( int k = 0; k < source->omega; k ++ ) {
-                sum += source->raw[i][ j * source->omega + k ];
-            }
-            for ( int k = 0; k < source->omega; k ++ ) {
-                if ( sum == 0 ) {
-                    source->normalized[i][ j * source->omega + k ] = 0;
-                } else {
-                    source->normalized[i][ j * source->omega + k ] = ( double ) source->raw[i][ j * source->omega + k ] / sum;
-                }
-            }
+    for ( int k = 0; k < omega; k ++ ) {
+        sum += raw[k];
+    }
+
+    // Empty row, the first outcome is always generated
+    if ( sum == 0 ) {
+        for ( int k = 0; k < omega; k ++ ) {
+            prob[k] = 0;
+            alias[k] = 0;
         }
+        return;
+    }
+
+    // Probabilities scaled by omega, sum is the unit
+    for ( int k = 0; k < omega; k ++ ) {
+        scaled[k] = raw[k] * omega;
+        if ( scaled[k] < sum ) {
+            small[n_small++] = k;
+        } else {
+            large[n_large++] = k;
+        }
+    }
+
+    // Pair each underfull column with an overfull one
+    while ( n_small > 0 && n_large > 0 ) {
+        s = small[--n_small];
+        l = large[--n_large];
+        prob[s] = ( double ) scaled[s] / sum;
+        alias[s] = l;
+        scaled[l] = ( scaled[l] + scaled[s] ) - sum;
+        if ( scaled[l] < sum ) {
+            small[n_small++] = l;
+        } else {
+            large[n_large++] = l;
+        }
+    }
+
+    // Remaining columns are exactly full
+    while ( n_large > 0 ) {
+        l = large[--n_large];
+        prob[l] = 1;
+        alias[l] = l;
+    }
+    while ( n_small > 0 ) {
+        s = small[--n_small];
+        prob[s] = 1;
+        alias[s] = s;
     }
 }
 
-unsigned char source_generate ( unsigned char * in, int len, int pos, source_t * source ) {
-    double * p;
-    double outcome;
-    double threshold;
+/*
+ * Builds the cumulative row of a narrow source.
+ * Each threshold is computed from the exact
+ * count of the previous outcomes, so that there
+ * is no accumulated error, an outcome never seen
+ * has an empty interval and the last threshold
+ * is always SOURCE_UNIT.
+ */
+void __cumulative ( unsigned long * raw, uint32_t * cdf, int omega ) {
+    unsigned long sum = 0;
+    unsigned long partial = 0;
 
-    if ( source->normalized == NULL ) {
-        __normalize ( source );
+    for ( int k = 0; k < omega; k ++ ) {
+        sum += raw[k];
     }
 
-    // Random decision about the alternatives
-    outcome = ( double ) rand() / RAND_MAX;
-    threshold = 0;
-    int index = __index ( in, len, source );
-    p = & ( source->normalized[pos][ index * source->omega ] );
-    for ( int i = 0; i < source->omega; i++ ) {
-        if ( threshold <= outcome && outcome < threshold + *p ) {
-            return ( unsigned char ) i;
-        } else {
-            threshold += *p;
+    // Empty row, the first outcome is always generated
+    if ( sum == 0 ) {
+        for ( int k = 0; k < omega; k ++ ) {
+            cdf[k] = SOURCE_UNIT;
+        }
+        return;
+    }
+
+    for ( int k = 0; k < omega; k ++ ) {
+        partial += raw[k];
+        cdf[k] = ( uint32_t ) ( ( double ) partial / sum * SOURCE_UNIT );
+    }
+}
+
+/*
+ * Compacts the rows of a sparse source, the
+ * entries of consecutive rows are contiguous.
+ */
+int __compact ( source_t * source ) {
+    long rows = ( long ) source->n * source->prefix;
+    long k = 0;
+
+    source->entries = 0;
+    for ( long row = 0; row < rows; row ++ ) {
+        source->entries += source->rows[row].n;
+    }
+    source->offset = malloc ( sizeof ( long ) * ( rows + 1 ) );
+    source->entry = malloc ( sizeof ( source_entry_t ) * ( source->entries + 1 ) );
+    if ( source->offset == NULL || source->entry == NULL ) {
+        free ( source->offset );
+        free ( source->entry );
+        source->offset = NULL;
+        source->entry = NULL;
+        return -1;
+    }
+
+    for ( long row = 0; row < rows; row ++ ) {
+        source->offset[row] = k;
+        if ( source->rows[row].n > 0 ) {
+            memcpy ( &source->entry[k], source->rows[row].entry, sizeof ( source_entry_t ) * source->rows[row].n );
+        }
+        k += source->rows[row].n;
+        free ( source->rows[row].entry );
+    }
+    source->offset[rows] = k;
+    free ( source->rows );
+    source->rows = NULL;
+    return 0;
+}
+
+int __normalize ( source_t * source ) {
+    int omega = source->omega;
+
+    if ( ! source->sparse ) {
+        source->cdf = __arena ( source->n, sizeof ( uint32_t ), source );
+        if ( source->cdf == NULL ) {
+            return -1;
+        }
+        for ( int i = 0; i < source->n; i ++ ) {
+            for ( int j = 0; j < source->prefix; j ++ ) {
+                long offset = ( long ) i * source->stride + j * omega;
+                __cumulative ( &source->raw[offset], &source->cdf[offset], omega );
+            }
+        }
+        return 0;
+    }
+
+    if ( source->entry == NULL && __compact ( source ) != 0 ) {
+        return -1;
+    }
+
+    unsigned long * count = malloc ( sizeof ( unsigned long ) * omega );
+    unsigned long * scaled = malloc ( sizeof ( unsigned long ) * omega );
+    int * small = malloc ( sizeof ( int ) * omega );
+    int * large = malloc ( sizeof ( int ) * omega );
+
+    // Alias tables over the observed outcomes of each row
+    source->normalized = malloc ( sizeof ( double ) * ( source->entries + 1 ) );
+    source->alias = malloc ( sizeof ( int ) * ( source->entries + 1 ) );
+    if ( count == NULL || scaled == NULL || small == NULL || large == NULL ||
+         source->normalized == NULL || source->alias == NULL ) {
+        free ( count );
+        free ( scaled );
+        free ( small );
+        free ( large );
+        free ( source->normalized );
+        free ( source->alias );
+        // Not normalized
+        source->normalized = NULL;
+        source->alias = NULL;
+        return -1;
+    }
+    for ( long row = 0; row < ( long ) source->n * source->prefix; row ++ ) {
+        long offset = source->offset[row];
+        int n = source->offset[row + 1] - offset;
+        for ( int k = 0; k < n; k ++ ) {
+            count[k] = source->entry[offset + k].count;
         }
-        p ++;
+        __alias (
+            count,
+            &source->normalized[offset],
+            &source->alias[offset],
+            n, scaled, small, large );
     }
+
+    free ( count );
+    free ( scaled );
+    free ( small );
+    free ( large );
     return 0;
 }
 
-unsigned char * source_generate_word ( unsigned char * w, int * size, source_t * source ) {
+bool __normalized ( source_t * source ) {
+    return ( source->sparse ) ? source->normalized != NULL : source->cdf != NULL;
+}
+
+int source_normalize ( source_t * source ) {
+    if ( ! __normalized ( source ) ) {
+        return __normalize ( source );
+    }
+    return 0;
+}
+
+int source_draws ( source_t * source ) {
+    return ( source->sparse ) ? 2 : 1;
+}
+
+long source_row ( unsigned char * in, int len, int pos, source_t * source ) {
+    long bin = __bin ( pos, source );
+
+    if ( source->sparse ) {
+        return bin * source->prefix + __index ( in, len, source );
+    }
+    // Dense rows are located in the arena
+    return bin * source->stride + ( long ) __index ( in, len, source ) * source->omega;
+}
+
+int source_sample ( long row, const uint32_t * r, source_t * source ) {
+    double outcome;
+    int column;
+    long index;
+    int n;
+
+    // Number of thresholds not above the random number
+    if ( ! source->sparse ) {
+        uint32_t u = r[0] >> 1;
+        uint32_t * cdf = &source->cdf[row];
+        int k = 0;
+        for ( int z = 0; z < source->omega; z ++ ) {
+            k += ( cdf[z] <= u );
+        }
+        return k;
+    }
+
+    // Random decision about the observed outcomes, as rng_uniform
+    index = source->offset[row];
+    n = source->offset[row + 1] - index;
+    outcome = ( ( r[0] >> 5 ) * 67108864.0 + ( r[1] >> 6 ) ) / 9007199254740992.0 * n;
+    column = ( int ) outcome;
+    // Empty row, the first outcome is always generated
+    if ( n == 0 ) {
+        return 0;
+    }
+
+    // Biased coin between the column and its alias
+    if ( outcome - column >= source->normalized[index + column] ) {
+        column = source->alias[index + column];
+    }
+    return source->entry[index + column].col;
+}
+
+int source_generate ( unsigned char * in, int len, int pos, rng_t * rng, source_t * source ) {
+    uint32_t r[2];
+
+    if ( ! __normalized ( source ) ) {
+        __normalize ( source );
+    }
+    for ( int d = 0; d < source_draws ( source ); d ++ ) {
+        r[d] = rng_next ( rng );
+    }
+
+    return source_sample ( source_row ( in, len, pos, source ), r, source );
+}
+
+unsigned char * source_generate_word ( unsigned char * w, int * size, rng_t * rng, source_t * source ) {
     int m = source->m;
     int len;
     int i;
     
     if ( w == NULL ){
-        w = malloc ( sizeof ( unsigned char ) * source->n );
+        w = malloc ( sizeof ( unsigned char ) * source->length );
     }
 
-    *size = source->n;
+    *size = source->length;
 
     for ( i = 0; i < *size; i ++ ){
         // Length of the sample
         len = ( i < m ) ? i : m;
-        w[i] = source_generate ( &w[i - len], len, i, source );
+        w[i] = source_generate ( &w[i - len], len, i, rng, source );
         if ( w[i] == source->omega - 1 ){
             *size = i+1;
             return w;
@@ -176,32 +621,264 @@ unsigned char * source_generate_word ( unsigned char * w, int * size, source_t *
     return w;
 }
 
+void source_generate_words ( int n, unsigned char * w, int * size, uint32_t * random, rng_t * rng, source_t * source ) {
+    int draws = source_draws ( source );
+    long modulo = source->prefix;
+    long index;
+    uint32_t * r;
+
+    source_normalize ( source );
+
+    for ( int k = 0; k < n; k ++ ) {
+        unsigned char * word = &w[( long ) k * source->length];
+        rng_fill ( random, ( long ) source->length * draws, rng );
+        r = random;
+        // Every character of the prefix is empty
+        index = modulo - 1;
+        size[k] = source->length;
+        for ( int i = 0; i < source->length; i ++ ) {
+            long bin = __bin ( i, source );
+            long row = ( source->sparse ) ? bin * source->prefix + index : bin * source->stride + index * source->omega;
+            word[i] = source_sample ( row, r, source );
+            r += draws;
+            if ( word[i] == source->omega - 1 ) {
+                size[k] = i + 1;
+                break;
+            }
+            // The oldest character leaves the prefix
+            index = ( index * source->sigma + word[i] ) % modulo;
+        }
+    }
+}
+
 void source_dump ( FILE * file, char * source_name, source_t * source ) {
-    fprintf ( file, "@%s %d %d %d\n", source_name, source->n, source->prefix, source->omega );
+    fprintf ( file, "@%s %d %d %d %d %d %d\n", source_name, source->n, source->prefix, source->omega, source->length, source->exact, source->width );
+
+    // Observed outcomes as row:outcome:count
+    if ( source->sparse ) {
+        for ( int i = 0; i < source->n; i ++ ) {
+            for ( int j = 0; j < source->prefix; j ++ ) {
+                int n;
+                source_entry_t * entry = __row ( ( long ) i * source->prefix + j, &n, source );
+                for ( int k = 0; k < n; k ++ ) {
+                    fprintf ( file, "%d:%d:%lu ", j, entry[k].col, entry[k].count );
+                }
+            }
+            fprintf ( file, "\n" );
+        }
+        return;
+    }
 
     for ( int i = 0; i < source->n; i ++ ) {
+        unsigned long * raw = &source->raw[ ( long ) i * source->stride ];
         for ( int j = 0; j < source->prefix; j ++ ) {
             for ( int z = 0; z < ( int ) source->omega; z ++ ) {
-                fprintf ( file, "%lu ", source->raw[i][j * source->omega + z] );
+                fprintf ( file, "%lu ", raw[j * source->omega + z] );
             }
         }
         fprintf ( file, "\n" );
     }
 }
 
-void source_destroy ( source_t * source ) {
-    if ( source == NULL ){
+/*
+ * Writes a table padded to the alignment
+ */
+int __table ( FILE * file, void * data, long size ) {
+    char padding[SOURCE_ALIGNMENT] = { 0 };
+    long padded = __aligned ( size );
+
+    if ( ( size > 0 && fwrite ( data, 1, size, file ) != ( size_t ) size ) ||
+         fwrite ( padding, 1, padded - size, file ) != ( size_t ) ( padded - size ) ) {
+        return -1;
+    }
+    return 0;
+}
+
+int source_write ( FILE * file, source_t * source ) {
+    source_header_t header;
+    size_t size = ( size_t ) source->n * source->stride;
+    long rows = ( long ) source->n * source->prefix;
+
+    if ( source_normalize ( source ) != 0 ) {
+        return -1;
+    }
+
+    memset ( &header, 0, sizeof ( source_header_t ) );
+    header.n = source->n;
+    header.sigma = source->sigma;
+    header.omega = source->omega;
+    header.m = source->m;
+    header.stride = source->stride;
+    header.sparse = source->sparse;
+    header.entries = source->entries;
+    header.length = source->length;
+    header.exact = source->exact;
+    header.width = source->width;
+    if ( fwrite ( &header, sizeof ( source_header_t ), 1, file ) != 1 ) {
+        return -1;
+    }
+
+    // Offsets of the rows, entries and their alias tables
+    if ( source->sparse ) {
+        if ( __table ( file, source->offset, sizeof ( long ) * ( rows + 1 ) ) != 0 ||
+             __table ( file, source->entry, sizeof ( source_entry_t ) * source->entries ) != 0 ||
+             __table ( file, source->normalized, sizeof ( double ) * source->entries ) != 0 ||
+             __table ( file, source->alias, sizeof ( int ) * source->entries ) != 0 ) {
+            return -1;
+        }
+        return 0;
+    }
+
+    // Every table is a multiple of the alignment
+    if ( fwrite ( source->raw, sizeof ( unsigned long ), size, file ) != size ||
+         fwrite ( source->cdf, sizeof ( uint32_t ), size, file ) != size ) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Frees the tables owned by a source
+ */
+void __free ( source_t * source ) {
+    if ( source->mapped ) {
         return;
     }
-    for ( int i = 0; i < source->n; i ++ ) {
-        free ( source->raw[i] );
+    if ( source->rows != NULL ) {
+        for ( long row = 0; row < ( long ) source->capacity * source->prefix; row ++ ) {
+            free ( source->rows[row].entry );
+        }
     }
     free ( source->raw );
-    if ( source->normalized != NULL ) {
-        for ( int i = 0; i < source->n; i ++ ) {
-            free ( source->normalized[i] );
+    free ( source->cdf );
+    free ( source->rows );
+    free ( source->offset );
+    free ( source->entry );
+    free ( source->normalized );
+    free ( source->alias );
+}
+
+long source_map ( void * data, long size, source_t * source ) {
+    source_header_t * header = data;
+    char * ptr = data;
+    long elements;
+    long rows;
+    long total;
+
+    if ( size < ( long ) sizeof ( source_header_t ) ) {
+        return -1;
+    }
+    if ( header->sigma != source->sigma || header->omega != source->omega ||
+         header->m != source->m || header->stride != source->stride || header->n < 0 ||
+         header->sparse != source->sparse || header->entries < 0 ||
+         header->length < 0 || header->exact < 0 || header->width < 0 ) {
+        return -1;
+    }
+    // Every position below the length is binned to one of the matrixes
+    if ( header->length > 0 ) {
+        source_t binning = *source;
+        binning.exact = header->exact;
+        binning.width = header->width;
+        if ( header->n == 0 || __bin ( header->length - 1, &binning ) >= header->n ) {
+            return -1;
         }
-        free ( source->normalized );
     }
+    elements = ( long ) header->n * header->stride;
+    rows = ( long ) header->n * source->prefix;
+    if ( source->sparse ) {
+        total = sizeof ( source_header_t ) + __aligned ( sizeof ( long ) * ( rows + 1 ) ) +
+                __aligned ( sizeof ( source_entry_t ) * header->entries ) +
+                __aligned ( sizeof ( double ) * header->entries ) +
+                __aligned ( sizeof ( int ) * header->entries );
+    }
+    else {
+        total = sizeof ( source_header_t ) + elements * ( sizeof ( unsigned long ) + sizeof ( uint32_t ) );
+    }
+    if ( total > size ) {
+        return -1;
+    }
+
+    ptr += sizeof ( source_header_t );
+    if ( source->sparse ) {
+        long * offset = ( long * ) ptr;
+        source_entry_t * entry = ( source_entry_t * ) ( ptr + __aligned ( sizeof ( long ) * ( rows + 1 ) ) );
+        int * alias = ( int * ) ( ( char * ) entry + __aligned ( sizeof ( source_entry_t ) * header->entries ) +
+                                  __aligned ( sizeof ( double ) * header->entries ) );
+        // Rows inside the entries, outcomes inside the alphabet
+        if ( offset[0] != 0 || offset[rows] != header->entries ) {
+            return -1;
+        }
+        for ( long row = 0; row < rows; row ++ ) {
+            if ( offset[row + 1] < offset[row] ) {
+                return -1;
+            }
+        }
+        for ( long k = 0; k < header->entries; k ++ ) {
+            if ( entry[k].col < 0 || entry[k].col >= source->omega ) {
+                return -1;
+            }
+        }
+        // Aliases inside their row
+        for ( long row = 0; row < rows; row ++ ) {
+            for ( long k = offset[row]; k < offset[row + 1]; k ++ ) {
+                if ( alias[k] < 0 || alias[k] >= offset[row + 1] - offset[row] ) {
+                    return -1;
+                }
+            }
+        }
+    }
+    else {
+        uint32_t * cdf = ( uint32_t * ) ( ptr + elements * sizeof ( unsigned long ) );
+        // The last threshold of each row keeps the outcomes inside the alphabet
+        for ( long i = 0; i < header->n; i ++ ) {
+            for ( int j = 0; j < source->prefix; j ++ ) {
+                if ( cdf[i * header->stride + ( long ) ( j + 1 ) * source->omega - 1] != SOURCE_UNIT ) {
+                    return -1;
+                }
+            }
+        }
+    }
+
+    // Tables allocated until now
+    __free ( source );
+    source->raw = NULL;
+    source->cdf = NULL;
+    source->rows = NULL;
+    source->offset = NULL;
+    source->entry = NULL;
+    source->normalized = NULL;
+    source->alias = NULL;
+
+    if ( source->sparse ) {
+        source->offset = ( long * ) ptr;
+        ptr += __aligned ( sizeof ( long ) * ( rows + 1 ) );
+        source->entry = ( source_entry_t * ) ptr;
+        ptr += __aligned ( sizeof ( source_entry_t ) * header->entries );
+        source->normalized = ( double * ) ptr;
+        ptr += __aligned ( sizeof ( double ) * header->entries );
+        source->alias = ( int * ) ptr;
+        source->entries = header->entries;
+    }
+    else {
+        source->raw = ( unsigned long * ) ptr;
+        ptr += elements * sizeof ( unsigned long );
+        source->cdf = ( uint32_t * ) ptr;
+    }
+    source->n = header->n;
+    source->capacity = header->n;
+    source->length = header->length;
+    source->exact = header->exact;
+    source->width = header->width;
+    source->mapped = true;
+
+    return total;
+}
+
+void source_destroy ( source_t * source ) {
+    if ( source == NULL ){
+        return;
+    }
+    __free ( source );
     free ( source );
 }
@@ -8,8 +8,8 @@
  */
 
 #include <stdlib.h>
-#include <ctype.h>
 #include <string.h>
+#include "encoding.h"
 #include "stats.h"
 
 stats_t * stats_init ( ) {
@@ -29,35 +29,6 @@ stats_t * stats_init ( ) {
     return stats;
 }
 
-static unsigned char __nucleotide ( char nucleotide ) {
-    nucleotide = toupper ( nucleotide );
-    switch ( nucleotide ) {
-    case 'A':
-        return 0;
-    case 'C':
-        return 1;
-    case 'G':
-        return 2;
-    case 'T':
-        return 3;
-    }
-    return 4;
-}
-
-static char __nucleotide_rev ( unsigned char nucleotide ) {
-    switch ( nucleotide ) {
-    case 0:
-        return 'A';
-    case 1:
-        return 'C';
-    case 2:
-        return 'G';
-    case 3:
-        return 'T';
-    }
-    return 'N';
-}
-
 void stats_update ( unsigned char * align, int alg_len, char * read, char * ref, unsigned char * quality, stats_t * stats ) {
     // Pointers
     char * ptr_read = read;
@@ -84,8 +55,8 @@ void stats_update ( unsigned char * align, int alg_len, char * read, char * ref,
             ptr_ref ++;
             break;
         case 3: {
-            in = __nucleotide ( *ptr_ref );
-            out = __nucleotide ( *ptr_read );
+            in = enc_code[( unsigned char ) *ptr_ref];
+            out = enc_code[( unsigned char ) *ptr_read];
             source_update ( &in, 1, i, out, stats->mismatch );
             i++;
             ptr_ref++;
@@ -100,7 +71,37 @@ void stats_update ( unsigned char * align, int alg_len, char * read, char * ref,
     }
 }
 
-read_t * stats_generate_read ( char * ref, read_t * read, stats_t * stats ){
+int stats_merge ( stats_t * dst, stats_t * src ) {
+    if ( source_merge ( dst->alignment, src->alignment ) != 0 ||
+         source_merge ( dst->mismatch, src->mismatch ) != 0 ||
+         source_merge ( dst->quality, src->quality ) != 0 ||
+         source_merge ( dst->distribution, src->distribution ) != 0 ) {
+        return -1;
+    }
+    return 0;
+}
+
+int stats_bin ( int exact, int width, stats_t * stats ) {
+    if ( source_bin ( exact, width, stats->alignment ) != 0 ||
+         source_bin ( exact, width, stats->mismatch ) != 0 ||
+         source_bin ( exact, width, stats->quality ) != 0 ||
+         source_bin ( exact, width, stats->distribution ) != 0 ) {
+        return -1;
+    }
+    return 0;
+}
+
+int stats_normalize ( stats_t * stats ) {
+    if ( source_normalize ( stats->alignment ) != 0 ||
+         source_normalize ( stats->mismatch ) != 0 ||
+         source_normalize ( stats->quality ) != 0 ||
+         source_normalize ( stats->distribution ) != 0 ) {
+        return -1;
+    }
+    return 0;
+}
+
+read_t * stats_generate_read ( char * ref, read_t * read, rng_t * rng, stats_t * stats ){
     int i = 0;
     int pos = 0;
     unsigned char in, out;
@@ -116,25 +117,25 @@ read_t * stats_generate_read ( char * ref, read_t * read, stats_t * stats ){
     }
 
     // Check if read memory must be reallocated
-    if ( ( stats->quality->n + 1 ) > read->buffer_size ) {
-      read->read = realloc ( read->read, sizeof ( char ) *  ( stats->quality->n + 1 ) );
-      read->quality = realloc ( read->quality, sizeof ( char ) * ( stats->quality->n + 1 ) );
-      read->buffer_size = stats->quality->n + 1;
+    if ( ( stats->quality->length + 1 ) > read->buffer_size ) {
+      read->read = realloc ( read->read, sizeof ( char ) *  ( stats->quality->length + 1 ) );
+      read->quality = realloc ( read->quality, sizeof ( char ) * ( stats->quality->length + 1 ) );
+      read->buffer_size = stats->quality->length + 1;
     }
 
     // Alignment generation
-    read->align = source_generate_word ( read->align, &read->alg_len, stats->alignment );
+    read->align = source_generate_word ( read->align, &read->alg_len, rng, stats->alignment );
     // Read status
     read->cut = false;
    
     // Read
     for ( int z = 0; z < read->alg_len; z ++ ) {
         // Minimum position
-        pos = ( i < stats->quality->n ) ? i : stats->quality->n - 1;
-        pos = ( pos < stats->mismatch->n ) ? pos : stats->mismatch->n - 1;
+        pos = ( i < stats->quality->length ) ? i : stats->quality->length - 1;
+        pos = ( pos < stats->mismatch->length ) ? pos : stats->mismatch->length - 1;
         // Quality score ignored if insertion or if end of alignment
         if ( read->align[z] != 2 && read->align[z] < 4) {
-            read->quality[pos] = source_generate ( &read->align[z], 1, pos, stats->quality );
+            read->quality[pos] = source_generate ( &read->align[z], 1, pos, rng, stats->quality );
         }
         switch ( read->align[z] ) {
         case 0:
@@ -143,16 +144,16 @@ read_t * stats_generate_read ( char * ref, read_t * read, stats_t * stats ){
             ref ++;
             break;
         case 1:
-            read->read[pos] = __nucleotide_rev ( rand () % 4 );
+            read->read[pos] = enc_base[rng_range ( 4, rng )];
             i++;
             break;
         case 2:
             ref ++;
             break;
         case 3:
-            in = __nucleotide ( *ref );
-            out = source_generate ( &in, 1, pos, stats->mismatch );
-            read->read[pos] = __nucleotide_rev ( out );
+            in = enc_code[( unsigned char ) *ref];
+            out = source_generate ( &in, 1, pos, rng, stats->mismatch );
+            read->read[pos] = enc_base[out];
             i++;
             ref++;
             break;
@@ -165,14 +166,210 @@ read_t * stats_generate_read ( char * ref, read_t * read, stats_t * stats ){
     }
 
     // Terminal
-    pos = ( i < stats->quality->n ) ? i : stats->quality->n - 1;
-    pos = ( pos < stats->mismatch->n ) ? pos : stats->mismatch->n - 1;
+    pos = ( i < stats->quality->length ) ? i : stats->quality->length - 1;
+    pos = ( pos < stats->mismatch->length ) ? pos : stats->mismatch->length - 1;
     read->read[pos] = '\0';
     read->quality[pos] = '\0';
 
     return read;
 }
 
+read_batch_t * stats_batch_init ( int size, stats_t * stats ) {
+    read_batch_t * batch = malloc ( sizeof ( read_batch_t ) );
+    if ( batch == NULL ) {
+        return NULL;
+    }
+
+    if ( stats_normalize ( stats ) != 0 ) {
+        free ( batch );
+        return NULL;
+    }
+    batch->n = 0;
+    batch->size = size;
+    batch->alg_stride = stats->alignment->length;
+    batch->stride = stats->quality->length + 1;
+    // Minimum position
+    batch->last = ( stats->quality->length < stats->mismatch->length ) ? stats->quality->length : stats->mismatch->length;
+    batch->last = ( batch->last > 0 ) ? batch->last - 1 : 0;
+
+    // Never empty, even without alignments
+    batch->align = malloc ( sizeof ( unsigned char ) * size * batch->alg_stride + 1 );
+    batch->alg_len = malloc ( sizeof ( int ) * size );
+    batch->read = malloc ( sizeof ( char ) * size * batch->stride );
+    batch->quality = malloc ( sizeof ( unsigned char ) * size * batch->stride );
+    batch->length = malloc ( sizeof ( int ) * size );
+    batch->start = malloc ( sizeof ( long ) * size );
+    batch->cut = malloc ( sizeof ( bool ) * size );
+    batch->quality_row = malloc ( sizeof ( long ) * ( batch->last + 1 ) * stats->quality->sigma );
+    batch->mismatch_row = malloc ( sizeof ( long ) * ( batch->last + 1 ) * stats->mismatch->sigma );
+    // Enough for a whole alignment
+    batch->random_size = ( long ) batch->alg_stride * source_draws ( stats->alignment ) + 1;
+    batch->random = malloc ( sizeof ( uint32_t ) * batch->random_size );
+    if ( batch->align == NULL || batch->alg_len == NULL || batch->read == NULL ||
+         batch->quality == NULL || batch->length == NULL || batch->start == NULL ||
+         batch->cut == NULL || batch->quality_row == NULL || batch->mismatch_row == NULL ||
+         batch->random == NULL ) {
+        stats_batch_destroy ( batch );
+        return NULL;
+    }
+
+    // Lookups of the distributions, hoisted out of the generation
+    for ( int pos = 0; pos <= batch->last; pos ++ ) {
+        for ( unsigned char c = 0; c < stats->quality->sigma; c ++ ) {
+            batch->quality_row[pos * stats->quality->sigma + c] = source_row ( &c, 1, pos, stats->quality );
+        }
+        for ( unsigned char c = 0; c < stats->mismatch->sigma; c ++ ) {
+            batch->mismatch_row[pos * stats->mismatch->sigma + c] = source_row ( &c, 1, pos, stats->mismatch );
+        }
+    }
+
+    return batch;
+}
+
+void stats_batch_align ( int n, read_batch_t * batch, rng_t * rng, stats_t * stats ) {
+    batch->n = ( n < batch->size ) ? n : batch->size;
+    source_generate_words ( batch->n, batch->align, batch->alg_len, batch->random, rng, stats->alignment );
+
+    // Nucleotides of the alignment, before the end
+    for ( int k = 0; k < batch->n; k ++ ) {
+        unsigned char * align = &batch->align[( long ) k * batch->alg_stride];
+        int i = 0;
+        for ( int z = 0; z < batch->alg_len[k]; z ++ ) {
+            i += ( align[z] == 0 || align[z] == 1 || align[z] == 3 );
+        }
+        batch->length[k] = ( i < batch->last ) ? i : batch->last;
+        batch->cut[k] = false;
+    }
+}
+
+void stats_batch_clip ( int k, long n, read_batch_t * batch ) {
+    unsigned char * align = &batch->align[( long ) k * batch->alg_stride];
+    long used = 0;
+    int i = 0;
+
+    batch->cut[k] = false;
+    for ( int z = 0; z < batch->alg_len[k]; z ++ ) {
+        i += ( align[z] == 0 || align[z] == 1 || align[z] == 3 );
+        used += ( align[z] == 0 || align[z] == 2 || align[z] == 3 );
+        // Reference ended
+        if ( used >= n ) {
+            batch->cut[k] = true;
+            break;
+        }
+    }
+    batch->length[k] = ( i < batch->last ) ? i : batch->last;
+}
+
+int stats_generate_batch ( char * ref, long ref_stride, read_batch_t * batch, rng_t * rng, stats_t * stats ) {
+    int q_draws = source_draws ( stats->quality );
+    int m_draws = source_draws ( stats->mismatch );
+    int q_sigma = stats->quality->sigma;
+    int m_sigma = stats->mismatch->sigma;
+    long total = 0;
+    uint32_t * r;
+
+    // Random numbers required by the whole alignments
+    for ( int k = 0; k < batch->n; k ++ ) {
+        unsigned char * align = &batch->align[( long ) k * batch->alg_stride];
+        for ( int z = 0; z < batch->alg_len[k]; z ++ ) {
+            total += ( align[z] != 2 && align[z] < 4 ) ? q_draws : 0;
+            total += ( align[z] == 1 ) ? 1 : ( align[z] == 3 ) ? m_draws : 0;
+        }
+    }
+    if ( total > batch->random_size ) {
+        uint32_t * random = realloc ( batch->random, sizeof ( uint32_t ) * total );
+        if ( random == NULL ) {
+            return -1;
+        }
+        batch->random = random;
+        batch->random_size = total;
+    }
+    rng_fill ( batch->random, total, rng );
+    r = batch->random;
+
+    for ( int k = 0; k < batch->n; k ++ ) {
+        unsigned char * align = &batch->align[( long ) k * batch->alg_stride];
+        char * read = &batch->read[( long ) k * batch->stride];
+        unsigned char * quality = &batch->quality[( long ) k * batch->stride];
+        char * seq = &ref[k * ref_stride];
+        unsigned char in;
+        int pos;
+        int i = 0;
+
+        batch->cut[k] = false;
+        for ( int z = 0; z < batch->alg_len[k]; z ++ ) {
+            pos = ( i < batch->last ) ? i : batch->last;
+            // Quality score ignored if insertion or if end of alignment
+            if ( align[z] != 2 && align[z] < 4 ) {
+                quality[pos] = source_sample ( batch->quality_row[pos * q_sigma + align[z]], r, stats->quality );
+                r += q_draws;
+            }
+            switch ( align[z] ) {
+            case 0:
+                read[pos] = *seq;
+                i ++;
+                seq ++;
+                break;
+            case 1:
+                // As rng_range ( 4 )
+                read[pos] = enc_base[*r >> 30];
+                r ++;
+                i ++;
+                break;
+            case 2:
+                seq ++;
+                break;
+            case 3:
+                in = enc_code[( unsigned char ) *seq];
+                read[pos] = enc_base[source_sample ( batch->mismatch_row[pos * m_sigma + in], r, stats->mismatch )];
+                r += m_draws;
+                i ++;
+                seq ++;
+                break;
+            }
+            // Reference ended
+            if ( *seq == '\0' ) {
+                batch->cut[k] = true;
+                break;
+            }
+        }
+
+        // Terminal
+        pos = ( i < batch->last ) ? i : batch->last;
+        read[pos] = '\0';
+        quality[pos] = '\0';
+        batch->length[k] = pos;
+    }
+
+    return 0;
+}
+
+void stats_batch_destroy ( read_batch_t * batch ) {
+    if ( batch == NULL ) {
+        return;
+    }
+    free ( batch->align );
+    free ( batch->alg_len );
+    free ( batch->read );
+    free ( batch->quality );
+    free ( batch->length );
+    free ( batch->start );
+    free ( batch->cut );
+    free ( batch->quality_row );
+    free ( batch->mismatch_row );
+    free ( batch->random );
+    free ( batch );
+}
+
+void stats_read_destroy ( read_t * read ) {
+    if ( read == NULL ) {
+        return;
+    }
+    free ( read->read );
+    free ( read->align );
+    free ( read->quality );
+    free ( read );
+}
 
 void stats_dump ( FILE * file, stats_t * stats ) {
     source_dump ( file, "alignment", stats->alignment );
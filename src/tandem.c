@@ -7,20 +7,90 @@
  * @author Riccardo Massidda
  */
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
 #include "tandem.h"
 
+// Minimum length of the chunk analyzed by a thread
+#define TANDEM_CHUNK ( 1 << 20 )
+// Alignment of the records in the annotation file
+#define TANDEM_ALIGNMENT 8
+
+/*
+ * Tandem found by a step of the analysis,
+ * the repetitions aren't truncated.
+ */
+typedef struct {
+    int pos;
+    int pat;
+    int rep;
+} run_t;
+
+/*
+ * Interval of the sequence analyzed
+ * by a thread, starting from its
+ * first position.
+ */
+typedef struct {
+    const char * reference; // original sequence
+    const char * upper; // uppercase sequence
+    int length; // length of the sequence
+    int max_motif; // size of the maximum motif
+    int beg; // first position of the chunk
+    int end; // last position of the chunk, excluded
+    int stop; // position reached by the analysis, at least end
+    run_t * run; // tandems found
+    int n; // number of tandems
+    int size; // allocated tandems
+} chunk_t;
+
+/*
+ * Header of the annotation file, the sizes
+ * and the byte order are checked since the
+ * tandems are mapped as they are.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t tandem_size;
+    char padding[64 - 8 - 3 * sizeof ( uint32_t )];
+} tandem_header_t;
+
+/*
+ * Header of an entry, followed by
+ * the name and the tandems.
+ */
+typedef struct {
+    int64_t length;
+    int64_t name_size;
+    int32_t n;
+    int32_t max_motif;
+    int32_t max_repetition;
+    uint32_t checksum;
+} tandem_record_t;
+
 tandem_set_t * tandem_set_init ( int length, int max_motif, int max_repetition, tandem_set_t * set ){
     int tmp_size = length / 2;
     // First initialization
     if ( set == NULL ) {
         set = malloc ( sizeof ( tandem_set_t ) );
-        set->set = malloc ( sizeof ( tandem_t * ) * tmp_size );
+        set->set = malloc ( sizeof ( tandem_t ) * tmp_size );
+    }
+    // Tandems shared with a cache
+    else if ( set->mapped ){
+        set->set = malloc ( sizeof ( tandem_t ) * tmp_size );
     }
     // Sequence bigger
     else if ( set->size < tmp_size ){
-        set->set = realloc ( set->set, sizeof ( tandem_t * ) * tmp_size );
+        set->set = realloc ( set->set, sizeof ( tandem_t ) * tmp_size );
     }
     // Motif size
     set->max_motif = max_motif;
@@ -32,61 +102,515 @@ tandem_set_t * tandem_set_init ( int length, int max_motif, int max_repetition,
     set->n = 0;
     // Current tandem
     set->i = 0;
+    // Owned tandems
+    set->mapped = false;
 
     return set;
 }
 
-tandem_set_t * tandem_set_analyze ( char * reference, int length, tandem_set_t * set ){
-    int pos = 0;
-    int max = 0;
-    int w[set->max_motif + 1];
-
-    while ( pos < length ){
-        // Ignore 'N' regions in a chromosome
-        while ( reference[pos] == 'N' ){ pos ++; }
-        // Find best repetition
-        max = 1;
-        // Motif size € [1, max]
-        for ( int i = 1; i <= set->max_motif; i ++ ){
-            // Motif appears at least one time
-            w[i] = 1;
-            // If the sequences are comparable
-            while ( ( pos + (w[i] + 1) * i ) <= length ){
-                if ( strncasecmp ( &reference[pos], &reference[pos + w[i] * i], i ) == 0 ){
-                    w[i] ++;
-                }
-                else{
-                    break;
-                }
+/*
+ * Number of equal characters of two
+ * strings, compared a word at a time.
+ */
+static inline int __match ( const char * a, const char * b, int limit ){
+    int k = 0;
+
+    while ( k + 8 <= limit ){
+        uint64_t x, y, d;
+        memcpy ( &x, &a[k], sizeof ( uint64_t ) );
+        memcpy ( &y, &b[k], sizeof ( uint64_t ) );
+        d = x ^ y;
+        if ( d != 0 ){
+            // First different byte in memory order
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            return k + ( __builtin_clzll ( d ) >> 3 );
+#else
+            return k + ( __builtin_ctzll ( d ) >> 3 );
+#endif
+        }
+        k += 8;
+    }
+    while ( k < limit && a[k] == b[k] ){
+        k ++;
+    }
+
+    return k;
+}
+
+/*
+ * Finds the best tandem at a position.
+ *
+ * @returns     the next position to be analyzed
+ */
+static int __step ( const char * reference, const char * upper, int length, int max_motif, int pos, run_t * run ){
+    int max = 1;
+    int w_max = 1;
+
+    // Ignore 'N' regions in a chromosome
+    while ( reference[pos] == 'N' ){ pos ++; }
+    // Motif size € [1, max]
+    for ( int i = 1; i <= max_motif; i ++ ){
+        int limit = length - pos - i;
+        // Motif appears at least one time, plus the following equal copies
+        int w = ( limit >= i ) ? 1 + __match ( &upper[pos + i], &upper[pos], limit ) / i : 1;
+        // The best tandem is the wider one with at least
+        // two repetitions with the same width wins
+        // the smaller motif
+        if ( i == 1 ){
+            w_max = w;
+        }
+        else if ( w > 1 && ( i * w ) > ( max * w_max ) ){
+            max = i;
+            w_max = w;
+        }
+    }
+
+    run->pos = pos;
+    run->pat = max;
+    run->rep = w_max;
+    // Update position
+    return pos + w_max * max;
+}
+
+static int __append ( run_t * run, chunk_t * chunk ){
+    if ( chunk->n == chunk->size ){
+        int size = ( chunk->size == 0 ) ? 1024 : 2 * chunk->size;
+        run_t * tmp = realloc ( chunk->run, sizeof ( run_t ) * size );
+        if ( tmp == NULL ){
+            return -1;
+        }
+        chunk->run = tmp;
+        chunk->size = size;
+    }
+    chunk->run[chunk->n ++] = *run;
+    return 0;
+}
+
+/*
+ * Analyzes a chunk as if the sequence
+ * started at its first position.
+ */
+static void * __analyze ( void * arg ){
+    chunk_t * chunk = arg;
+    run_t run;
+    int pos = chunk->beg;
+
+    while ( pos < chunk->end ){
+        pos = __step ( chunk->reference, chunk->upper, chunk->length, chunk->max_motif, pos, &run );
+        if ( run.rep > 1 && __append ( &run, chunk ) != 0 ){
+            chunk->stop = -1;
+            return NULL;
+        }
+    }
+    chunk->stop = pos;
+
+    return NULL;
+}
+
+tandem_set_t * tandem_set_analyze ( char * reference, int length, int threads, tandem_set_t * set ){
+    char * upper;
+    chunk_t * chunk;
+    pthread_t * pool;
+    bool * created;
+    int n_chunks;
+    int pos;
+    run_t run;
+    chunk_t result = { 0 };
+
+    // Uppercase once, instead of case insensitive comparisons
+    upper = malloc ( sizeof ( char ) * ( length + 1 ) );
+    if ( upper == NULL ){
+        return NULL;
+    }
+    for ( int j = 0; j < length; j ++ ){
+        char c = reference[j];
+        upper[j] = ( c >= 'a' && c <= 'z' ) ? c - 'a' + 'A' : c;
+    }
+    upper[length] = '\0';
+
+    // Chunks, each one analyzed from its first position
+    n_chunks = length / TANDEM_CHUNK;
+    n_chunks = ( n_chunks < threads ) ? n_chunks : threads;
+    n_chunks = ( n_chunks > 1 ) ? n_chunks : 1;
+    chunk = calloc ( n_chunks, sizeof ( chunk_t ) );
+    pool = malloc ( sizeof ( pthread_t ) * n_chunks );
+    created = calloc ( n_chunks, sizeof ( bool ) );
+    if ( chunk == NULL || pool == NULL || created == NULL ){
+        free ( chunk );
+        free ( pool );
+        free ( created );
+        free ( upper );
+        return NULL;
+    }
+    for ( int c = 0; c < n_chunks; c ++ ){
+        chunk[c].reference = reference;
+        chunk[c].upper = upper;
+        chunk[c].length = length;
+        chunk[c].max_motif = set->max_motif;
+        chunk[c].beg = ( long ) length * c / n_chunks;
+        chunk[c].end = ( long ) length * ( c + 1 ) / n_chunks;
+        if ( c > 0 ){
+            created[c] = pthread_create ( &pool[c], NULL, __analyze, &chunk[c] ) == 0;
+        }
+    }
+    __analyze ( &chunk[0] );
+    for ( int c = 1; c < n_chunks; c ++ ){
+        if ( created[c] ){
+            pthread_join ( pool[c], NULL );
+        } else {
+            // Analyzed by the calling thread
+            __analyze ( &chunk[c] );
+        }
+    }
+
+    /*
+     * Stitching, the first chunk is exact. The analysis
+     * of the following chunk is used from the first position
+     * reached by the exact analysis that isn't inside one of
+     * its tandems, since from there the two analyses coincide.
+     * The positions before are analyzed again.
+     */
+    result = chunk[0];
+    chunk[0].run = NULL;
+    pos = result.stop;
+    for ( int c = 1; c < n_chunks && pos >= 0; c ++ ){
+        int r = 0;
+        if ( chunk[c].stop < 0 ){
+            pos = -1;
+            break;
+        }
+        while ( pos < chunk[c].end ){
+            while ( r < chunk[c].n && chunk[c].run[r].pos + chunk[c].run[r].pat * chunk[c].run[r].rep <= pos ){
+                r ++;
             }
-            // The best tandem is the wider one with at least
-            // two repetitions with the same width wins 
-            // the smaller motif
-            if ( w[i] > 1 && (i * w[i]) > (max * w[max]) ){
-                max = i;
+            if ( r == chunk[c].n || chunk[c].run[r].pos >= pos ){
+                // Same analysis from here on
+                for ( ; r < chunk[c].n && pos >= 0; r ++ ){
+                    if ( __append ( &chunk[c].run[r], &result ) != 0 ){
+                        pos = -1;
+                    }
+                }
+                pos = ( pos >= 0 ) ? chunk[c].stop : pos;
+                break;
             }
-        }
-        if ( w[max] > 1 ){
-            if ( set->n >= set->size ){
-                return set;
+            pos = __step ( reference, upper, length, set->max_motif, pos, &run );
+            if ( run.rep > 1 && __append ( &run, &result ) != 0 ){
+                pos = -1;
+                break;
             }
-            // Save tandem repeat
-            set->set[set->n].pos = pos;
-            set->set[set->n].pat = max;
-            set->set[set->n].rep = w[max];
-            set->n ++;
         }
-        // Update position
-        pos += w[max] * max;
     }
 
-    return set;
+    // Save tandem repeats
+    for ( int r = 0; r < result.n && set->n < set->size; r ++ ){
+        set->set[set->n].pos = result.run[r].pos;
+        set->set[set->n].pat = result.run[r].pat;
+        set->set[set->n].rep = result.run[r].rep;
+        set->n ++;
+    }
+
+    for ( int c = 0; c < n_chunks; c ++ ){
+        free ( chunk[c].run );
+    }
+    free ( result.run );
+    free ( chunk );
+    free ( pool );
+    free ( created );
+    free ( upper );
+
+    return ( pos >= 0 && result.stop >= 0 ) ? set : NULL;
 }
 
 void tandem_set_destroy ( tandem_set_t * set ){
     if ( set == NULL ){
         return;
     }
-    free ( set->set );
+    if ( ! set->mapped ){
+        free ( set->set );
+    }
     free ( set );
 }
+
+static long __padded ( long size ) {
+    return ( size + TANDEM_ALIGNMENT - 1 ) / TANDEM_ALIGNMENT * TANDEM_ALIGNMENT;
+}
+
+/*
+ * Adds an entry to the cache, the
+ * name is copied but not the tandems.
+ */
+static int __insert ( tandem_entry_t * entry, tandem_cache_t * cache ){
+    if ( cache->n == cache->size ){
+        int size = ( cache->size == 0 ) ? 16 : 2 * cache->size;
+        tandem_entry_t * tmp = realloc ( cache->entry, sizeof ( tandem_entry_t ) * size );
+        if ( tmp == NULL ){
+            return -1;
+        }
+        cache->entry = tmp;
+        cache->size = size;
+    }
+    cache->entry[cache->n] = *entry;
+    if ( ! entry->mapped ){
+        cache->entry[cache->n].name = strdup ( entry->name );
+        if ( cache->entry[cache->n].name == NULL ){
+            return -1;
+        }
+    }
+    cache->n ++;
+    return 0;
+}
+
+/*
+ * Entries of a mapped file, an invalid
+ * file is discarded as a whole.
+ */
+static int __map ( tandem_cache_t * cache ){
+    FILE * file;
+    tandem_header_t header;
+    struct stat st;
+    char * map;
+    long offset;
+
+    file = fopen ( cache->filename, "r" );
+    if ( file == NULL ) {
+        return 0;
+    }
+
+    // Written by a different version or platform
+    if ( fread ( &header, sizeof ( tandem_header_t ), 1, file ) != 1 ||
+         memcmp ( header.magic, TANDEM_MAGIC, sizeof ( header.magic ) ) != 0 ||
+         header.version != TANDEM_VERSION || header.byte_order != 0x01020304 ||
+         header.tandem_size != sizeof ( tandem_t ) || fstat ( fileno ( file ), &st ) != 0 ) {
+        fclose ( file );
+        return 0;
+    }
+
+    map = mmap ( NULL, st.st_size, PROT_READ, MAP_SHARED, fileno ( file ), 0 );
+    fclose ( file );
+    if ( map == MAP_FAILED ) {
+        return 0;
+    }
+    cache->map = map;
+    cache->map_size = st.st_size;
+
+    // Entries follow the header
+    offset = sizeof ( tandem_header_t );
+    while ( offset < st.st_size ) {
+        tandem_record_t * record = ( tandem_record_t * ) &map[offset];
+        tandem_entry_t entry;
+        long total;
+
+        if ( st.st_size - offset < ( long ) sizeof ( tandem_record_t ) ||
+             record->length < 0 || record->n < 0 || record->name_size <= 0 ) {
+            cache->n = 0;
+            return 0;
+        }
+        total = sizeof ( tandem_record_t ) + record->name_size + record->n * sizeof ( tandem_t );
+        if ( total > st.st_size - offset ||
+             map[offset + sizeof ( tandem_record_t ) + record->name_size - 1] != '\0' ) {
+            cache->n = 0;
+            return 0;
+        }
+
+        // Tandems point into the mapped file
+        entry.name = &map[offset + sizeof ( tandem_record_t )];
+        entry.length = record->length;
+        entry.checksum = record->checksum;
+        entry.max_motif = record->max_motif;
+        entry.max_repetition = record->max_repetition;
+        entry.n = record->n;
+        entry.set = ( tandem_t * ) &map[offset + sizeof ( tandem_record_t ) + record->name_size];
+        entry.mapped = true;
+        if ( __insert ( &entry, cache ) != 0 ) {
+            return -1;
+        }
+        offset += total;
+    }
+
+    cache->stored = cache->n;
+    return 0;
+}
+
+tandem_cache_t * tandem_cache_open ( char * filename ){
+    tandem_cache_t * cache = malloc ( sizeof ( tandem_cache_t ) );
+    if ( cache == NULL ){
+        return NULL;
+    }
+
+    cache->entry = NULL;
+    cache->n = 0;
+    cache->size = 0;
+    cache->stored = 0;
+    cache->map = NULL;
+    cache->map_size = 0;
+    pthread_mutex_init ( &cache->lock, NULL );
+    cache->filename = malloc ( sizeof ( char ) * ( strlen ( filename ) + strlen ( TANDEM_SUFFIX ) + 1 ) );
+    if ( cache->filename == NULL ){
+        tandem_cache_destroy ( cache );
+        return NULL;
+    }
+    sprintf ( cache->filename, "%s%s", filename, TANDEM_SUFFIX );
+
+    if ( __map ( cache ) != 0 ){
+        tandem_cache_destroy ( cache );
+        return NULL;
+    }
+
+    return cache;
+}
+
+tandem_set_t * tandem_cache_analyze ( char * name, char * reference, int length, int max_motif, int max_repetition, int threads, tandem_set_t * set, tandem_cache_t * cache ){
+    uint32_t checksum = crc32 ( crc32 ( 0L, Z_NULL, 0 ), ( const Bytef * ) reference, length );
+    tandem_entry_t entry = { 0 };
+    bool found = false;
+
+    pthread_mutex_lock ( &cache->lock );
+    for ( int e = 0; e < cache->n && ! found; e ++ ){
+        tandem_entry_t * c = &cache->entry[e];
+        if ( c->length == length && c->checksum == checksum &&
+             c->max_motif == max_motif && c->max_repetition == max_repetition &&
+             strcmp ( c->name, name ) == 0 ){
+            entry = *c;
+            found = true;
+        }
+    }
+    pthread_mutex_unlock ( &cache->lock );
+
+    // Shared annotation
+    if ( found ){
+        if ( set == NULL ){
+            set = malloc ( sizeof ( tandem_set_t ) );
+            if ( set == NULL ){
+                return NULL;
+            }
+        }
+        else if ( ! set->mapped ){
+            free ( set->set );
+        }
+        set->set = entry.set;
+        set->n = entry.n;
+        set->size = entry.n;
+        set->i = 0;
+        set->max_motif = max_motif;
+        set->max_repetition = max_repetition;
+        set->mapped = true;
+        return set;
+    }
+
+    set = tandem_set_init ( length, max_motif, max_repetition, set );
+    set = tandem_set_analyze ( reference, length, threads, set );
+    if ( set == NULL ){
+        return NULL;
+    }
+
+    // New annotation, the tandems are copied
+    entry.name = name;
+    entry.length = length;
+    entry.checksum = checksum;
+    entry.max_motif = max_motif;
+    entry.max_repetition = max_repetition;
+    entry.n = set->n;
+    entry.set = malloc ( sizeof ( tandem_t ) * ( set->n + 1 ) );
+    entry.mapped = false;
+    if ( entry.set == NULL ){
+        return NULL;
+    }
+    memcpy ( entry.set, set->set, sizeof ( tandem_t ) * set->n );
+    pthread_mutex_lock ( &cache->lock );
+    if ( __insert ( &entry, cache ) != 0 ){
+        free ( entry.set );
+        set = NULL;
+    }
+    pthread_mutex_unlock ( &cache->lock );
+
+    return set;
+}
+
+int tandem_cache_write ( tandem_cache_t * cache ){
+    tandem_header_t header;
+    char padding[TANDEM_ALIGNMENT] = { 0 };
+    FILE * file;
+    char * tmp_fn;
+    int ret = 0;
+
+    // Nothing new
+    if ( cache->n == cache->stored ){
+        return 0;
+    }
+
+    tmp_fn = malloc ( sizeof ( char ) * ( strlen ( cache->filename ) + 24 ) );
+    if ( tmp_fn == NULL ){
+        return -1;
+    }
+    sprintf ( tmp_fn, "%s.%ld", cache->filename, ( long ) getpid () );
+    file = fopen ( tmp_fn, "w" );
+    if ( file == NULL ){
+        free ( tmp_fn );
+        return -1;
+    }
+
+    memset ( &header, 0, sizeof ( tandem_header_t ) );
+    memcpy ( header.magic, TANDEM_MAGIC, sizeof ( header.magic ) );
+    header.version = TANDEM_VERSION;
+    header.byte_order = 0x01020304;
+    header.tandem_size = sizeof ( tandem_t );
+    if ( fwrite ( &header, sizeof ( tandem_header_t ), 1, file ) != 1 ){
+        ret = -1;
+    }
+
+    // Mapped entries are written again, followed by the new ones
+    for ( int e = 0; e < cache->n && ret == 0; e ++ ){
+        tandem_entry_t * entry = &cache->entry[e];
+        tandem_record_t record;
+        long name_len = strlen ( entry->name );
+
+        memset ( &record, 0, sizeof ( tandem_record_t ) );
+        record.length = entry->length;
+        record.name_size = __padded ( name_len + 1 );
+        record.n = entry->n;
+        record.max_motif = entry->max_motif;
+        record.max_repetition = entry->max_repetition;
+        record.checksum = entry->checksum;
+        if ( fwrite ( &record, sizeof ( tandem_record_t ), 1, file ) != 1 ||
+             fwrite ( entry->name, sizeof ( char ), name_len, file ) != ( size_t ) name_len ||
+             fwrite ( padding, sizeof ( char ), record.name_size - name_len, file ) != ( size_t ) ( record.name_size - name_len ) ||
+             ( entry->n > 0 && fwrite ( entry->set, sizeof ( tandem_t ), entry->n, file ) != ( size_t ) entry->n ) ){
+            ret = -1;
+        }
+    }
+
+    if ( fclose ( file ) != 0 ){
+        ret = -1;
+    }
+    if ( ret == 0 && rename ( tmp_fn, cache->filename ) != 0 ){
+        ret = -1;
+    }
+    if ( ret != 0 ){
+        remove ( tmp_fn );
+    }
+    else {
+        cache->stored = cache->n;
+    }
+
+    free ( tmp_fn );
+    return ret;
+}
+
+void tandem_cache_destroy ( tandem_cache_t * cache ){
+    if ( cache == NULL ){
+        return;
+    }
+    for ( int e = 0; e < cache->n; e ++ ){
+        if ( ! cache->entry[e].mapped ){
+            free ( cache->entry[e].name );
+            free ( cache->entry[e].set );
+        }
+    }
+    free ( cache->entry );
+    if ( cache->map != NULL ){
+        munmap ( cache->map, cache->map_size );
+    }
+    pthread_mutex_destroy ( &cache->lock );
+    free ( cache->filename );
+    free ( cache );
+}
@@ -17,6 +17,7 @@
 #include <zlib.h>
 #include <htslib/kseq.h>
 #include <time.h>
+#include <pthread.h>
 #include "allele.h"
 #include "parse_frequency.h"
 #include "wrapper.h"
@@ -24,14 +25,255 @@
 // Init kseq structure
 KSEQ_INIT ( gzFile, gzread );
 
+typedef struct contig_t contig_t;
+typedef struct variator_t variator_t;
+typedef struct worker_t worker_t;
+
+/*
+ * Unit of work, a sequence of the reference
+ * and the alleles generated from it.
+ */
+struct contig_t {
+    char * name; // name of the sequence
+    char * seq; // reference sequence
+    long len; // length of the sequence
+    int index; // order in the FASTA file
+    FILE ** output; // alignment and sequence of each allele, temporary if owned
+    bool owned; // the output files belong to the contig
+    bool done; // alleles generated
+    contig_t * next; // next contig in the queue
+};
+
+/*
+ * Options and queue of contigs
+ * shared by the workers.
+ */
+struct variator_t {
+    int ploidy; // number of alleles
+    uint64_t seed; // seed of the pseudorandom streams
+    contig_t * head; // first contig to be written
+    contig_t * todo; // first contig not taken by a worker
+    contig_t * tail; // last contig in the queue
+    int queued; // contigs not yet written
+    bool finished; // no more contigs will be queued
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/*
+ * State of a thread, each worker has
+ * its own readers and alleles.
+ */
+struct worker_t {
+    variator_t * var; // shared data
+    pthread_t thread;
+    wrapper_t * w; // readers of the variations
+    allele_t ** allele;
+    // Statistics
+    unsigned long int done;
+    unsigned long int igno;
+    unsigned long int udv_collision;
+    unsigned long int vcf_collision;
+};
+
 void usage ( char * name ) {
-    fprintf ( stderr, "Usage: %s [-n number of alleles] [-u udv_file] [-o output_name] fasta_file vcf_file\n", name );
+    fprintf ( stderr, "Usage: %s [-n number of alleles] [-u udv_file] [-o output_name] [-S seed] [-t threads] fasta_file vcf_file\n", name );
+}
+
+/*
+ * Applies the variations of a contig to
+ * each allele, writing the alleles in the
+ * temporary files of the contig.
+ */
+void vary_contig ( worker_t * wk, contig_t * contig ) {
+    int ploidy = wk->var->ploidy;
+    wrapper_t * w = wk->w;
+    allele_t ** allele = wk->allele;
+    FILE ** output = contig->output;
+    long gap;
+
+    // Reset allele
+    for ( int i = 0; i < ploidy; i++ ) {
+        allele[i] = allele_stream ( output[i+ploidy], allele[i] );
+        fprintf ( output[i+ploidy], ">%s\n", contig->name );
+    }
+    // Stream of the sequence
+    rng_init ( wk->var->seed, contig->index, 0, &w->rng );
+    // Seek to the desired region
+    if ( wr_seek ( w, contig->name ) ) {
+        // Up to the end of the region
+        while ( wr_region ( w ) ) {
+            if ( wr_update_wrapper ( w ) ) {
+                // Per allele
+                for ( int i = 0; i < ploidy; i++ ) {
+                    // Don't "apply" reference
+                    if ( w->alt_index[i] < 0 ) {
+                        wk->igno ++;
+                        continue;
+                    }
+
+                    // Gap between variations
+                    gap = w->pos - allele[i]->ref;
+
+                    // Avoid collision
+                    if ( gap < 0 ){
+                        //  Keep track of the collision number
+                        wk->vcf_collision ++;
+                        continue;
+                    }
+
+                    // Distance between the reference and the variation pointers
+                    if ( gap > 0 ) {
+                        /*
+                         * The variation starts far from the current
+                         * reference position, what is in between can
+                         * be copied without any mutation.
+                         */
+                        if ( allele_copy ( &contig->seq[allele[i]->ref], gap, allele[i] ) != 0 ) {
+                            fprintf ( stderr, "Can't write the alleles.\n" );
+                            exit ( EXIT_FAILURE );
+                        }
+                    }
+
+                    // Alternative
+                    if ( allele_variation (
+                                    w->ref,
+                                    w->alt[w->alt_index[i]],
+                                    allele[i] ) != 0 ) {
+                        fprintf ( stderr, "Can't write the alleles.\n" );
+                        exit ( EXIT_FAILURE );
+                    }
+
+                    wk->done ++;
+                }
+            } else {
+                wk->udv_collision++;
+            }
+        }
+    }
+    // Copy of the remaining part of the sequence
+    for ( int i = 0; i < ploidy; i++ ) {
+        gap = contig->len - allele[i]->ref;
+        if ( ( gap > 0 && allele_copy ( &contig->seq[allele[i]->ref], gap, allele[i] ) != 0 ) ||
+             allele_flush ( allele[i] ) != 0 ) {
+            fprintf ( stderr, "Can't write the alleles.\n" );
+            exit ( EXIT_FAILURE );
+        }
+        // End of the sequence
+        fprintf ( output[i+ploidy], "\n" );
+    }
+    // Write of the alignment on file
+    for ( int i = 0; i < ploidy; i++ ) {
+        fprintf ( output[i], ">%s\n", contig->name );
+        allele_write ( output[i], allele[i] );
+        fprintf ( output[i], "\n" );
+    }
+}
+
+/*
+ * Worker thread, generates the alleles of
+ * the contigs in the queue until it's closed.
+ */
+void * worker ( void * arg ) {
+    worker_t * wk = arg;
+    variator_t * var = wk->var;
+    contig_t * contig;
+
+    while ( true ) {
+        pthread_mutex_lock ( &var->lock );
+        while ( var->todo == NULL && ! var->finished ) {
+            pthread_cond_wait ( &var->cond, &var->lock );
+        }
+        contig = var->todo;
+        if ( contig == NULL ) {
+            pthread_mutex_unlock ( &var->lock );
+            break;
+        }
+        var->todo = contig->next;
+        pthread_mutex_unlock ( &var->lock );
+
+        vary_contig ( wk, contig );
+
+        pthread_mutex_lock ( &var->lock );
+        contig->done = true;
+        pthread_cond_broadcast ( &var->cond );
+        pthread_mutex_unlock ( &var->lock );
+    }
+
+    return NULL;
+}
+
+void contig_destroy ( contig_t * contig, int ploidy ) {
+    if ( contig->owned ) {
+        for ( int i = 0; i < 2 * ploidy; i ++ ) {
+            fclose ( contig->output[i] );
+        }
+        free ( contig->output );
+    }
+    free ( contig->name );
+    free ( contig->seq );
+    free ( contig );
+}
+
+/*
+ * Appends the content of a temporary file.
+ */
+int __append ( FILE * dst, FILE * src ) {
+    char buffer[1 << 16];
+    size_t len;
+
+    rewind ( src );
+    while ( ( len = fread ( buffer, sizeof ( char ), sizeof ( buffer ), src ) ) > 0 ) {
+        if ( fwrite ( buffer, sizeof ( char ), len, dst ) != len ) {
+            return -1;
+        }
+    }
+    return ferror ( src ) ? -1 : 0;
+}
+
+/*
+ * Writes the contigs at the head of the queue in
+ * FASTA order, waiting for them until at most
+ * limit contigs are left in the queue.
+ */
+void write_contigs ( variator_t * var, FILE ** output, bool stats, int limit ) {
+    contig_t * contig;
+
+    pthread_mutex_lock ( &var->lock );
+    while ( var->queued > limit ) {
+        contig = var->head;
+        while ( ! contig->done ) {
+            pthread_cond_wait ( &var->cond, &var->lock );
+        }
+        var->head = contig->next;
+        if ( var->head == NULL ) {
+            var->tail = NULL;
+        }
+        var->queued --;
+        pthread_mutex_unlock ( &var->lock );
+
+        // Label separated by white space
+        if ( stats ) {
+            printf ( "%s\n", contig->name );
+        }
+        for ( int i = 0; i < 2 * var->ploidy; i ++ ) {
+            if ( __append ( output[i], contig->output[i] ) != 0 ) {
+                fprintf ( stderr, "Can't write the alleles.\n" );
+                exit ( EXIT_FAILURE );
+            }
+        }
+        contig_destroy ( contig, var->ploidy );
+
+        pthread_mutex_lock ( &var->lock );
+    }
+    pthread_mutex_unlock ( &var->lock );
 }
 
 int main ( int argc, char ** argv ) {
     // Parsing
     int opt;
     int ploidy = 2;
+    int threads = 1;
     // Filenames
     char * fasta_fn = NULL;
     char * udv_fn = NULL;
@@ -40,11 +282,11 @@ int main ( int argc, char ** argv ) {
     // FASTA
     gzFile fp;
     kseq_t * seq;
-    // Wrapper
-    wrapper_t * w;
-    // Alleles
-    allele_t ** allele;
-    int gap;
+    // Workers
+    variator_t var;
+    worker_t ** workers;
+    contig_t * contig;
+    int index = 0;
     // Output
     FILE ** output;
     char * str;
@@ -56,10 +298,13 @@ int main ( int argc, char ** argv ) {
     unsigned long int vcf_collision = 0;
 
     // Init pseudorandom generator
-    srand ( time ( NULL ) );
+    var.seed = time ( NULL );
 
-    while ( ( opt = getopt ( argc, argv, "sn:u:o:" ) ) != -1 ) {
+    while ( ( opt = getopt ( argc, argv, "sn:u:o:S:t:" ) ) != -1 ) {
         switch ( opt ) {
+        case 'S':
+            var.seed = strtoull ( optarg, NULL, 10 );
+            break;
         case 's':
             stats = true;
             break;
@@ -72,8 +317,15 @@ int main ( int argc, char ** argv ) {
         case 'o':
             out_fn = optarg;
             break;
+        case 't':
+            threads = atoi ( optarg );
+            if ( threads < 1 ) {
+                fprintf ( stderr, "The number of threads must be positive.\n" );
+                exit ( EXIT_FAILURE );
+            }
+            break;
         case '?':
-            if ( optopt == 'u' || optopt == 'o' )
+            if ( optopt == 'n' || optopt == 'u' || optopt == 'o' || optopt == 'S' || optopt == 't' )
                 fprintf ( stderr, "Option -%c requires an argument.\n", optopt );
             else if ( isprint ( optopt ) )
                 fprintf ( stderr, "Unknown option `-%c'.\n", optopt );
@@ -93,14 +345,12 @@ int main ( int argc, char ** argv ) {
     fasta_fn = argv[optind++];
     vcf_fn = argv[optind];
 
+    // Seed needed to reproduce the run
+    fprintf ( stderr, "Seed: %llu\n", ( unsigned long long ) var.seed );
+
     // Allocate
-    allele = malloc ( sizeof ( allele_t * ) * ploidy );
     output = malloc ( sizeof ( FILE * ) * 2 * ploidy );
 
-
-    // Initialize wrapper
-    w = wr_init ( vcf_fn, udv_fn, ploidy );
-
     // FASTA file
     fp = gzopen ( fasta_fn, "r" );
     if ( fp == NULL ) {
@@ -112,6 +362,8 @@ int main ( int argc, char ** argv ) {
     /*
      * Output files, one per allele
      * [filename_0.fa, filename_N.fa)
+     * and the alignments of the alleles
+     * [filename_0.fa.aln, filename_N.fa.aln)
      */
     if ( out_fn == NULL ) {
         out_fn = basename ( fasta_fn );
@@ -119,7 +371,7 @@ int main ( int argc, char ** argv ) {
     }
     str = malloc ( sizeof ( char ) * ( strlen ( out_fn ) + 20 ) );
     for ( int i = 0; i < ploidy; i++ ) {
-        sprintf ( str, "%s_%d.fq", out_fn, i );
+        sprintf ( str, "%s_%d.fa.aln", out_fn, i );
         output[i] = fopen ( str, "w+" );
     }
     for ( int i = 0; i < ploidy; i++ ) {
@@ -127,104 +379,119 @@ int main ( int argc, char ** argv ) {
         output[i+ploidy] = fopen ( str, "w+" );
     }
 
-    // Initialize alleles
-    for ( int i = 0; i < ploidy; i++ ) {
-        allele[i] = allele_init ( 0, NULL );
+    // Queue of the contigs
+    var.ploidy = ploidy;
+    var.head = NULL;
+    var.todo = NULL;
+    var.tail = NULL;
+    var.queued = 0;
+    var.finished = false;
+    pthread_mutex_init ( &var.lock, NULL );
+    pthread_cond_init ( &var.cond, NULL );
+
+    // Pool of workers, each one with its own readers
+    workers = malloc ( sizeof ( worker_t * ) * threads );
+    for ( int t = 0; t < threads; t ++ ) {
+        workers[t] = malloc ( sizeof ( worker_t ) );
+        workers[t]->var = &var;
+        workers[t]->w = wr_init ( vcf_fn, udv_fn, ploidy );
+        if ( workers[t]->w == NULL ) {
+            fprintf ( stderr, "Can't open the variations.\n" );
+            exit ( EXIT_FAILURE );
+        }
+        workers[t]->allele = malloc ( sizeof ( allele_t * ) * ploidy );
+        for ( int i = 0; i < ploidy; i++ ) {
+            workers[t]->allele[i] = allele_stream ( NULL, NULL );
+        }
+        workers[t]->done = 0;
+        workers[t]->igno = 0;
+        workers[t]->udv_collision = 0;
+        workers[t]->vcf_collision = 0;
+        // A single worker runs on the main thread
+        if ( threads > 1 && pthread_create ( &workers[t]->thread, NULL, worker, workers[t] ) != 0 ) {
+            fprintf ( stderr, "Can't create the threads.\n" );
+            exit ( EXIT_FAILURE );
+        }
     }
 
     // While there are sequences to read in the FASTA file
     while ( kseq_read ( seq ) >= 0 ) {
-        // Resize allele
-        for ( int i = 0; i < ploidy; i++ ) {
-            allele[i] = allele_init ( seq->seq.l, allele[i] );
+        contig = malloc ( sizeof ( contig_t ) );
+        contig->name = strdup ( seq->name.s );
+        // The sequence is taken from the parser, that allocates a new one
+        contig->seq = seq->seq.s;
+        contig->len = seq->seq.l;
+        seq->seq.s = NULL;
+        seq->seq.l = 0;
+        seq->seq.m = 0;
+        contig->index = index ++;
+
+        // Alleles written straight to the output files
+        if ( threads == 1 ) {
+            contig->output = output;
+            contig->owned = false;
+            vary_contig ( workers[0], contig );
+            // Label separated by white space
+            if ( stats ) {
+                printf ( "%s\n", contig->name );
+            }
+            contig_destroy ( contig, ploidy );
+            continue;
         }
-        // Label separated by white space
-        if ( stats )
-            printf ( "%s\n", seq->name.s );
-        // Seek to the desired region
-        if ( wr_seek ( w, seq->name.s ) ) {
-            // Up to the end of the region
-            while ( wr_region ( w ) ) {
-                if ( wr_update_wrapper ( w ) ) {
-                    // Per allele
-                    for ( int i = 0; i < ploidy; i++ ) {
-                        // Don't "apply" reference
-                        if ( w->alt_index[i] < 0 ) {
-                            igno ++;
-                            continue;
-                        }
 
-                        // Gap between variations
-                        gap = w->pos - allele[i]->ref;
+        contig->owned = true;
+        contig->output = malloc ( sizeof ( FILE * ) * 2 * ploidy );
+        for ( int i = 0; i < 2 * ploidy; i ++ ) {
+            contig->output[i] = tmpfile ();
+            if ( contig->output[i] == NULL ) {
+                perror ( "Can't create temporary file" );
+                exit ( EXIT_FAILURE );
+            }
+        }
+        contig->done = false;
+        contig->next = NULL;
 
-                        // Avoid collision
-                        if ( gap < 0 ){
-                            //  Keep track of the collision number
-                            if ( stats ){
-                                vcf_collision ++;
-                            }
-                            continue;
-                        }
+        // Bounded queue, a contig per thread
+        write_contigs ( &var, output, stats, threads - 1 );
 
-                        // Distance between the reference and the variation pointers
-                        if ( gap > 0 ) {
-                            /*
-                             * The variation starts far from the current
-                             * reference position, what is in between can
-                             * be copied without any mutation.
-                             */
-                            memcpy (
-                                &allele[i]->sequence[allele[i]->pos],
-                                &seq->seq.s[allele[i]->ref],
-                                sizeof ( char ) * gap
-                            );
-                            memset ( 
-                                &allele[i]->alignment[allele[i]->alg],
-                                '=',
-                                sizeof ( char ) * gap
-                            );
-                            // Update position
-                            allele[i]->pos += gap;
-                            allele[i]->alg += gap;
-                            allele[i]->ref += gap;
-                        }
+        pthread_mutex_lock ( &var.lock );
+        if ( var.tail == NULL ) {
+            var.head = contig;
+        } else {
+            var.tail->next = contig;
+        }
+        var.tail = contig;
+        if ( var.todo == NULL ) {
+            var.todo = contig;
+        }
+        var.queued ++;
+        pthread_cond_broadcast ( &var.cond );
+        pthread_mutex_unlock ( &var.lock );
+    }
 
-                        // Alternative
-                        allele_variation (
-                                        w->ref,
-                                        w->alt[w->alt_index[i]],
-                                        allele[i] );
+    // No more contigs
+    pthread_mutex_lock ( &var.lock );
+    var.finished = true;
+    pthread_cond_broadcast ( &var.cond );
+    pthread_mutex_unlock ( &var.lock );
+    write_contigs ( &var, output, stats, 0 );
 
-                        done ++;
-                    }
-                } else if ( stats ) {
-                    udv_collision++;
-                }
-            }
-        }
-        // Copy of the remaining part of the sequence
-        for ( int i = 0; i < ploidy; i++ ) {
-            allele_variation (
-                &seq->seq.s[allele[i]->ref],
-                &seq->seq.s[allele[i]->ref],
-                allele[i]
-            );
-            // End of the sequence
-            allele[i]->sequence[allele[i]->pos] = '\0';
-            allele[i]->alignment[allele[i]->alg] = '\0';
-        }
-        // Write of the sequence on file
-        for ( int i = 0; i < ploidy; i++ ) {
-            fprintf ( output[i], ">%s\n", seq->name.s );
-            fprintf ( output[i], "%s\n", allele[i]->sequence );
-            fprintf ( output[i], "+\n" );
-            fprintf ( output[i], "%s\n", allele[i]->alignment );
+    for ( int t = 0; t < threads; t ++ ) {
+        if ( threads > 1 ) {
+            pthread_join ( workers[t]->thread, NULL );
         }
+        done += workers[t]->done;
+        igno += workers[t]->igno;
+        udv_collision += workers[t]->udv_collision;
+        vcf_collision += workers[t]->vcf_collision;
         for ( int i = 0; i < ploidy; i++ ) {
-            fprintf ( output[i+ploidy], ">%s\n", seq->name.s );
-            fprintf ( output[i+ploidy], "%s\n", allele[i]->sequence );
+            allele_destroy ( workers[t]->allele[i] );
         }
+        free ( workers[t]->allele );
+        wr_destroy ( workers[t]->w );
+        free ( workers[t] );
     }
+
     if ( stats ) {
         unsigned long int sum = done + igno + vcf_collision + udv_collision;
         printf ( "DONE:\t%lu\t%.2f\n", done, done * 100.0 / sum );
@@ -234,17 +501,15 @@ int main ( int argc, char ** argv ) {
     }
 
     // Cleanup
-    for ( int i = 0; i < ploidy; i++ ) {
-        allele_destroy ( allele[i] );
-    }
     for ( int i = 0; i < ( 2 * ploidy ); i++ ) {
         fclose ( output[i] );
     }
-    free ( allele );
+    free ( workers );
     free ( output );
     free ( str );
     kseq_destroy ( seq );
     gzclose ( fp );
-    wr_destroy ( w );
+    pthread_mutex_destroy ( &var.lock );
+    pthread_cond_destroy ( &var.cond );
     exit ( EXIT_SUCCESS );
 }
@@ -11,9 +11,6 @@
 #include "wrapper.h"
 #include "parse_frequency.h"
 
-// Global variables
-double * p = NULL;
-
 wrapper_t * wr_init ( char * vcf_filename, char * udv_filename, int ploidy ) {
     wrapper_t * w;
     // At least a filename is required
@@ -31,8 +28,11 @@ wrapper_t * wr_init ( char * vcf_filename, char * udv_filename, int ploidy ) {
     w->used = 0;
     w->udv = NULL;
     w->udv_line = NULL;
+    w->sr = NULL;
+    w->p = NULL;
     w->ploidy = ploidy;
     w->alt_index = malloc ( sizeof ( int ) * ploidy );
+    rng_init ( 0, 0, 0, &w->rng );
 
     // VCF
     if ( vcf_filename != NULL ) {
@@ -186,25 +186,25 @@ bool _vcf2wrapper ( wrapper_t * w ) {
     freq_ret = bcf_get_info_string ( w->hdr, w->vcf_line, "FREQ", &freq, &freq_size );
     // Parse results
     if ( af_ret >= 0  ) {
-        p = parse_af ( w->vcf_line->n_allele, af, p );
+        w->p = parse_af ( w->vcf_line->n_allele, af, w->p );
         free ( af );
     } else if ( freq_ret >= 0 ) {
-        p = parse_db_snp_freq ( w->vcf_line->n_allele, freq, p );
+        w->p = parse_db_snp_freq ( w->vcf_line->n_allele, freq, w->p );
         free ( freq );
     } else {
-        p = linear ( w->vcf_line->n_allele, p );
+        w->p = linear ( w->vcf_line->n_allele, w->p );
     }
 
     for ( int i = 0; i < w->ploidy; i++ ) {
         // Random decision about the alternatives
-        outcome = ( double ) rand() / RAND_MAX;
+        outcome = rng_uniform ( &w->rng );
         threshold = 0;
         for ( int j = 0; j < w->vcf_line->n_allele; j++ ) {
-            if ( threshold <= outcome && outcome < threshold + p[j] ) {
+            if ( threshold <= outcome && outcome < threshold + w->p[j] ) {
                 w->alt_index[i] = j - 1;
                 break;
             } else {
-                threshold += p[j];
+                threshold += w->p[j];
             }
         }
     }
@@ -256,13 +256,14 @@ bool wr_update_wrapper ( wrapper_t * w ) {
 
 void wr_destroy ( wrapper_t * w ) {
     // VCF
-    bcf_sr_destroy ( w->sr );
+    if ( w->sr != NULL )
+        bcf_sr_destroy ( w->sr );
     // UDV
     if ( w->udv != NULL )
         udv_destroy ( w->udv );
     // Wrapper
     free ( w->alt_index );
+    free ( w->p );
     free ( w );
-    free ( p );
     return;
 }
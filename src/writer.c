@@ -0,0 +1,104 @@
+/*
+ * CNRSIM
+ * writer.c
+ * Output stage of the simulator, formats
+ * the reads in FASTQ records and writes them
+ * on a BGZF compressed stream.
+ *
+ * @author Riccardo Massidda
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "writer.h"
+
+// Blocks queued in the shared thread pool
+#define WRITER_QUEUE 256
+
+writer_t * writer_open ( char * filename, hts_tpool * pool ) {
+    writer_t * writer = malloc ( sizeof ( writer_t ) );
+    if ( writer == NULL ) {
+        return NULL;
+    }
+
+    // Standard output is left uncompressed
+    if ( filename == NULL ) {
+        writer->fp = bgzf_open ( "-", "wu" );
+    } else {
+        writer->fp = bgzf_open ( filename, "w" );
+    }
+    if ( writer->fp == NULL ) {
+        free ( writer );
+        return NULL;
+    }
+
+    // Compression in background
+    if ( filename != NULL && pool != NULL ) {
+        bgzf_thread_pool ( writer->fp, pool, WRITER_QUEUE );
+    }
+
+    return writer;
+}
+
+static void __append ( const char * s, size_t len, fastq_buffer_t * buffer ) {
+    memcpy ( &buffer->data[buffer->len], s, len );
+    buffer->len += len;
+}
+
+int writer_format ( char * name, int unit, long id, long pos, bool reverse, read_batch_t * batch, int k, fastq_buffer_t * buffer ) {
+    char * read = &batch->read[( long ) k * batch->stride];
+    unsigned char * quality = &batch->quality[( long ) k * batch->stride];
+    size_t name_len = strlen ( name );
+    size_t read_len = batch->length[k];
+    char * data;
+    char number[80];
+    int number_len = sprintf ( number, ":%d:%ld %ld", unit, id, pos );
+
+    // Header, sequence, separator and quality
+    size_t required = buffer->len + name_len + number_len + 2 * read_len + 16;
+    if ( required > buffer->size ) {
+        size_t size = ( required > 2 * buffer->size ) ? required : 2 * buffer->size;
+        data = realloc ( buffer->data, sizeof ( char ) * size );
+        if ( data == NULL ) {
+            return -1;
+        }
+        buffer->data = data;
+        buffer->size = size;
+    }
+
+    // @name:unit:id pos strand
+    __append ( "@", 1, buffer );
+    __append ( name, name_len, buffer );
+    __append ( number, number_len, buffer );
+    __append ( ( reverse ) ? " -\n" : " +\n", 3, buffer );
+    // Sequence, in the order of the strand
+    char * seq = &buffer->data[buffer->len];
+    for ( size_t j = 0; j < read_len; j ++ ) {
+        seq[j] = read[( reverse ) ? read_len - j - 1 : j];
+    }
+    buffer->len += read_len;
+    __append ( "\n+\n", 3, buffer );
+    // Printable quality
+    char * qual = &buffer->data[buffer->len];
+    for ( size_t j = 0; j < read_len; j ++ ) {
+        qual[j] = quality[( reverse ) ? read_len - j - 1 : j] + 33;
+    }
+    buffer->len += read_len;
+    __append ( "\n", 1, buffer );
+
+    return 0;
+}
+
+int writer_write ( fastq_buffer_t * buffer, writer_t * writer ) {
+    if ( buffer->len > 0 && bgzf_write ( writer->fp, buffer->data, buffer->len ) < 0 ) {
+        return -1;
+    }
+    buffer->len = 0;
+    return 0;
+}
+
+int writer_close ( writer_t * writer ) {
+    int ret = bgzf_close ( writer->fp );
+    free ( writer );
+    return ( ret == 0 ) ? 0 : -1;
+}